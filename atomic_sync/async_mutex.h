@@ -0,0 +1,254 @@
+#pragma once
+#include <coroutine>
+#include "atomic_shared_mutex.h"
+
+/*
+
+Acquisition of atomic_mutex and atomic_shared_mutex in C++20 coroutines.
+
+A lock that is waited for by coroutines must use async_mutex_storage:
+
+  atomic_mutex<async_mutex_storage<>> m;
+  atomic_shared_mutex<shared_mutex_storage<uint32_t,
+                      shared_mutex_policy::prefer_writer,
+                      async_mutex_storage<>>> sux;
+
+  co_await m.async_lock();
+  m.unlock();
+  co_await sux.async_lock_shared();
+  sux.unlock_shared();
+
+The lock word is that of mutex_storage, and the blocking operations,
+such as lock(), spin_lock() and try_lock_for(), remain available, so
+threads and coroutines may wait for the same lock.
+
+An uncontended lock is acquired in await_ready() by the same single
+atomic operation as in lock(). Under contention, the coroutine is
+registered as a waiter in the lock word and suspended in a FIFO queue.
+unlock() will acquire the lock on behalf of the first suspended
+coroutine and hand the coroutine over to an async_executor, instead of
+waking up a blocked thread. Threads that are blocked in lock() will be
+woken up when no coroutines are waiting.
+
+async_lock_shared() and async_lock_update() only wait for the outer
+mutex. async_lock() of atomic_shared_mutex may block the thread while
+shared locks that were granted earlier are being released, like
+lock_update() followed by update_lock_upgrade(). The phase_fair policy,
+in which lock_shared() waits on the inner lock word, is not supported,
+and it is rejected at compilation time.
+
+*/
+
+/** Where a coroutine will be resumed once it has been granted a lock */
+struct async_executor
+{
+  /** the executor, for post */
+  void *context;
+  /** Resume a coroutine, or schedule it for resumption */
+  void (*post)(void *context, std::coroutine_handle<> h) noexcept;
+};
+
+/** Resume coroutines in the thread that invokes unlock() */
+inline constexpr async_executor inline_executor
+{
+  nullptr, [](void*, std::coroutine_handle<> h) noexcept { h.resume(); }
+};
+
+/** @return an async_executor that invokes e.post(h)
+@param e  an executor that outlives the waits on locks */
+template<class Executor> async_executor make_async_executor(Executor &e)
+  noexcept
+{
+  return async_executor
+  {
+    &e, [](void *context, std::coroutine_handle<> h) noexcept
+    { static_cast<Executor*>(context)->post(h); }
+  };
+}
+
+/** A suspended coroutine in async_mutex_storage */
+struct async_mutex_waiter
+{
+  /** the next waiter in the queue */
+  async_mutex_waiter *next;
+  /** the suspended coroutine */
+  std::coroutine_handle<> handle;
+  /** where handle will be resumed */
+  async_executor executor;
+};
+
+/** Storage for atomic_mutex that supports atomic_mutex::async_lock().
+Like other Storage, this is expected to be zero-initialized.
+@tparam T  the type of the lock word */
+template<typename T = uint32_t>
+class async_mutex_storage
+{
+  mutex_storage<T> storage;
+  /** protects head and tail */
+  atomic_mutex<> queue_mutex;
+  /** the oldest suspended coroutine */
+  async_mutex_waiter *head;
+  /** the most recently suspended coroutine */
+  async_mutex_waiter *tail;
+
+  static constexpr T HOLDER = mutex_storage<T>::HOLDER;
+  static constexpr T WAITER = mutex_storage<T>::WAITER;
+
+public:
+  bool is_locked() const noexcept { return storage.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return storage.is_locked_or_waiting(); }
+  bool is_locked_not_waiting() const noexcept
+  { return storage.is_locked_not_waiting(); }
+
+  /** The awaitable of atomic_mutex::async_lock() */
+  class awaiter
+  {
+    async_mutex_storage &s;
+    async_mutex_waiter w;
+  public:
+    awaiter(async_mutex_storage &s, const async_executor &e) noexcept : s(s)
+    { w.executor = e; }
+    awaiter(const awaiter &) = delete;
+
+    /** @return whether the mutex was acquired without waiting */
+    bool await_ready() noexcept { return s.lock_impl(); }
+    /** Wait for the mutex after await_ready() returned false
+    @return whether the coroutine was suspended */
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      w.handle = h;
+      return s.async_lock_wait(w);
+    }
+    /** The mutex has been acquired */
+    void await_resume() noexcept {}
+  };
+
+private:
+  friend class atomic_mutex<async_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds()
+  { return mutex_storage<T>::default_spin_rounds(); }
+
+  bool lock_impl() noexcept { return storage.lock_impl(); }
+  void lock_wait() noexcept { storage.lock_wait(); }
+  void lock_requeued() noexcept { storage.lock_requeued(); }
+  bool requeue(std::atomic<uint32_t> &word, uint32_t val, T n) noexcept
+  { return storage.requeue(word, val, n); }
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return storage.lock_wait_until(deadline); }
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept
+  { return storage.spin_lock_wait(spin_rounds); }
+
+  /** @return the awaitable for acquiring the mutex
+  @param e  where the coroutine will be resumed */
+  awaiter async_lock(const async_executor &e = inline_executor) noexcept
+  { return awaiter{*this, e}; }
+
+  /** Register a coroutine as a waiter, and suspend it unless the mutex
+  can be acquired
+  @param w  the waiter
+  @return whether the coroutine was suspended */
+  bool async_lock_wait(async_mutex_waiter &w) noexcept
+  {
+    storage.m.fetch_add(WAITER, std::memory_order_relaxed);
+    queue_mutex.lock();
+    /* Because unlock_notify() will acquire queue_mutex, it cannot miss w. */
+    const bool suspend =
+      storage.m.fetch_or(HOLDER, std::memory_order_acquire) & HOLDER;
+    if (suspend)
+    {
+      w.next = nullptr;
+      if (tail)
+        tail->next = &w;
+      else
+        head = &w;
+      tail = &w;
+    }
+    queue_mutex.unlock();
+    return suspend;
+  }
+
+  bool unlock_impl() noexcept { return storage.unlock_impl(); }
+  /** Notify waiters after unlock_impl() returned true: grant the
+  mutex to the oldest suspended coroutine, or wake up a thread */
+  void unlock_notify() noexcept
+  {
+    queue_mutex.lock();
+    async_mutex_waiter *w = head;
+    if (!w)
+    {
+      queue_mutex.unlock();
+      storage.unlock_notify();
+      return;
+    }
+    if (storage.m.fetch_or(HOLDER, std::memory_order_acquire) & HOLDER)
+    {
+      /* Someone else acquired the mutex; its unlock() will notify us. */
+      queue_mutex.unlock();
+      return;
+    }
+    head = w->next;
+    if (!head)
+      tail = nullptr;
+    queue_mutex.unlock();
+    w->executor.post(w->executor.context, w->handle);
+  }
+};
+
+/** The awaitable of atomic_shared_mutex::async_lock_shared(),
+async_lock_update() and async_lock()
+@tparam Storage  shared_mutex_storage whose Outer is async_mutex_storage
+@tparam mode     the kind of lock */
+template<typename Storage, async_lock_mode mode>
+class async_shared_lock
+{
+  static_assert(Storage::scheduling != shared_mutex_policy::phase_fair,
+                "async_lock_shared() does not support phase_fair");
+  Storage &s;
+  /** the awaitable for acquiring the outer mutex */
+  decltype(s.async_lock_outer(inline_executor)) outer;
+  /** whether the lock was acquired by await_ready() */
+  bool acquired = false;
+
+public:
+  async_shared_lock(Storage &s, const async_executor &e = inline_executor)
+    noexcept : s(s), outer(s.async_lock_outer(e)) {}
+  async_shared_lock(const async_shared_lock &) = delete;
+
+  /** @return whether the outer mutex or the shared lock was acquired
+  without waiting */
+  bool await_ready() noexcept
+  {
+    if (mode == async_lock_mode::shared && (acquired = s.shared_lock_inner()))
+      return true;
+    return s.try_lock_outer();
+  }
+  /** Wait for the outer mutex after await_ready() returned false
+  @return whether the coroutine was suspended */
+  bool await_suspend(std::coroutine_handle<> h) noexcept
+  { return outer.await_suspend(h); }
+  /** Acquire the lock while holding the outer mutex */
+  void await_resume() noexcept
+  {
+    if (acquired)
+      return;
+    switch (mode) {
+    case async_lock_mode::shared:
+      /* Only the holder of outer may set the exclusive lock. */
+      acquired = s.shared_lock_inner();
+      assert(acquired);
+      s.unlock_outer();
+      return;
+    case async_lock_mode::update:
+      s.update_lock_inner();
+      return;
+    case async_lock_mode::exclusive:
+      if (auto lk = s.lock_inner())
+        s.lock_inner_wait(lk);
+      return;
+    }
+  }
+};
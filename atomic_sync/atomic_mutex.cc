@@ -1,40 +1,56 @@
 #include "atomic_shared_mutex.h"
+#ifdef __cpp_impl_coroutine
+# include "async_mutex.h"
+#endif
 
-#if !defined _WIN32 && __cplusplus < 202002L
-/* Emulate the C++20 primitives */
-# include <climits>
-# if defined __linux__
-#  include <linux/futex.h>
-#  include <unistd.h>
-#  include <sys/syscall.h>
-#  define FUTEX(op,m,n)                                                 \
-   syscall(SYS_futex, m, FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, 0)
-# elif defined __OpenBSD__
-#  include <sys/time.h>
-#  include <sys/futex.h>
-#  define FUTEX(op,m,n)                                                 \
-   futex((volatile uint32_t*) m, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __FreeBSD__
-#   include <sys/types.h>
-#   include <sys/umtx.h>
-#   define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
-#   define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
-#   define FUTEX(op,m,n) _umtx_op(m, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __DragonFly__
-#   include <unistd.h>
-#   define FUTEX_WAKE(m,n) umtx_wakeup(m,n)
-#   define FUTEX_WAIT(m,n) umtx_sleep(m,n,0)
-#   define FUTEX(op,m,n) FUTEX_ ## op((volatile int*) m, int(n))
-# else
-#  error "no C++20 nor futex support"
-# endif
-template<>
-void mutex_storage<uint32_t>::notify_one() noexcept {FUTEX(WAKE, &m, 1);}
-template<>
-inline void mutex_storage<uint32_t>::wait(uint32_t old) const noexcept
-{FUTEX(WAIT, &m, old);}
+#include "futex.h"
+#ifdef __linux__
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <pthread.h>
+#endif
+
+/** The futex operations for a futex_scope */
+template<futex_scope scope> struct futex_ops
+{
+  template<typename T>
+  static void wait(const std::atomic<T> &a, T old) noexcept
+  { futex_wait(a, old); }
+  template<typename T>
+  static bool wait_until(const std::atomic<T> &a, T old,
+                         std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return futex_wait_until(a, old, deadline); }
+  template<typename T> static void wake_one(std::atomic<T> &a) noexcept
+  { futex_wake_one(a); }
+  template<typename T> static void wake_all(std::atomic<T> &a) noexcept
+  { futex_wake_all(a); }
+};
+
+#ifdef FUTEX_SHARED
+template<> struct futex_ops<futex_scope::process_shared>
+{
+  static void wait(const std::atomic<uint32_t> &a, uint32_t old) noexcept
+  { futex_wait_shared(a, old); }
+  static bool wait_until(const std::atomic<uint32_t> &a, uint32_t old,
+                         std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return futex_wait_until_shared(a, old, deadline); }
+  static void wake_one(std::atomic<uint32_t> &a) noexcept
+  { futex_wake_one_shared(a); }
+  static void wake_all(std::atomic<uint32_t> &a) noexcept
+  { futex_wake_all_shared(a); }
+};
 #endif
 
+template<typename T, futex_scope S>
+void mutex_storage<T,S>::unlock_notify() noexcept
+{ futex_ops<S>::wake_one(m); }
+template void mutex_storage<uint32_t>::unlock_notify() noexcept;
+template void mutex_storage<uint16_t>::unlock_notify() noexcept;
+template void mutex_storage<uint64_t>::unlock_notify() noexcept;
+
 /*
 
 Unfortunately, compilers targeting IA-32 or AMD64 currently cannot
@@ -49,40 +65,297 @@ https://gcc.gnu.org/bugzilla/show_bug.cgi?id=102566
 https://github.com/llvm/llvm-project/issues/37322
 
 Hence, we will manually translate fetch_or() using GCC-style inline
-assembler code or a MSVC intrinsic function.
+assembler code or a MSVC intrinsic function. The bit must be the most
+significant one of the 16-bit, 32-bit or 64-bit word mem, that is,
+HOLDER, which will also be used where no single instruction exists.
 
 */
 #if defined __clang_major__ && __clang_major__ < 10
 /* Only clang-10 introduced support for asm goto */
 #elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
-# define IF_FETCH_OR_GOTO(mem, bit, label)				\
-  __asm__ goto("lock btsl $" #bit ", %0\n\t"				\
-               "jc %l1" : : "m" (mem) : "cc", "memory" : label);
-# define IF_NOT_FETCH_OR_GOTO(mem, bit, label)				\
-  __asm__ goto("lock btsl $" #bit ", %0\n\t"				\
-               "jnc %l1" : : "m" (mem) : "cc", "memory" : label);
+/** Set the most significant bit of a 16-bit word.
+@return whether the bit was set */
+template<typename T>
+static inline bool fetch_or_msb(std::atomic<T> &mem,
+                                std::integral_constant<size_t, 2>) noexcept
+{
+  __asm__ goto("lock btsw $15, %0\n\t"
+               "jc %l1" : : "m" (mem) : "cc", "memory" : was_set);
+  return false;
+was_set:
+  return true;
+}
+/** Set the most significant bit of a 32-bit word.
+@return whether the bit was set */
+template<typename T>
+static inline bool fetch_or_msb(std::atomic<T> &mem,
+                                std::integral_constant<size_t, 4>) noexcept
+{
+  __asm__ goto("lock btsl $31, %0\n\t"
+               "jc %l1" : : "m" (mem) : "cc", "memory" : was_set);
+  return false;
+was_set:
+  return true;
+}
+/** Set the most significant bit of a 64-bit word.
+@return whether the bit was set */
+template<typename T>
+static inline bool fetch_or_msb(std::atomic<T> &mem,
+                                std::integral_constant<size_t, 8>) noexcept
+{
+# ifdef __x86_64__
+  __asm__ goto("lock btsq $63, %0\n\t"
+               "jc %l1" : : "m" (mem) : "cc", "memory" : was_set);
+  return false;
+was_set:
+  return true;
+# else /* IA-32 has no 64-bit LOCK BTS */
+  constexpr T msb = T(1) << 63;
+  return mem.fetch_or(msb, std::memory_order_relaxed) & msb;
+# endif
+}
+# define IF_FETCH_OR_GOTO(mem, label)					\
+  if (fetch_or_msb(mem, std::integral_constant<size_t, sizeof mem>()))	\
+    goto label;
+# define IF_NOT_FETCH_OR_GOTO(mem, label)				\
+  if (!fetch_or_msb(mem, std::integral_constant<size_t, sizeof mem>()))	\
+    goto label;
 #elif defined _MSC_VER && (defined _M_IX86 || defined _M_IX64)
-# define IF_FETCH_OR_GOTO(mem, bit, label)				\
-  if (_interlockedbittestandset(reinterpret_cast<volatile long*>(&mem), bit)) \
+# define IF_FETCH_OR_GOTO(mem, label)					\
+  if (sizeof mem == 4							\
+      ? _interlockedbittestandset(reinterpret_cast<volatile long*>(&mem), 31)\
+      : !!(mem.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER))	\
     goto label;
-# define IF_NOT_FETCH_OR_GOTO(mem, bit, label)				\
-  if (!_interlockedbittestandset(reinterpret_cast<volatile long*>(&mem), bit))\
+# define IF_NOT_FETCH_OR_GOTO(mem, label)				\
+  if (sizeof mem == 4							\
+      ? !_interlockedbittestandset(reinterpret_cast<volatile long*>(&mem),31)\
+      : !(mem.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER))	\
     goto label;
 #endif
 
+/*
+
+A spinloop round is calibrated to last about SPIN_ROUND_NS nanoseconds,
+measured by a fixed-frequency cycle counter (TSC, CNTVCT_EL0, or the
+POWER time base), so that the meaning of SPINLOOP does not depend on
+the latency of the pause instruction, which is about 140 cycles on
+Intel Skylake and later, and about 10 cycles on earlier
+microarchitectures. With SPIN_ROUND_NS=0, or if no cycle counter is
+available, a round is a single pause instruction.
+
+While a lock is being held, a spinning thread will wait for the lock
+word to change. On ARMv8, an exclusive load arms the monitor, and WFE
+will wait until the cache line is written to, or until the next event
+of the event stream, which on Linux is generated every 100µs. On x86
+processors with WAITPKG, UMONITOR and UMWAIT (in the C0.1 state) will
+wait until the lock word is written to or the round has elapsed.
+Because a WFE can outlast many rounds, the total duration of a
+spinloop is bounded by a spin_deadline() of SPINLOOP rounds.
+
+*/
+#ifndef SPIN_ROUND_NS
+# define SPIN_ROUND_NS 50
+#endif
+
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
+# include <intrin.h>
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__) && \
+  (defined __clang_major__ ? __clang_major__ >= 9 : __GNUC__ >= 9)
+# include <cpuid.h>
+# include <immintrin.h>
+# define HAVE_WAITPKG
+#endif
+
+/** @return the value of a fixed-frequency cycle counter, or 0 if none */
+static inline uint64_t spin_clock() noexcept
+{
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
+  return __rdtsc();
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+  return __builtin_ia32_rdtsc();
+#elif defined __GNUC__ && defined __aarch64__
+  uint64_t t;
+  __asm__ __volatile__ ("isb\n\tmrs %0, cntvct_el0" : "=r" (t));
+  return t;
+#elif defined __GNUC__ && defined _ARCH_PWR8
+  return __builtin_ppc_get_timebase();
+#else
+  return 0;
+#endif
+}
+
+/** @return the number of spin_clock() ticks in a spinloop round,
+or 0 if a round is a single pause instruction */
+static uint64_t spin_round_ticks() noexcept
+{
+  static const uint64_t ticks = []() noexcept -> uint64_t {
+    if (!SPIN_ROUND_NS || !spin_clock())
+      return 0;
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t c = spin_clock();
+    std::chrono::steady_clock::duration d;
+    do
+      d = std::chrono::steady_clock::now() - start;
+    while (d < std::chrono::microseconds(20));
+    const uint64_t ticks = (spin_clock() - c) * SPIN_ROUND_NS /
+      uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(d).
+               count());
+    return ticks ? ticks : 1;
+  }();
+  return ticks;
+}
+
+/** Execute a pause instruction */
+static inline void cpu_relax() noexcept
+{
+#ifdef _WIN32
+  YieldProcessor();
+#elif defined __GNUC__ && defined _ARCH_PWR8
+  __builtin_ppc_get_timebase();
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+  __asm__ __volatile__ ("pause");
+#elif defined __GNUC__ && defined __aarch64__
+  __asm__ __volatile__ ("isb" ::: "memory");
+#endif
+}
+
+void spin_pause() noexcept
+{
+  if (const uint64_t ticks = spin_round_ticks())
+  {
+    const uint64_t end = spin_clock() + ticks;
+    do
+      cpu_relax();
+    while (int64_t(spin_clock() - end) < 0);
+  }
+  else
+    cpu_relax();
+}
+
+#ifdef HAVE_WAITPKG
+/** @return whether the processor supports UMONITOR and UMWAIT */
+static bool have_waitpkg() noexcept
+{
+  static const bool waitpkg = []() noexcept {
+    unsigned a, b, c, d;
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & 1U << 5);
+  }();
+  return waitpkg;
+}
+
+/** Wait until a word is written to, or a deadline is reached
+@param m         the word
+@param old       the last observed value of m
+@param deadline  spin_clock() deadline */
 template<typename T>
-void mutex_storage<T>::lock_wait() noexcept
+__attribute__((target("waitpkg")))
+static void umwait(const std::atomic<T> &m, T old, uint64_t deadline) noexcept
+{
+  _umonitor(const_cast<std::atomic<T>*>(&m));
+  if (m.load(std::memory_order_relaxed) == old)
+    _umwait(1, deadline);
+}
+#endif
+
+/** @return the spin_clock() deadline of a spinloop
+@param spin_rounds  maximum number of spinloop rounds
+@retval 0 if spinloop rounds are not being timed */
+static inline uint64_t spin_deadline(unsigned spin_rounds) noexcept
+{
+  const uint64_t ticks = spin_rounds ? spin_round_ticks() : 0;
+  return ticks ? spin_clock() + spin_rounds * ticks : 0;
+}
+
+#if defined __GNUC__ && defined __aarch64__
+/** Load a 16-bit word and arm the exclusive monitor */
+template<typename T>
+static inline T load_exclusive(const std::atomic<T> &m,
+                               std::integral_constant<size_t, 2>) noexcept
+{
+  T v;
+  __asm__ __volatile__ ("ldxrh %w0, %1" : "=r" (v) : "Q" (m) : "memory");
+  return v;
+}
+/** Load a 32-bit word and arm the exclusive monitor */
+template<typename T>
+static inline T load_exclusive(const std::atomic<T> &m,
+                               std::integral_constant<size_t, 4>) noexcept
+{
+  T v;
+  __asm__ __volatile__ ("ldxr %w0, %1" : "=r" (v) : "Q" (m) : "memory");
+  return v;
+}
+/** Load a 64-bit word and arm the exclusive monitor */
+template<typename T>
+static inline T load_exclusive(const std::atomic<T> &m,
+                               std::integral_constant<size_t, 8>) noexcept
+{
+  T v;
+  __asm__ __volatile__ ("ldxr %0, %1" : "=r" (v) : "Q" (m) : "memory");
+  return v;
+}
+#endif
+
+/** Wait for one spinloop round, or until a word may have changed
+@param m         the word
+@param old       the last observed value of m
+@param spin_end  spin_deadline() of the spinloop
+@return whether the spinloop may continue */
+template<typename T>
+static inline bool spin_wait(const std::atomic<T> &m, T old,
+                             uint64_t spin_end) noexcept
+{
+  if (!spin_end)
+  {
+    (void) m; (void) old;
+    cpu_relax();
+    return true;
+  }
+  const uint64_t now = spin_clock();
+  if (int64_t(now - spin_end) >= 0)
+    return false;
+#if defined __GNUC__ && defined __aarch64__
+  /* A WFE may last until the next event of the event stream, which
+  may be much longer than a round; spin_end bounds the total. */
+  if (load_exclusive(m, std::integral_constant<size_t, sizeof old>()) == old)
+    __asm__ __volatile__ ("wfe" ::: "memory");
+#else
+# ifdef HAVE_WAITPKG
+  if (have_waitpkg())
+  {
+    const uint64_t end = now + spin_round_ticks();
+    umwait(m, old, int64_t(end - spin_end) < 0 ? end : spin_end);
+    return true;
+  }
+# endif
+  (void) m; (void) old;
+  spin_pause();
+#endif
+  return true;
+}
+
+/** maximum number of spinloop rounds between fetch_or() attempts */
+static constexpr unsigned SPIN_BACKOFF_MAX = 16;
+
+/** Back off after a failed attempt to acquire a lock
+@param backoff  number of rounds to wait; will be doubled
+@param spin     remaining spinloop rounds; will be decremented */
+static inline void spin_backoff(unsigned &backoff, unsigned &spin) noexcept
+{
+  for (unsigned b = backoff; b && spin; b--, spin--)
+    spin_pause();
+  if (backoff < SPIN_BACKOFF_MAX)
+    backoff<<= 1;
+}
+
+template<typename T, futex_scope S>
+void mutex_storage<T,S>::lock_wait(T lk) noexcept
 {
-  T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
   for (;;)
   {
     if (lk & HOLDER)
     {
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-      this->wait(lk);
-#else
-      m.wait(lk);
-#endif
+      futex_ops<S>::wait(m, lk);
 #if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_IX64
     reload:
 #endif
@@ -92,8 +365,7 @@ void mutex_storage<T>::lock_wait() noexcept
     else
     {
 # ifdef IF_FETCH_OR_GOTO
-      static_assert(HOLDER == (1U << 31), "compatibility");
-      IF_FETCH_OR_GOTO(*this, 31, reload);
+      IF_FETCH_OR_GOTO(m, reload);
 # else
       if (m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER)
         goto reload;
@@ -115,41 +387,31 @@ void mutex_storage<T>::lock_wait() noexcept
   }
 }
 
-#ifdef _WIN32
-# include <windows.h>
-#endif
-
-template<typename T>
-void mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
+template<typename T, futex_scope S>
+unsigned mutex_storage<T,S>::spin_lock_wait(unsigned spin_rounds) noexcept
 {
   T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
+  unsigned spin = spin_rounds, backoff = 1;
+  const uint64_t spin_end = spin_deadline(spin_rounds);
 
   /* We hope to avoid system calls when the conflict is resolved quickly. */
-  for (auto spin = spin_rounds;;)
+  while (spin)
   {
     assert(~HOLDER & lk);
     if (lk & HOLDER)
-      lk = m.load(std::memory_order_relaxed);
+      spin = spin_wait(m, lk, spin_end) ? spin - 1 : 0;
     else
     {
 #ifdef IF_NOT_FETCH_OR_GOTO
-      static_assert(HOLDER == (1U << 31), "compatibility");
-      IF_NOT_FETCH_OR_GOTO(*this, 31, acquired);
-      lk|= HOLDER;
+      IF_NOT_FETCH_OR_GOTO(m, acquired);
 #else
       if (!((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) & HOLDER))
         goto acquired;
 #endif
-# ifdef _WIN32
-      YieldProcessor();
-# elif defined __GNUC__ && defined _ARCH_PWR8
-      __builtin_ppc_get_timebase();
-# elif defined __GNUC__ && defined __i386__ || defined __x86_64__
-      __asm__ __volatile__ ("pause");
-# endif
+      /* Another waiter won the race; avoid hammering the cache line. */
+      spin_backoff(backoff, spin);
     }
-    if (!--spin)
-      break;
+    lk = m.load(std::memory_order_relaxed);
   }
 
   for (;;)
@@ -157,11 +419,7 @@ void mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
     assert(~HOLDER & lk);
     if (lk & HOLDER)
     {
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-      this->wait(lk);
-#else
-      m.wait(lk);
-#endif
+      futex_ops<S>::wait(m, lk);
 #ifdef IF_FETCH_OR_GOTO
     reload:
 #endif
@@ -170,8 +428,7 @@ void mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
     else
     {
 #ifdef IF_FETCH_OR_GOTO
-      static_assert(HOLDER == (1U << 31), "compatibility");
-      IF_FETCH_OR_GOTO(*this, 31, reload);
+      IF_FETCH_OR_GOTO(m, reload);
 #else
       if ((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) & HOLDER)
         continue;
@@ -180,40 +437,846 @@ void mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
 #endif
     acquired:
       std::atomic_thread_fence(std::memory_order_acquire);
-      return;
+      return spin_rounds - spin;
+    }
+  }
+}
+
+template<typename T, futex_scope S>
+bool mutex_storage<T,S>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
+  for (;;)
+  {
+    if (lk & HOLDER)
+    {
+      const bool timed_out = !futex_ops<S>::wait_until(m, lk, deadline);
+      lk = m.load(std::memory_order_relaxed);
+      if (timed_out && (lk & HOLDER))
+      {
+        /* If we were woken up by unlock_notify(), the mutex has since
+        been acquired by another thread, which will invoke
+        unlock_notify() on unlock() if any waiters remain. */
+        m.fetch_sub(WAITER, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    else if (!((lk = m.fetch_or(HOLDER, std::memory_order_relaxed)) &
+               HOLDER))
+    {
+      assert(lk);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+  }
+}
+
+template<typename T, futex_scope S>
+bool mutex_storage<T,S>::requeue(std::atomic<uint32_t> &word, uint32_t val,
+                               T n) noexcept
+{
+  /* The waiters will be woken up one at a time by unlock_notify(),
+  or they will invoke lock_requeued() after the caller woke them up. */
+  m.fetch_add(n * WAITER, std::memory_order_relaxed);
+  /* A process-private futex word cannot be requeued to a shared one. */
+  if (S == futex_scope::process_shared)
+    return false;
+  return futex_requeue(word, val, m);
+}
+
+template void mutex_storage<uint32_t>::lock_wait(uint32_t) noexcept;
+template bool mutex_storage<uint32_t>::requeue
+  (std::atomic<uint32_t>&, uint32_t, uint32_t) noexcept;
+template bool mutex_storage<uint32_t>::lock_wait_until
+  (std::chrono::steady_clock::time_point) noexcept;
+template unsigned mutex_storage<uint32_t>::spin_lock_wait(unsigned) noexcept;
+template void mutex_storage<uint16_t>::lock_wait(uint16_t) noexcept;
+template bool mutex_storage<uint16_t>::requeue
+  (std::atomic<uint32_t>&, uint32_t, uint16_t) noexcept;
+template bool mutex_storage<uint16_t>::lock_wait_until
+  (std::chrono::steady_clock::time_point) noexcept;
+template unsigned mutex_storage<uint16_t>::spin_lock_wait(unsigned) noexcept;
+template void mutex_storage<uint64_t>::lock_wait(uint64_t) noexcept;
+template bool mutex_storage<uint64_t>::requeue
+  (std::atomic<uint32_t>&, uint32_t, uint64_t) noexcept;
+template bool mutex_storage<uint64_t>::lock_wait_until
+  (std::chrono::steady_clock::time_point) noexcept;
+template unsigned mutex_storage<uint64_t>::spin_lock_wait(unsigned) noexcept;
+
+template<typename T>
+void embedded_mutex_storage<T>::lock_wait() noexcept
+{
+  for (;;)
+  {
+    /* Other threads may be sleeping; make our unlock() wake them up. */
+    const T lk = m.fetch_or(HOLDER | WAITING, std::memory_order_relaxed);
+    if (!(lk & HOLDER))
+      break;
+    futex_wait(m, T(lk | WAITING));
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+template<typename T>
+bool embedded_mutex_storage<T>::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  for (bool timed_out = false;;)
+  {
+    const T lk = m.fetch_or(HOLDER | WAITING, std::memory_order_relaxed);
+    if (!(lk & HOLDER))
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    /* We may have consumed a futex_wake_one() that was meant for
+    another waiter. Because we set WAITING above, the current holder
+    will wake up the next waiter. */
+    if (timed_out)
+      return false;
+    timed_out = !futex_wait_until(m, T(lk | WAITING), deadline);
+  }
+}
+
+template<typename T>
+unsigned embedded_mutex_storage<T>::spin_lock_wait(unsigned spin_rounds)
+  noexcept
+{
+  const uint64_t spin_end = spin_deadline(spin_rounds);
+  for (unsigned spin = spin_rounds, backoff = 1; spin; )
+  {
+    const T lk = m.load(std::memory_order_relaxed);
+    if (lk & HOLDER)
+    {
+      spin = spin_wait(m, lk, spin_end) ? spin - 1 : 0;
+      continue;
+    }
+#ifdef IF_NOT_FETCH_OR_GOTO
+    IF_NOT_FETCH_OR_GOTO(m, acquired);
+#else
+    if (!(m.fetch_or(HOLDER, std::memory_order_relaxed) & HOLDER))
+      goto acquired;
+#endif
+    spin_backoff(backoff, spin);
+    continue;
+  acquired:
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return spin_rounds - spin;
+  }
+  lock_wait();
+  return spin_rounds;
+}
+
+template<typename T>
+bool embedded_mutex_storage<T>::requeue(std::atomic<uint32_t> &word,
+                                        uint32_t val, T) noexcept
+{
+  m.fetch_or(WAITING, std::memory_order_relaxed);
+  return futex_requeue(word, val, m);
+}
+
+template<typename T>
+void embedded_mutex_storage<T>::unlock_notify() noexcept
+{ futex_wake_one(m); }
+
+template void embedded_mutex_storage<uint32_t>::lock_wait() noexcept;
+template bool embedded_mutex_storage<uint32_t>::lock_wait_until
+  (std::chrono::steady_clock::time_point) noexcept;
+template unsigned embedded_mutex_storage<uint32_t>::spin_lock_wait(unsigned)
+  noexcept;
+template bool embedded_mutex_storage<uint32_t>::requeue
+  (std::atomic<uint32_t>&, uint32_t, uint32_t) noexcept;
+template void embedded_mutex_storage<uint32_t>::unlock_notify() noexcept;
+template void embedded_mutex_storage<uint64_t>::lock_wait() noexcept;
+template bool embedded_mutex_storage<uint64_t>::lock_wait_until
+  (std::chrono::steady_clock::time_point) noexcept;
+template unsigned embedded_mutex_storage<uint64_t>::spin_lock_wait(unsigned)
+  noexcept;
+template bool embedded_mutex_storage<uint64_t>::requeue
+  (std::atomic<uint32_t>&, uint32_t, uint64_t) noexcept;
+template void embedded_mutex_storage<uint64_t>::unlock_notify() noexcept;
+
+template<typename T>
+void fair_mutex_storage<T>::unlock_notify() noexcept { futex_wake_one(m); }
+
+template<typename T>
+bool fair_mutex_storage<T>::lock_wait
+  (T lk, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  const auto never = std::chrono::steady_clock::time_point::max();
+  std::chrono::steady_clock::time_point start;
+  bool slept = false;
+
+  for (;;)
+  {
+    assert(~(HOLDER | HANDOFF | STARVING) & lk);
+    if (!(lk & HOLDER))
+    {
+      if (m.compare_exchange_weak(lk, lk | HOLDER, std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return true;
+      continue;
+    }
+
+    if (lk & HANDOFF && slept)
+    {
+      /* unlock() passed the ownership to a waiter. End the fair mode
+      if we did not wait for long or if nobody else is waiting. */
+      T l = lk & ~HANDOFF;
+      if ((l & ~(HOLDER | STARVING)) == WAITER ||
+          std::chrono::steady_clock::now() - start < starvation())
+        l&= ~STARVING;
+      if (m.compare_exchange_weak(lk, l, std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return true;
+      continue;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (!slept)
+      start = now;
+    else if (!(lk & STARVING) && now - start >= starvation())
+    {
+      lk = STARVING | m.fetch_or(STARVING, std::memory_order_relaxed);
+      continue;
+    }
+
+    if (now >= deadline)
+    {
+      /* Give up waiting, unless we can acquire the mutex. */
+      if (!(lk & HANDOFF) &&
+          m.compare_exchange_weak(lk, lk - WAITER, std::memory_order_relaxed,
+                                  std::memory_order_relaxed))
+        return false;
+      slept = true;
+      continue;
+    }
+
+    if (lk & STARVING && !slept)
+    {
+      /* Let the ownership be handed off to a waiter that has slept.
+      The timeout covers the case that none were asleep in unlock(). */
+      const auto until = now + starvation();
+      futex_wait_until(m, lk, until < deadline ? until : deadline);
+    }
+    else if (deadline == never)
+      futex_wait(m, lk);
+    else
+      futex_wait_until(m, lk, deadline);
+
+    slept = true;
+    lk = m.load(std::memory_order_relaxed);
+  }
+}
+
+template<typename T>
+unsigned fair_mutex_storage<T>::spin_lock_wait(unsigned spin_rounds) noexcept
+{
+  T lk = WAITER + m.fetch_add(WAITER, std::memory_order_relaxed);
+  const uint64_t spin_end = spin_deadline(spin_rounds);
+
+  /* In the fair mode, we must not spin for the mutex. */
+  for (unsigned spin = spin_rounds; spin && !(lk & STARVING); spin--)
+  {
+    if (lk & HOLDER)
+    {
+      if (!spin_wait(m, lk, spin_end))
+        break;
+      lk = m.load(std::memory_order_relaxed);
+    }
+    else if (m.compare_exchange_weak(lk, lk | HOLDER,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return spin_rounds - spin;
+  }
+
+  lock_wait(lk, std::chrono::steady_clock::time_point::max());
+  return spin_rounds;
+}
+
+template<typename T>
+bool fair_mutex_storage<T>::unlock_contended(T lk) noexcept
+{
+  for (;;)
+  {
+    assert(lk & HOLDER);
+    assert(!(lk & HANDOFF));
+    const T waiters = lk & ~(HOLDER | STARVING);
+    assert(waiters);
+    if (waiters == WAITER)
+    {
+      if (m.compare_exchange_weak(lk, 0, std::memory_order_release,
+                                  std::memory_order_relaxed))
+        return false;
+    }
+    else if (lk & STARVING)
+    {
+      if (m.compare_exchange_weak(lk, lk - WAITER + HANDOFF,
+                                  std::memory_order_release,
+                                  std::memory_order_relaxed))
+        return true;
     }
+    else if (m.compare_exchange_weak(lk, lk - HOLDER - WAITER,
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed))
+      return true;
   }
 }
 
-template void mutex_storage<uint32_t>::lock_wait() noexcept;
-template void mutex_storage<uint32_t>::spin_lock_wait(unsigned) noexcept;
+template void fair_mutex_storage<uint32_t>::unlock_notify() noexcept;
+template bool fair_mutex_storage<uint32_t>::lock_wait
+  (uint32_t, std::chrono::steady_clock::time_point) noexcept;
+template unsigned fair_mutex_storage<uint32_t>::spin_lock_wait(unsigned)
+  noexcept;
+template bool fair_mutex_storage<uint32_t>::unlock_contended(uint32_t)
+  noexcept;
 
+unsigned mcs_mutex_storage::spin_lock_wait(unsigned spin_rounds) noexcept
+{
+  mcs_node n;
+  n.next.store(nullptr, std::memory_order_relaxed);
+  n.state.store(WAITING, std::memory_order_relaxed);
+  mcs_node *prev = tail.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    if (!prev)
+    {
+      if (tail.compare_exchange_weak(prev, &head, std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+        return 0;
+    }
+    else if (tail.compare_exchange_weak(prev, &n, std::memory_order_acq_rel,
+                                        std::memory_order_relaxed))
+      break;
+  }
+
+  /* prev is either &head or a waiter, which will wait for us to
+  set prev->next before it can return from lock(). */
+  prev->next.store(&n, std::memory_order_release);
+
+  unsigned spin = spin_rounds;
+  const uint64_t spin_end = spin_deadline(spin_rounds);
+  for (; spin; spin--)
+  {
+    if (n.state.load(std::memory_order_acquire) == GRANTED)
+      break;
+    if (!spin_wait(n.state, WAITING, spin_end))
+    {
+      spin = 0;
+      break;
+    }
+  }
+  if (!spin)
+  {
+    uint32_t state = WAITING;
+    if (n.state.compare_exchange_strong(state, SLEEPING,
+                                        std::memory_order_relaxed))
+      state = SLEEPING;
+    while (state != GRANTED)
+    {
+      futex_wait(n.state, state);
+      state = n.state.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  /* We are holding the mutex. Our successor, if any, will be the
+  successor of the lock holder. */
+  mcs_node *succ = n.next.load(std::memory_order_acquire);
+  if (!succ)
+  {
+    head.next.store(nullptr, std::memory_order_relaxed);
+    mcs_node *t = &n;
+    if (tail.compare_exchange_strong(t, &head, std::memory_order_acq_rel,
+                                     std::memory_order_relaxed))
+      return spin ? spin_rounds - spin : spin_rounds;
+    /* Another thread is about to set n.next. */
+    while (!(succ = n.next.load(std::memory_order_acquire)))
+      spin_pause();
+  }
+  head.next.store(succ, std::memory_order_relaxed);
+  return spin ? spin_rounds - spin : spin_rounds;
+}
+
+void mcs_mutex_storage::unlock_notify() noexcept
+{
+  mcs_node *succ;
+  /* A waiter has been enqueued, but it may not have set head.next yet. */
+  while (!(succ = head.next.load(std::memory_order_acquire)))
+    spin_pause();
+  /* The successor may return from lock() and its node may cease to
+  exist as soon as the GRANTED state is observed. A futex_wake_one()
+  on a stale address can at most cause a spurious wake-up. */
+  if (succ->state.exchange(GRANTED, std::memory_order_release) == SLEEPING)
+    futex_wake_one(succ->state);
+}
+
+#ifdef __linux__
+thread_local uint32_t pi_mutex_storage::cached_tid;
+
+/* In the child process of fork(), the calling thread has a new TID. */
+const int pi_mutex_storage::atfork =
+  pthread_atfork(nullptr, nullptr, []() noexcept { cached_tid = 0; });
+
+uint32_t pi_mutex_storage::gettid() noexcept
+{ return uint32_t(syscall(SYS_gettid)); }
+
+/** Report an unexpected FUTEX_LOCK_PI error and terminate the process.
+For example, EDEADLK means that the mutex is already held by the current
+thread, and ESRCH or EPERM that the lock word is corrupted. */
+[[noreturn]] static void pi_lock_failed() noexcept
+{
+  fprintf(stderr, "pi_mutex_storage: FUTEX_LOCK_PI failed: %s\n",
+          strerror(errno));
+  abort();
+}
+
+void pi_mutex_storage::lock_wait() noexcept
+{
+  /* The kernel will acquire the mutex or sleep until it is handed off.
+  EAGAIN means that the holder is exiting. */
+  while (syscall(SYS_futex, &m, FUTEX_LOCK_PI_PRIVATE, 0, nullptr,
+                 nullptr, 0))
+    if (errno != EAGAIN && errno != EINTR)
+      pi_lock_failed();
+}
+
+bool pi_mutex_storage::lock_wait_until
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  for (;;)
+  {
+    const auto timeout = deadline - std::chrono::steady_clock::now();
+    if (timeout <= timeout.zero())
+      return false;
+    /* FUTEX_LOCK_PI expects an absolute CLOCK_REALTIME timeout.
+    If the clock is adjusted, we will compute a new one. */
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::system_clock::now().time_since_epoch() + timeout).count();
+    timespec ts;
+    ts.tv_sec = time_t(ns / 1000000000);
+    ts.tv_nsec = long(ns % 1000000000);
+    if (!syscall(SYS_futex, &m, FUTEX_LOCK_PI_PRIVATE, 0, &ts, nullptr, 0))
+      return true;
+    /* On ETIMEDOUT, we will check the deadline again. */
+    if (errno != ETIMEDOUT && errno != EAGAIN && errno != EINTR)
+      pi_lock_failed();
+  }
+}
+
+unsigned pi_mutex_storage::spin_lock_wait(unsigned spin_rounds) noexcept
+{
+  const uint32_t id = tid();
+  const uint64_t spin_end = spin_deadline(spin_rounds);
+  for (unsigned spin = spin_rounds; spin; spin--)
+  {
+    uint32_t lk = m.load(std::memory_order_relaxed);
+    if (lk)
+    {
+      if (!spin_wait(m, lk, spin_end))
+        break;
+    }
+    else if (m.compare_exchange_weak(lk, id, std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return spin_rounds - spin;
+  }
+  lock_wait();
+  return spin_rounds;
+}
+
+void pi_mutex_storage::unlock_notify() noexcept
+{
+  /* The kernel will hand off the mutex to the highest-priority waiter. */
+  syscall(SYS_futex, &m, FUTEX_UNLOCK_PI_PRIVATE, 0, nullptr, nullptr, 0);
+}
+#endif
+
+unsigned current_numa_node() noexcept
+{
+#ifdef __linux__
+  static thread_local const unsigned node = []() noexcept {
+    unsigned cpu, node;
+    return syscall(SYS_getcpu, &cpu, &node, nullptr) ? 0U : node;
+  }();
+  return node;
+#elif defined _WIN32
+  static thread_local const unsigned node = []() noexcept {
+    PROCESSOR_NUMBER p;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&p);
+    return GetNumaProcessorNodeEx(&p, &node) ? unsigned(node) : 0U;
+  }();
+  return node;
+#else
+  return 0;
+#endif
+}
+
+#ifndef SPINLOOP
+# define SPINLOOP 50
+#endif
+
+template<typename T, futex_scope S>
+unsigned mutex_storage<T,S>::default_spin_rounds() { return SPINLOOP; }
+template unsigned mutex_storage<uint32_t>::default_spin_rounds();
+template unsigned mutex_storage<uint16_t>::default_spin_rounds();
+template unsigned mutex_storage<uint64_t>::default_spin_rounds();
+#ifdef FUTEX_SHARED
+template class mutex_storage<uint32_t, futex_scope::process_shared>;
+#endif
 template<typename T>
-void shared_mutex_storage<T>::lock_inner_wait(T lk) noexcept
+unsigned embedded_mutex_storage<T>::default_spin_rounds() { return SPINLOOP; }
+template unsigned embedded_mutex_storage<uint32_t>::default_spin_rounds();
+template unsigned embedded_mutex_storage<uint64_t>::default_spin_rounds();
+template<typename T>
+unsigned fair_mutex_storage<T>::default_spin_rounds() { return SPINLOOP; }
+template unsigned fair_mutex_storage<uint32_t>::default_spin_rounds();
+template<typename T, shared_mutex_policy P, typename O>
+unsigned shared_mutex_storage<T,P,O>::default_spin_rounds() { return SPINLOOP; }
+template<typename T, unsigned N>
+unsigned sharded_shared_mutex_storage<T,N>::default_spin_rounds()
+{ return SPINLOOP; }
+unsigned mcs_mutex_storage::default_spin_rounds() { return SPINLOOP; }
+#ifdef __linux__
+unsigned pi_mutex_storage::default_spin_rounds() { return SPINLOOP; }
+#endif
+
+template<typename T, shared_mutex_policy P, typename O>
+void shared_mutex_storage<T,P,O>::lock_inner_wait(T lk) noexcept
 {
+  if (P == shared_mutex_policy::prefer_reader)
+  {
+    /* Wait for the S locks to be released, without blocking new ones. */
+    for (;;)
+    {
+      assert(lk & PENDING);
+      assert(!(lk & X));
+      if (lk != PENDING)
+      {
+        futex_ops<scope>::wait(inner, lk);
+        lk = inner.load(std::memory_order_relaxed);
+      }
+      else if (inner.compare_exchange_weak(lk, X, std::memory_order_acquire,
+                                           std::memory_order_relaxed))
+        return;
+    }
+  }
+
+  if (P == shared_mutex_policy::phase_fair)
+  {
+    /* Concurrent lock_shared() may register as BLOCKED meanwhile. */
+    while ((lk = inner.load(std::memory_order_acquire)) & SHARED)
+      futex_ops<scope>::wait(inner, lk);
+    return;
+  }
+
   assert(lk < X);
   lk |= X;
 
+  /* Concurrent lock_shared() may set SHARED_WAITING meanwhile. */
   do
   {
-    assert(lk > X);
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-    FUTEX(WAIT, &inner, lk);
-#else
-    inner.wait(lk);
-#endif
+    assert(lk & X);
+    futex_ops<scope>::wait(inner, lk);
     lk = inner.load(std::memory_order_acquire);
   }
-  while (lk != X);
+  while (lk & SHARED);
 }
 
-template
-void shared_mutex_storage<uint32_t>::lock_inner_wait(uint32_t) noexcept;
+template<typename T, shared_mutex_policy P, typename O>
+bool shared_mutex_storage<T,P,O>::lock_inner_wait_until
+  (T lk, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  if (P == shared_mutex_policy::prefer_reader)
+  {
+    for (;;)
+    {
+      assert(lk & PENDING);
+      assert(!(lk & X));
+      if (lk == PENDING)
+      {
+        if (inner.compare_exchange_weak(lk, X, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+          return true;
+      }
+      else if (futex_ops<scope>::wait_until(inner, lk, deadline))
+        lk = inner.load(std::memory_order_relaxed);
+      else if (inner.compare_exchange_weak(lk, lk - PENDING,
+                                           std::memory_order_relaxed))
+        return false;
+    }
+  }
 
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-template<typename T>
-void shared_mutex_storage<T>::shared_unlock_inner_notify() noexcept
-{FUTEX(WAKE, &inner, 1);}
-template
-void shared_mutex_storage<uint32_t>::shared_unlock_inner_notify() noexcept;
+  if (P == shared_mutex_policy::phase_fair)
+  {
+    for (;;)
+    {
+      lk = inner.load(std::memory_order_acquire);
+      if (!(lk & SHARED))
+        return true;
+      if (!futex_ops<scope>::wait_until(inner, lk, deadline))
+        break;
+    }
+    /* Roll back lock_inner(). The PHASE will not be toggled, because a
+    lock_shared() that was granted by the preceding write phase might not
+    have observed it yet. Any lock_shared() that was blocked by us will
+    acquire the S lock by itself. */
+    lk = inner.load(std::memory_order_relaxed);
+    while (lk & SHARED)
+    {
+      assert(lk & X);
+      if (inner.compare_exchange_weak(lk, lk - X, std::memory_order_relaxed))
+      {
+        if (lk & ~(X | PHASE | SHARED))
+          futex_ops<scope>::wake_all(inner);
+        return false;
+      }
+    }
+    /* The last S lock was released after all. */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+  }
+
+  assert(lk < X);
+  lk |= X;
+
+  do
+  {
+    assert(lk & X);
+    if (!futex_ops<scope>::wait_until(inner, lk, deadline))
+    {
+      /* Roll back lock_inner(), and wake up any lock_shared() that was
+      blocked by us. */
+      lk = inner.load(std::memory_order_relaxed);
+      while (lk & SHARED &&
+             !inner.compare_exchange_weak(lk, (lk - X) & ~SHARED_WAITING,
+                                          std::memory_order_relaxed))
+        assert(lk & X);
+      if (lk & SHARED)
+      {
+        if (lk & SHARED_WAITING)
+          shared_waiting_notify();
+        return false;
+      }
+      /* The last S lock was released after all. */
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    lk = inner.load(std::memory_order_acquire);
+  }
+  while (lk & SHARED);
+  return true;
+}
+
+template<typename T, shared_mutex_policy P, typename O>
+void shared_mutex_storage<T,P,O>::shared_unlock_inner_notify() noexcept
+{
+  /* In phase_fair, blocked lock_shared() may be waiting on the same
+  word. In prefer_writer, they wait on x_released instead. */
+  if (P == shared_mutex_policy::phase_fair)
+    futex_ops<scope>::wake_all(inner);
+  else
+    futex_ops<scope>::wake_one(inner);
+}
+
+template<typename T, shared_mutex_policy P, typename O>
+bool shared_mutex_storage<T,P,O>::shared_lock_inner_wait
+  (std::chrono::steady_clock::time_point deadline) noexcept
+{
+  assert(P == shared_mutex_policy::phase_fair);
+  T lk = inner.load(std::memory_order_relaxed);
+
+  /* Register as BLOCKED, unless the write phase has already ended. */
+  for (;;)
+  {
+    if (!(lk & X))
+    {
+      if (inner.compare_exchange_weak(lk, lk + WAITER,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return true;
+    }
+    else if (inner.compare_exchange_weak(lk, lk + BLOCKED,
+                                         std::memory_order_relaxed))
+      break;
+  }
+
+  /* PHASE cannot be toggled twice while we hold the granted S lock. */
+  const T phase = lk & PHASE;
+  lk+= BLOCKED;
+
+  for (;;)
+  {
+    if ((lk & PHASE) != phase)
+    {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    if (!(lk & X))
+    {
+      /* A timed-out lock() was rolled back; convert ourselves. */
+      if (inner.compare_exchange_weak(lk, lk - BLOCKED + WAITER,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return true;
+      continue;
+    }
+    if (deadline == std::chrono::steady_clock::time_point::max())
+      futex_ops<scope>::wait(inner, lk);
+    else if (!futex_ops<scope>::wait_until(inner, lk, deadline))
+    {
+      lk = inner.load(std::memory_order_relaxed);
+      while ((lk & PHASE) == phase)
+        if (inner.compare_exchange_weak(lk, lk - BLOCKED,
+                                        std::memory_order_relaxed))
+          return false;
+      continue;
+    }
+    lk = inner.load(std::memory_order_relaxed);
+  }
+}
+
+template<typename T, shared_mutex_policy P, typename O>
+bool shared_mutex_storage<T,P,O>::shared_lock_x_wait
+  (std::chrono::steady_clock::time_point deadline, unsigned spin_rounds)
+  noexcept
+{
+  assert(P == shared_mutex_policy::prefer_writer);
+  /* If we observe X after reading seq, the unlock_inner() that will
+  release it will not have incremented x_released yet. */
+  uint32_t seq = x_released.load(std::memory_order_acquire);
+  T lk = inner.load(std::memory_order_relaxed);
+  const uint64_t spin_end = spin_deadline(spin_rounds);
+  for (;;)
+  {
+    if (!(lk & X))
+    {
+      /* SHARED_WAITING is only set together with X. */
+      if (inner.compare_exchange_weak(lk, lk + WAITER,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+        return true;
+      continue;
+    }
+    if (spin_rounds)
+    {
+      spin_rounds = spin_wait(inner, lk, spin_end) ? spin_rounds - 1 : 0;
+      lk = inner.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (!(lk & SHARED_WAITING))
+    {
+      if (!inner.compare_exchange_weak(lk, lk | SHARED_WAITING,
+                                       std::memory_order_relaxed))
+        continue;
+      lk |= SHARED_WAITING;
+    }
+    if (deadline == std::chrono::steady_clock::time_point::max())
+      futex_ops<scope>::wait(x_released, seq);
+    else if (!futex_ops<scope>::wait_until(x_released, seq, deadline))
+      /* SHARED_WAITING may remain set; it will cause a spurious wakeup. */
+      return false;
+    seq = x_released.load(std::memory_order_acquire);
+    lk = inner.load(std::memory_order_relaxed);
+  }
+}
+
+template<typename T, shared_mutex_policy P, typename O>
+void shared_mutex_storage<T,P,O>::shared_waiting_notify() noexcept
+{
+  assert(P == shared_mutex_policy::prefer_writer);
+  x_released.fetch_add(1, std::memory_order_release);
+  futex_ops<scope>::wake_all(x_released);
+}
+
+template<typename T, shared_mutex_policy P, typename O>
+void shared_mutex_storage<T,P,O>::unlock_inner_phase(T lk) noexcept
+{
+  assert(P == shared_mutex_policy::phase_fair);
+  T l = inner.load(std::memory_order_relaxed), blocked;
+  do
+  {
+    assert((l & (X | SHARED)) == X);
+    blocked = l & ~(X | PHASE);
+  }
+  while (!inner.compare_exchange_weak(l, ((l & PHASE) ^ PHASE) + lk +
+                                      blocked / BLOCKED,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed));
+  if (blocked)
+    futex_ops<scope>::wake_all(inner);
+}
+
+template<typename T, unsigned N>
+void sharded_shared_mutex_storage<T,N>::shared_unlock_inner_notify() noexcept
+{
+  inner.fetch_add(WAITER, std::memory_order_release);
+  futex_wake_one(inner);
+}
+
+template<typename T, unsigned N>
+void sharded_shared_mutex_storage<T,N>::lock_inner_wait(T) noexcept
+{
+  for (;;)
+  {
+    /* Any shared_unlock_inner() after count() will modify inner. */
+    const T lk = inner.load(std::memory_order_acquire);
+    assert(lk & X);
+    if (!count())
+      return;
+    futex_wait(inner, lk);
+  }
+}
+
+template<typename T, unsigned N>
+bool sharded_shared_mutex_storage<T,N>::lock_inner_wait_until
+  (T, std::chrono::steady_clock::time_point deadline) noexcept
+{
+  for (;;)
+  {
+    const T lk = inner.load(std::memory_order_acquire);
+    assert(lk & X);
+    if (!count())
+      return true;
+    if (!futex_wait_until(inner, lk, deadline))
+      break;
+  }
+  if (!count())
+    return true;
+  /* Roll back lock_inner(). Any lock_shared() that was blocked by us
+  is waiting for outer, which our caller will release. */
+  inner.store(0, std::memory_order_relaxed);
+  return false;
+}
+
+template class sharded_shared_mutex_storage<uint32_t>;
+template class shared_mutex_storage<uint32_t>;
+template class shared_mutex_storage<uint32_t,
+                                    shared_mutex_policy::prefer_reader>;
+template class shared_mutex_storage<uint32_t,
+                                    shared_mutex_policy::phase_fair>;
+template class shared_mutex_storage<uint64_t>;
+template class shared_mutex_storage<uint64_t,
+                                    shared_mutex_policy::prefer_reader>;
+template class shared_mutex_storage<uint64_t,
+                                    shared_mutex_policy::phase_fair>;
+#ifdef FUTEX_SHARED
+template class shared_mutex_storage
+  <uint32_t, shared_mutex_policy::prefer_writer,
+   mutex_storage<uint32_t, futex_scope::process_shared>>;
+template class shared_mutex_storage
+  <uint32_t, shared_mutex_policy::prefer_reader,
+   mutex_storage<uint32_t, futex_scope::process_shared>>;
+template class shared_mutex_storage
+  <uint32_t, shared_mutex_policy::phase_fair,
+   mutex_storage<uint32_t, futex_scope::process_shared>>;
+#endif
+#ifdef __cpp_impl_coroutine
+template class shared_mutex_storage<uint32_t,
+                                    shared_mutex_policy::prefer_writer,
+                                    async_mutex_storage<>>;
+template class shared_mutex_storage<uint32_t,
+                                    shared_mutex_policy::prefer_reader,
+                                    async_mutex_storage<>>;
 #endif
@@ -1,11 +1,29 @@
 #pragma once
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include "tsan.h"
 
 template<typename Storage> class atomic_mutex;
+template<unsigned nodes> class cohort_mutex_storage;
+template<typename Storage> class profiled_mutex_storage;
+template<typename T> class async_mutex_storage;
 
-template<typename T = uint32_t>
+/** Which processes may wait for a lock */
+enum class futex_scope
+{
+  /** only the threads of the current process (FUTEX_PRIVATE_FLAG) */
+  process_private,
+  /** any process that maps the lock, for example in shared memory
+  (see futex_wait_shared()); the lock word must be 32 bits */
+  process_shared
+};
+
+/** The default Storage of atomic_mutex
+@tparam T      the type of the lock word: uint16_t, uint32_t or uint64_t
+@tparam scope  whether processes may share the lock */
+template<typename T = uint32_t,
+         futex_scope scope = futex_scope::process_private>
 class mutex_storage
 {
   using type = T;
@@ -14,6 +32,8 @@ class mutex_storage
 
   static constexpr type HOLDER = type(~(type(~type(0)) >> 1));
   static constexpr type WAITER = 1;
+  static_assert(scope == futex_scope::process_private || sizeof(T) == 4,
+                "process_shared requires a 32-bit lock word");
 
 public:
   constexpr bool is_locked() const noexcept
@@ -25,9 +45,12 @@ public:
 
 private:
   friend class atomic_mutex<mutex_storage>;
+  friend class profiled_mutex_storage<mutex_storage>;
+  template<unsigned> friend class cohort_mutex_storage;
+  friend class async_mutex_storage<T>;
 
   /** @return default argument for spin_lock_wait() */
-  unsigned default_spin_rounds();
+  static unsigned default_spin_rounds();
 
   /** Try to acquire a mutex
   @return whether the mutex was acquired */
@@ -38,8 +61,32 @@ private:
                                      std::memory_order_acquire,
                                      std::memory_order_relaxed);
   }
-  void lock_wait() noexcept;
-  void spin_lock_wait(unsigned spin_rounds) noexcept;
+  void lock_wait() noexcept
+  { lock_wait(WAITER + m.fetch_add(WAITER, std::memory_order_relaxed)); }
+  /** Acquire a mutex after having been registered as a waiter
+  @param lk  the current value of the lock word */
+  void lock_wait(type lk) noexcept;
+  /** Acquire a mutex on behalf of a waiter that was registered by requeue() */
+  void lock_requeued() noexcept
+  { lock_wait(m.load(std::memory_order_relaxed)); }
+  /** Register waiters of another futex word, and make them wait for us.
+  @param word  futex word
+  @param val   current value of word
+  @param n     number of waiters, which must invoke lock_requeued()
+  @return whether the waiters were transferred, instead of having to be
+  woken up by the caller; always false for futex_scope::process_shared.
+  The waiters will be counted in either case. */
+  bool requeue(std::atomic<uint32_t> &word, uint32_t val, type n) noexcept;
+  /** Acquire a mutex after lock_impl() failed, unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept;
 
   /** Release a mutex
   @return whether the lock is being waited for */
@@ -49,15 +96,495 @@ private:
     assert(lk & HOLDER);
     return lk != HOLDER + WAITER;
   }
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-  void notify_one() noexcept;
-  inline void wait(T old) const noexcept;
   /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept { this->notify_one(); }
-#else
+  void unlock_notify() noexcept;
+};
+
+/** A variant of mutex_storage that bounds the waiting time.
+
+Normally, like in mutex_storage, any thread that finds the mutex free
+may acquire it, even if other threads have been waiting for longer.
+Once a thread has been waiting for more than starvation(), it will
+switch the mutex to a fair mode, similar to the starvation mode of
+sync.Mutex in the Go programming language: unlock() will keep the
+HOLDER flag and hand off the ownership to a waiter that had to sleep,
+and spin_lock() will not spin. The fair mode will end when a waiter
+that has not waited for long, or the last waiter, acquires the mutex. */
+template<typename T = uint32_t>
+class fair_mutex_storage
+{
+  using type = T;
+  std::atomic<type> m;
+
+  static constexpr type HOLDER = type(~(type(~type(0)) >> 1));
+  /** unlock() passed the ownership to a waiter */
+  static constexpr type HANDOFF = HOLDER >> 1;
+  /** a waiter has been waiting for more than starvation() */
+  static constexpr type STARVING = HOLDER >> 2;
+  static constexpr type WAITER = 1;
+
+public:
+  constexpr bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & HOLDER; }
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) != 0; }
+  constexpr bool is_locked_not_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) == HOLDER + WAITER; }
+
+  /** @return the waiting time after which unlock() will hand off */
+  static std::chrono::steady_clock::duration starvation() noexcept
+  { return std::chrono::milliseconds(1); }
+
+private:
+  friend class atomic_mutex<fair_mutex_storage>;
+  friend class profiled_mutex_storage<fair_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds();
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    type lk = 0;
+    return m.compare_exchange_strong(lk, HOLDER + WAITER,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed);
+  }
+  /** Acquire a mutex after having been registered as a waiter
+  @param lk        the current value of the lock word
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  bool lock_wait(type lk, std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  void lock_wait() noexcept
+  {
+    lock_wait(WAITER + m.fetch_add(WAITER, std::memory_order_relaxed),
+              std::chrono::steady_clock::time_point::max());
+  }
+  /** Acquire a mutex after lock_impl() failed, unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    return lock_wait(WAITER + m.fetch_add(WAITER, std::memory_order_relaxed),
+                     deadline);
+  }
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept;
+
+  /** Release a mutex after the lock word was not HOLDER + WAITER
+  @param lk  the current value of the lock word
+  @return whether the lock is being waited for */
+  bool unlock_contended(type lk) noexcept;
+  /** Release a mutex, or hand it off to a waiter
+  @return whether the lock is being waited for */
+  bool unlock_impl() noexcept
+  {
+    type lk = HOLDER + WAITER;
+    return !m.compare_exchange_strong(lk, 0, std::memory_order_release,
+                                      std::memory_order_relaxed) &&
+      unlock_contended(lk);
+  }
+  /** Notify waiters after unlock_impl() returned true */
+  void unlock_notify() noexcept;
+};
+
+/** A mutex in the two most significant bits of a word whose other bits
+carry a payload, such as a pointer or a reference count.
+
+Unlike mutex_storage, this does not count the waiters. Like the third
+mutex in Drepper's "Futexes Are Tricky", a waiter that had to sleep will
+set WAITING when it acquires the mutex, and unlock() will invoke
+futex_wake_one() only if WAITING is set. The payload may be modified by
+anyone at any time, whether or not the mutex is being held. The waiters
+of a 64-bit word wait on a shared table of 32-bit words; see futex.h.
+
+The payload is available by load(), store(), fetch_add(), fetch_sub()
+and compare_exchange_strong(), which preserve the lock bits.
+fetch_add() and fetch_sub() must not carry into the lock bits, and the
+payload must be less than PAYLOAD + 1:
+
+  atomic_mutex<embedded_mutex_storage<uintptr_t>> child; // tagged pointer
+  child.lock();
+  child.get_storage().store(uintptr_t(node) >> 2);
+  child.unlock();
+@tparam T  the type of the word: uint32_t or uint64_t */
+template<typename T = uintptr_t>
+class embedded_mutex_storage
+{
+  using type = T;
+  std::atomic<type> m;
+
+  static constexpr type HOLDER = type(~(type(~type(0)) >> 1));
+  /** a thread may be waiting in futex_wait() */
+  static constexpr type WAITING = HOLDER >> 1;
+
+public:
+  /** the bits that are available for the payload */
+  static constexpr type PAYLOAD = type(~(HOLDER | WAITING));
+
+  constexpr bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & HOLDER; }
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) & (HOLDER | WAITING); }
+  constexpr bool is_locked_not_waiting() const noexcept
+  {
+    return (m.load(std::memory_order_acquire) & (HOLDER | WAITING)) ==
+      HOLDER;
+  }
+
+  /** @return the payload */
+  type load(std::memory_order o = std::memory_order_seq_cst) const noexcept
+  { return m.load(o) & PAYLOAD; }
+  /** Replace the payload
+  @param payload  the new payload */
+  void store(type payload, std::memory_order o = std::memory_order_seq_cst)
+    noexcept
+  {
+    assert(!(payload & ~PAYLOAD));
+    type w = m.load(std::memory_order_relaxed);
+    while (!m.compare_exchange_weak(w, (w & ~PAYLOAD) | payload, o,
+                                       std::memory_order_relaxed));
+  }
+  /** Add to the payload
+  @return the previous payload */
+  type fetch_add(type n, std::memory_order o = std::memory_order_seq_cst)
+    noexcept
+  {
+    type w = m.fetch_add(n, o);
+    assert((w & PAYLOAD) + n <= PAYLOAD);
+    return w & PAYLOAD;
+  }
+  /** Subtract from the payload
+  @return the previous payload */
+  type fetch_sub(type n, std::memory_order o = std::memory_order_seq_cst)
+    noexcept
+  {
+    type w = m.fetch_sub(n, o);
+    assert((w & PAYLOAD) >= n);
+    return w & PAYLOAD;
+  }
+  /** Replace the payload if it matches an expected value
+  @param expected  the expected payload; will be updated on failure
+  @param desired   the new payload
+  @return whether the payload was replaced */
+  bool compare_exchange_strong(type &expected, type desired,
+                               std::memory_order o =
+                               std::memory_order_seq_cst) noexcept
+  {
+    assert(!(desired & ~PAYLOAD));
+    type w = m.load(std::memory_order_relaxed);
+    while ((w & PAYLOAD) == expected)
+      if (m.compare_exchange_weak(w, (w & ~PAYLOAD) | desired, o,
+                                     std::memory_order_relaxed))
+        return true;
+    expected = w & PAYLOAD;
+    return false;
+  }
+
+private:
+  friend class atomic_mutex<embedded_mutex_storage>;
+  friend class profiled_mutex_storage<embedded_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds();
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  { return !(m.fetch_or(HOLDER, std::memory_order_acquire) & HOLDER); }
+  /** Acquire a mutex after lock_impl() failed */
+  void lock_wait() noexcept;
+  /** Acquire a mutex on behalf of a waiter that was registered by requeue() */
+  void lock_requeued() noexcept { lock_wait(); }
+  /** Make the waiters of another futex word wait for us.
+  @param word  futex word
+  @param val   current value of word
+  @return whether the waiters were transferred, instead of having to be
+  woken up by the caller */
+  bool requeue(std::atomic<uint32_t> &word, uint32_t val, type) noexcept;
+  /** Acquire a mutex after lock_impl() failed, unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept;
+
+  /** Release a mutex
+  @return whether the lock may be waited for */
+  bool unlock_impl() noexcept
+  {
+    type w = m.fetch_and(~(HOLDER | WAITING), std::memory_order_release);
+    assert(w & HOLDER);
+    return w & WAITING;
+  }
   /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept { m.notify_one(); }
+  void unlock_notify() noexcept;
+};
+
+/** A queue node of a thread that is waiting for mcs_mutex_storage */
+struct mcs_node
+{
+  /** the next waiter */
+  std::atomic<mcs_node*> next;
+  /** GRANTED, WAITING, or SLEEPING */
+  std::atomic<uint32_t> state;
+};
+
+/** A queue-based mutex (MCS lock) that avoids a single contended word.
+
+Each waiter enqueues an mcs_node and waits for its own node to be
+granted the lock, first spinning and then in futex_wait(). Hence,
+unlock() will only write to the cache lines of the lock and the next
+waiter, and the waiters will be granted the lock in FIFO order.
+
+Like in the K42 variant of the MCS lock, the node only needs to exist
+while a thread is waiting; it resides on the stack of lock(), and
+unlock() may be invoked by any thread. The successor of the lock holder
+is kept in head.next, and tail==&head when there are no waiters.
+
+Because a node cannot leave the queue before being granted the lock,
+the timed operations try_lock_until() and try_lock_for() are not
+available, and neither is atomic_condition_variable::broadcast(m). */
+class mcs_mutex_storage
+{
+  /** the last waiter; &head if locked and not waited for; nullptr if free */
+  std::atomic<mcs_node*> tail{nullptr};
+  /** head.next is the successor of the lock holder */
+  mcs_node head{{nullptr}, {0}};
+
+  /** mcs_node::state: the lock has been granted */
+  static constexpr uint32_t GRANTED = 0;
+  /** mcs_node::state: the waiter is spinning */
+  static constexpr uint32_t WAITING = 1;
+  /** mcs_node::state: the waiter is in futex_wait() */
+  static constexpr uint32_t SLEEPING = 2;
+
+public:
+  constexpr mcs_mutex_storage() = default;
+
+  bool is_locked() const noexcept
+  { return tail.load(std::memory_order_acquire) != nullptr; }
+  bool is_locked_or_waiting() const noexcept { return is_locked(); }
+  bool is_locked_not_waiting() const noexcept
+  { return tail.load(std::memory_order_acquire) == &head; }
+
+private:
+  friend class atomic_mutex<mcs_mutex_storage>;
+  friend class profiled_mutex_storage<mcs_mutex_storage>;
+  template<unsigned> friend class cohort_mutex_storage;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds();
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    mcs_node *t = nullptr;
+    return tail.compare_exchange_strong(t, &head, std::memory_order_acquire,
+                                        std::memory_order_relaxed);
+  }
+  void lock_wait() noexcept { spin_lock_wait(0); }
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  on our own queue node
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept;
+
+  /** Release a mutex
+  @return whether the lock is being waited for */
+  bool unlock_impl() noexcept
+  {
+    mcs_node *t = &head;
+    return head.next.load(std::memory_order_relaxed) ||
+      !tail.compare_exchange_strong(t, nullptr, std::memory_order_release,
+                                    std::memory_order_relaxed);
+  }
+  /** Grant the mutex to the next waiter after unlock_impl() returned true */
+  void unlock_notify() noexcept;
+};
+
+#ifdef __linux__
+/** A priority-inheritance mutex for real-time threads on Linux.
+
+The lock word holds the thread identifier (TID) of the holder, as
+expected by FUTEX_LOCK_PI and FUTEX_UNLOCK_PI. The uncontended lock()
+and unlock() are a single compare-and-swap; under contention, the
+kernel queues the waiters by priority, boosts the priority of the holder
+to that of the highest-priority waiter, and hands off the ownership on
+unlock(). Hence, a SCHED_FIFO thread cannot be delayed indefinitely by
+a lower-priority thread that holds the mutex.
+
+The mutex must be released by the thread that acquired it. Because the
+waiters are not counted, atomic_condition_variable::broadcast(m) is not
+available. */
+class pi_mutex_storage
+{
+  /** the TID of the holder, and flags; 0 if free */
+  std::atomic<uint32_t> m;
+
+  /** the TID bits of the lock word (FUTEX_TID_MASK) */
+  static constexpr uint32_t TID = 0x3fffffff;
+  /** the kernel may have to be notified on unlock (FUTEX_WAITERS) */
+  static constexpr uint32_t WAITERS = 0x80000000;
+
+public:
+  bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & TID; }
+  bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) != 0; }
+  bool is_locked_not_waiting() const noexcept
+  {
+    const uint32_t lk = m.load(std::memory_order_acquire);
+    return lk & TID && !(lk & WAITERS);
+  }
+
+private:
+  friend class atomic_mutex<pi_mutex_storage>;
+  friend class profiled_mutex_storage<pi_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds();
+
+  /** the TID of the current thread, or 0 if not known yet;
+  reset in the child process of fork() */
+  static thread_local uint32_t cached_tid;
+  /** the result of registering the fork() handler that resets cached_tid */
+  static const int atfork;
+  /** @return the TID of the current thread, by system call */
+  static uint32_t gettid() noexcept;
+  /** @return the TID of the current thread */
+  static uint32_t tid() noexcept
+  {
+    if (!cached_tid)
+      cached_tid = gettid();
+    return cached_tid;
+  }
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    uint32_t lk = 0;
+    return m.compare_exchange_strong(lk, tid(), std::memory_order_acquire,
+                                     std::memory_order_relaxed);
+  }
+  /** Acquire a mutex after lock_impl() failed, by FUTEX_LOCK_PI */
+  void lock_wait() noexcept;
+  /** Acquire a mutex after lock_impl() failed, unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept;
+
+  /** Release a mutex
+  @return whether the kernel must hand off the mutex */
+  bool unlock_impl() noexcept
+  {
+    uint32_t lk = tid();
+    if (m.compare_exchange_strong(lk, 0, std::memory_order_release,
+                                  std::memory_order_relaxed))
+      return false;
+    assert((lk & TID) == tid());
+    return true;
+  }
+  /** Release the mutex by FUTEX_UNLOCK_PI after unlock_impl() returned true */
+  void unlock_notify() noexcept;
+};
 #endif
+
+/** Convert a deadline to std::chrono::steady_clock
+@param t  deadline
+@return the corresponding std::chrono::steady_clock::time_point */
+template<class Clock, class Duration>
+inline std::chrono::steady_clock::time_point
+steady_deadline(const std::chrono::time_point<Clock,Duration> &t) noexcept
+{
+  return std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>
+    (t - Clock::now());
+}
+inline std::chrono::steady_clock::time_point
+steady_deadline(const std::chrono::steady_clock::time_point &t) noexcept
+{ return t; }
+
+/** Spinloop budget that adapts to the observed lock hold times.
+
+Like PTHREAD_MUTEX_ADAPTIVE_NP in the GNU C library, we maintain a moving
+average of the number of spinloop rounds that it took for a contended
+spin_lock() to succeed. A failed spinloop (one that had to wait()) will
+also increase the estimate, unless spinning rarely turns out to be
+successful, as is the case for locks that are held for long.
+Then, we will only spin MIN_ROUNDS, to notice when things improve.
+
+An object may be associated with a single mutex or a call site, such as
+static adaptive_spin_rounds spin; m.spin_lock(spin);
+
+The state is updated with relaxed loads and stores. A lost update
+will do no harm. */
+class adaptive_spin_rounds
+{
+  /** moving average of spinloop rounds, in 1/8 */
+  std::atomic<uint32_t> estimate;
+  /** moving average of successful spinloops, in 1/SUCCESS_MAX */
+  std::atomic<uint16_t> success;
+  /** maximum number of spinloop rounds */
+  const uint16_t max_rounds;
+
+  static constexpr unsigned SUCCESS_MAX = 1U << 12;
+public:
+  /** minimum number of spinloop rounds */
+  static constexpr unsigned MIN_ROUNDS = 10;
+
+  /** Constructor
+  @param max_rounds  maximum number of spinloop rounds */
+  constexpr adaptive_spin_rounds(uint16_t max_rounds = 100) noexcept
+    : estimate(0), success(SUCCESS_MAX), max_rounds(max_rounds) {}
+  /** No copy constructor */
+  adaptive_spin_rounds(const adaptive_spin_rounds&) = delete;
+  /** No assignment operator */
+  adaptive_spin_rounds& operator=(const adaptive_spin_rounds&) = delete;
+
+  /** @return the current spinloop budget */
+  unsigned rounds() const noexcept
+  {
+    if (success.load(std::memory_order_relaxed) < SUCCESS_MAX / 8)
+      return MIN_ROUNDS;
+    unsigned r = MIN_ROUNDS + estimate.load(std::memory_order_relaxed) / 4;
+    return r < max_rounds ? r : max_rounds;
+  }
+
+  /** Update the statistics after a spinloop
+  @param budget  the rounds() that the spinloop was invoked with
+  @param spun    number of rounds until the lock was acquired,
+                 or budget if the spinloop had to wait() */
+  void update(unsigned budget, unsigned spun) noexcept
+  {
+    unsigned e = estimate.load(std::memory_order_relaxed);
+    unsigned s = success.load(std::memory_order_relaxed);
+    if (spun > max_rounds)
+      spun = max_rounds;
+    e = e + spun - e / 8;
+    s = spun < budget ? s + (SUCCESS_MAX - s) / 16 : s - s / 16;
+    estimate.store(e, std::memory_order_relaxed);
+    success.store(uint16_t(s), std::memory_order_relaxed);
+  }
 };
 
 /** Tiny, non-recursive mutex that keeps a count of waiters.
@@ -65,7 +592,12 @@ private:
 The interface intentionally resembles std::mutex.
 The counterpart of get_storage() is std::mutex::native_handle().
 
+Like std::timed_mutex, we define try_lock_for() and try_lock_until(),
+which give up waiting when the timeout expires.
+
 We define spin_lock(), which is like lock(), but with an initial spinloop.
+The number of spinloop rounds may be specified explicitly,
+by adaptive_spin_rounds, or by default (SPINLOOP at compilation time).
 
 The implementation counts pending lock() requests, so that unlock()
 will only invoke notify_one() when pending requests exist. */
@@ -89,6 +621,13 @@ public:
   atomic_mutex& operator=(const atomic_mutex&) = delete;
 
   constexpr const Storage& get_storage() const { return storage; }
+  /** @return the Storage, for example for the payload of
+  embedded_mutex_storage */
+  Storage& get_storage() { return storage; }
+
+  /** Assign a rank to the mutex, for WITH_LOCK_ORDER; see lock_order.h */
+  void set_lock_rank(unsigned rank) noexcept
+  { lock_order_set_rank(&storage, rank); }
 
   /** @return whether the mutex was acquired */
   bool try_lock() noexcept
@@ -101,6 +640,28 @@ public:
     return locked;
   }
 
+  /** Try to acquire a mutex, waiting until a deadline
+  @param deadline  when to give up waiting
+  @return whether the mutex was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock,Duration> &deadline)
+    noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    bool locked = storage.lock_impl() ||
+      storage.lock_wait_until(steady_deadline(deadline));
+    __tsan_mutex_post_lock(&storage, locked
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return locked;
+  }
+  /** Try to acquire a mutex, waiting for at most a specified time
+  @param timeout  how long to wait
+  @return whether the mutex was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep,Period> &timeout) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + timeout); }
+
   void lock() noexcept
   {
     __tsan_mutex_pre_lock(&storage, 0);
@@ -115,8 +676,48 @@ public:
       storage.spin_lock_wait(spin_rounds);
     __tsan_mutex_post_lock(&storage, 0, 0);
   }
+  void spin_lock(adaptive_spin_rounds &spin) noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, 0);
+    if (!storage.lock_impl())
+    {
+      const unsigned spin_rounds = spin.rounds();
+      spin.update(spin_rounds, storage.spin_lock_wait(spin_rounds));
+    }
+    __tsan_mutex_post_lock(&storage, 0, 0);
+  }
   void spin_lock() noexcept
   { return spin_lock(storage.default_spin_rounds()); }
+#ifdef __cpp_impl_coroutine
+  /** Acquire the mutex in a coroutine: co_await m.async_lock();
+  see async_mutex.h
+  @param e  optional async_executor for resuming the coroutine */
+  template<typename... Executor>
+  auto async_lock(const Executor&... e) noexcept
+  { return storage.async_lock(e...); }
+#endif
+
+  /** Make the waiters of a futex word wait for this mutex.
+  On Linux, FUTEX_CMP_REQUEUE will wake up one waiter and move the rest
+  to wait for unlock(), which will wake them up one at a time.
+  The waiters will be counted as waiting for the mutex, and after their
+  wait on word returns, they must invoke lock_requeued().
+  @param word  futex word
+  @param val   current value of word
+  @param n     number of waiters
+  @return whether the waiters were transferred; if not, the caller must
+  wake them up, for example by futex_wake_all(word) */
+  bool requeue(std::atomic<uint32_t> &word, uint32_t val, uint32_t n)
+    noexcept
+  { return storage.requeue(word, val, n); }
+  /** Acquire the mutex on behalf of a waiter that was registered
+  by requeue() */
+  void lock_requeued() noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, 0);
+    storage.lock_requeued();
+    __tsan_mutex_post_lock(&storage, 0, 0);
+  }
   void unlock() noexcept
   {
     __tsan_mutex_pre_unlock(&storage, 0);
@@ -130,3 +731,144 @@ public:
     }
   }
 };
+
+/** @return the NUMA node that the current thread was first invoked on,
+or 0 if it is not known */
+unsigned current_numa_node() noexcept;
+
+/** Pause the execution of a spinloop for one round of SPIN_ROUND_NS,
+like the spinloops of the Storage */
+void spin_pause() noexcept;
+
+/** A NUMA-aware cohort lock, composed of an mcs_mutex_storage for each
+NUMA node and a global mutex_storage.
+
+A thread first acquires the lock of its NUMA node. If the lock holder
+on the same node passed the ownership of the global mutex along with
+it, we are done; else we acquire the global mutex. On unlock(), if
+another thread on the same NUMA node is waiting, the global mutex will
+be passed to it, at most max_batch() times in a row,
+so that the lock word will not have to move between NUMA nodes.
+
+Like mcs_mutex_storage, this does not support the timed operations.
+@tparam nodes  number of NUMA nodes to distinguish */
+template<unsigned nodes = 4>
+class cohort_mutex_storage
+{
+  /** The lock of a NUMA node, padded to a typical cache line size */
+  struct alignas(64) cohort
+  {
+    mcs_mutex_storage local;
+    /** whether the global mutex was passed to the next local holder;
+    protected by local */
+    bool passed;
+    /** number of consecutive passes of the global mutex;
+    protected by local */
+    unsigned batch;
+  };
+  cohort cohorts[nodes];
+  mutex_storage<> global;
+  /** the cohort of the lock holder; protected by global */
+  unsigned holder;
+
+public:
+  /** @return the maximum number of consecutive local hand-offs */
+  static constexpr unsigned max_batch() noexcept { return 64; }
+
+  bool is_locked() const noexcept { return global.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  {
+    if (global.is_locked_or_waiting())
+      return true;
+    for (const cohort &c : cohorts)
+      if (c.local.is_locked_or_waiting())
+        return true;
+    return false;
+  }
+
+private:
+  friend class atomic_mutex<cohort_mutex_storage>;
+  friend class profiled_mutex_storage<cohort_mutex_storage>;
+
+  /** @return default argument for spin_lock_wait() */
+  static unsigned default_spin_rounds()
+  { return mutex_storage<>::default_spin_rounds(); }
+
+  /** Acquire or inherit the global mutex after acquiring the local one
+  @param n            the NUMA node of the current thread
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the global mutex was acquired */
+  unsigned global_lock(unsigned n, unsigned spin_rounds) noexcept
+  {
+    cohort &c = cohorts[n];
+    unsigned spun = 0;
+    if (c.passed)
+      c.passed = false;
+    else if (global.lock_impl());
+    else if (spin_rounds)
+      spun = global.spin_lock_wait(spin_rounds);
+    else
+      global.lock_wait();
+    holder = n;
+    return spun;
+  }
+
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    const unsigned n = current_numa_node() % nodes;
+    cohort &c = cohorts[n];
+    if (!c.local.lock_impl())
+      return false;
+    if (!c.passed && !global.lock_impl())
+    {
+      if (c.local.unlock_impl())
+        c.local.unlock_notify();
+      return false;
+    }
+    c.passed = false;
+    holder = n;
+    return true;
+  }
+  void lock_wait() noexcept
+  {
+    const unsigned n = current_numa_node() % nodes;
+    if (!cohorts[n].local.lock_impl())
+      cohorts[n].local.lock_wait();
+    global_lock(n, 0);
+  }
+  /** Acquire a mutex after lock_impl() failed, with an initial spinloop
+  @param spin_rounds  maximum number of spinloop rounds
+  @return number of spinloop rounds until the mutex was acquired
+  @retval spin_rounds if we had to wait() */
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept
+  {
+    const unsigned n = current_numa_node() % nodes;
+    unsigned spun = cohorts[n].local.lock_impl()
+      ? 0 : cohorts[n].local.spin_lock_wait(spin_rounds);
+    const unsigned g = global_lock(n, spin_rounds);
+    return spun > g ? spun : g;
+  }
+
+  /** Release a mutex, passing the global mutex to a waiter on the
+  same NUMA node if possible
+  @return false */
+  bool unlock_impl() noexcept
+  {
+    cohort &c = cohorts[holder];
+    if (!c.local.is_locked_not_waiting() && ++c.batch < max_batch())
+      c.passed = true;
+    else
+    {
+      c.batch = 0;
+      if (global.unlock_impl())
+        global.unlock_notify();
+    }
+    if (c.local.unlock_impl())
+      c.local.unlock_notify();
+    return false;
+  }
+  /** Notify waiters after unlock_impl() returned true */
+  void unlock_notify() noexcept {}
+};
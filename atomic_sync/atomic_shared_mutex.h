@@ -2,31 +2,120 @@
 #include "atomic_mutex.h"
 
 template<typename Storage> class atomic_shared_mutex;
+template<typename Storage> class profiled_shared_mutex_storage;
 
-template<typename T = uint32_t>
+/** The kind of lock of async_shared_lock */
+enum class async_lock_mode
+{
+  /** atomic_shared_mutex::async_lock_shared() */
+  shared,
+  /** atomic_shared_mutex::async_lock_update() */
+  update,
+  /** atomic_shared_mutex::async_lock() */
+  exclusive
+};
+template<typename Storage, async_lock_mode mode> class async_shared_lock;
+
+/** The scheduling policy of shared_mutex_storage */
+enum class shared_mutex_policy
+{
+  /** A waiting lock() blocks further lock_shared() until it has been
+  granted and released. Reads may be starved by frequent writes.
+  The lock_shared() that were blocked will be woken up together. */
+  prefer_writer,
+  /** A waiting lock() does not block lock_shared(); it will be granted
+  once no shared locks are being held. Writes may be starved. */
+  prefer_reader,
+  /** Like prefer_writer, but any lock_shared() that was blocked by lock()
+  will be granted when unlock() ends the write phase, before any
+  subsequent lock() can be granted. */
+  phase_fair
+};
+
+/** The futex_scope of the Outer of shared_mutex_storage */
+template<typename Outer> struct outer_futex_scope
+{ static constexpr futex_scope value = futex_scope::process_private; };
+template<typename T, futex_scope scope>
+struct outer_futex_scope<mutex_storage<T, scope>>
+{ static constexpr futex_scope value = scope; };
+
+/** The default Storage of atomic_shared_mutex
+@tparam T       the type of the lock words
+@tparam policy  the scheduling policy
+@tparam Outer   the Storage of the mutex for lock() and lock_update(),
+                such as async_mutex_storage<T> for async_lock_shared(),
+                or mutex_storage<uint32_t, futex_scope::process_shared>
+                for a lock that is shared between processes */
+template<typename T = uint32_t,
+         shared_mutex_policy policy = shared_mutex_policy::prefer_writer,
+         typename Outer = mutex_storage<T>>
 class shared_mutex_storage
 {
   // exposition only
   std::atomic<T> inner;
-  atomic_mutex<mutex_storage<T>> outer;
+  atomic_mutex<Outer> outer;
+  /** prefer_writer: incremented when an X lock that had SHARED_WAITING
+  is released; the blocked lock_shared() wait for this, so that the
+  lock() that waits on inner for the S locks to be released will not
+  wake them up in vain */
+  std::atomic<uint32_t> x_released;
   using type = T;
   static constexpr type X = type(~(type(~type(0)) >> 1));
+  /** prefer_reader: lock() is waiting for S locks to be released */
+  static constexpr type PENDING = X >> 1;
+  /** phase_fair: toggled at the end of each write phase */
+  static constexpr type PHASE = X >> 1;
+  /** phase_fair: a lock_shared() is waiting for the write phase to end */
+  static constexpr type BLOCKED = X >> 16;
+  /** prefer_writer: a lock_shared() is waiting for X to be released */
+  static constexpr type SHARED_WAITING = X >> 1;
   static constexpr type WAITER = 1;
+  /** mask of the count of S locks */
+  static constexpr type SHARED = policy == shared_mutex_policy::phase_fair
+    ? BLOCKED - 1 : PENDING - 1;
+  static_assert(policy != shared_mutex_policy::phase_fair || BLOCKED > WAITER,
+                "phase_fair requires a wider lock word");
+  /** whether processes may share the lock; inherited from Outer */
+  static constexpr futex_scope scope = outer_futex_scope<Outer>::value;
+  /** the scheduling policy, for async_shared_lock */
+  static constexpr shared_mutex_policy scheduling = policy;
 
 public:
   constexpr bool is_locked() const noexcept
-  { return inner.load(std::memory_order_acquire) == X; }
+  { return (inner.load(std::memory_order_acquire) & (X | SHARED)) == X; }
   constexpr bool is_locked_or_waiting() const noexcept
   { return outer.get_storage().is_locked_or_waiting() || is_locked(); }
+  /** @return whether the mutex of lock() and lock_update() is being
+  held or waited for. Unlike is_locked_or_waiting(), this does not read
+  the word that lock_shared() modifies. */
+  constexpr bool is_outer_locked_or_waiting() const noexcept
+  { return outer.get_storage().is_locked_or_waiting(); }
 private:
   friend class atomic_shared_mutex<shared_mutex_storage>;
+  friend class profiled_shared_mutex_storage<shared_mutex_storage>;
+  template<typename, async_lock_mode> friend class async_shared_lock;
   /** @return default argument for spin_lock_outer() */
   static unsigned default_spin_rounds();
 
+  /** For atomic_shared_mutex::set_lock_rank() */
+  void set_outer_lock_rank(unsigned rank) noexcept
+  { outer.set_lock_rank(rank); }
+  bool try_lock_outer() noexcept { return outer.try_lock(); }
   void lock_outer() noexcept { outer.lock(); }
+#ifdef __cpp_impl_coroutine
+  /** @return an awaitable for acquiring outer in a coroutine */
+  template<typename... Executor>
+  auto async_lock_outer(const Executor&... e) noexcept
+  { return outer.async_lock(e...); }
+#endif
   void spin_lock_outer(unsigned spin_rounds) noexcept
   { outer.spin_lock(spin_rounds); }
+  void spin_lock_outer(adaptive_spin_rounds &spin) noexcept
+  { outer.spin_lock(spin); }
   void unlock_outer() noexcept { outer.unlock(); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return outer.try_lock_until(deadline); }
 
   /** Try to acquire a shared mutex
   @return whether the shared mutex was acquired */
@@ -40,13 +129,94 @@ private:
         return false;
     return true;
   }
+  /** phase_fair: Wait for a blocked shared lock to be granted
+  @param deadline  when to give up waiting
+  @return whether the shared lock was acquired */
+  bool shared_lock_inner_wait(std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** prefer_writer: Wait for X to be released, and acquire a shared lock.
+  All waiters will be woken up at once by unlock_inner() or
+  update_lock_downgrade_inner(), instead of acquiring outer in turn.
+  @param deadline     when to give up waiting
+  @param spin_rounds  maximum number of spinloop rounds
+  @return whether the shared lock was acquired */
+  bool shared_lock_x_wait(std::chrono::steady_clock::time_point deadline,
+                          unsigned spin_rounds = 0) noexcept;
+  static unsigned spin_rounds(unsigned spin) noexcept { return spin; }
+  static unsigned spin_rounds(adaptive_spin_rounds &spin) noexcept
+  { return spin.rounds(); }
+  /** Wait for a shared lock after shared_lock_inner() failed */
+  void shared_lock_wait() noexcept
+  {
+    if (policy == shared_mutex_policy::phase_fair)
+    {
+      shared_lock_inner_wait(std::chrono::steady_clock::time_point::max());
+      return;
+    }
+    if (policy == shared_mutex_policy::prefer_writer)
+    {
+      shared_lock_x_wait(std::chrono::steady_clock::time_point::max());
+      return;
+    }
+    bool acquired;
+    do {
+      lock_outer();
+      acquired = shared_lock_inner();
+      unlock_outer();
+    } while (!acquired);
+  }
+  /** Wait for a shared lock after shared_lock_inner() failed,
+  with an initial spinloop */
+  template<typename Spin> void spin_shared_lock_wait(Spin &spin) noexcept
+  {
+    if (policy == shared_mutex_policy::phase_fair)
+    {
+      /* The S lock will be granted by unlock() or update_lock_downgrade(),
+      which do not require us to spin on outer. */
+      shared_lock_wait();
+      return;
+    }
+    if (policy == shared_mutex_policy::prefer_writer)
+    {
+      shared_lock_x_wait(std::chrono::steady_clock::time_point::max(),
+                         spin_rounds(spin));
+      return;
+    }
+    spin_lock_outer(spin);
+    bool acquired = shared_lock_inner();
+    unlock_outer();
+    if (!acquired)
+      shared_lock_wait();
+  }
+  /** Wait for a shared lock after shared_lock_inner() failed,
+  unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (policy == shared_mutex_policy::phase_fair)
+      return shared_lock_inner_wait(deadline);
+    if (policy == shared_mutex_policy::prefer_writer)
+      return shared_lock_x_wait(deadline);
+    while (lock_outer_until(deadline))
+    {
+      bool acquired = shared_lock_inner();
+      unlock_outer();
+      if (acquired)
+        return true;
+    }
+    return false;
+  }
   /** Release a shared mutex
   @return whether an exclusive mutex is being waited for */
   bool shared_unlock_inner() noexcept
   {
     type lk = inner.fetch_sub(WAITER, std::memory_order_release);
-    assert(~X & lk);
-    return lk == X + WAITER;
+    assert(SHARED & lk);
+    if (policy == shared_mutex_policy::prefer_reader)
+      return lk == PENDING + WAITER;
+    return (lk & (X | SHARED)) == X + WAITER;
   }
 
   /** For atomic_shared_mutex::lock()
@@ -54,67 +224,298 @@ private:
   @retval 0 if the exclusive lock was granted */
   type lock_inner() noexcept
   {
+    if (policy == shared_mutex_policy::prefer_reader)
+    {
+      type lk = 0;
+      if (inner.compare_exchange_strong(lk, X, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        return 0;
+      /* Only the holder of outer may set PENDING or X. */
+      return PENDING + inner.fetch_add(PENDING, std::memory_order_relaxed);
+    }
 #if defined __i386__||defined __x86_64__||defined _M_IX86||defined _M_IX64
     /* On IA-32 and AMD64, this type of fetch_or() can only be implemented
     as a loop around LOCK CMPXCHG. In this particular case, toggling the
     most significant bit using fetch_add() is equivalent, and is
     translated into a simple LOCK XADD. */
-    return inner.fetch_add(X, std::memory_order_acquire);
+    return inner.fetch_add(X, std::memory_order_acquire) & SHARED;
 #endif
-    return inner.fetch_or(X, std::memory_order_acquire);
+    return inner.fetch_or(X, std::memory_order_acquire) & SHARED;
   }
 
   /** Wait for an exclusive lock to be granted (any S locks to be released)
-  @param lk  recent number of conflicting S lock holders */
+  @param lk  lock word that was returned by lock_inner() */
   void lock_inner_wait(type lk) noexcept;
+  /** Wait for an exclusive lock to be granted, unless a deadline is reached.
+  On timeout, the lock_inner() will be rolled back.
+  @param lk        lock word that was returned by lock_inner()
+  @param deadline  when to give up waiting
+  @return whether the exclusive lock was granted */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept;
+
+  /** phase_fair: End a write phase, and grant the blocked shared locks
+  @param lk  number of shared locks to keep holding */
+  void unlock_inner_phase(type lk) noexcept;
+  /** prefer_writer: Wake up the lock_shared() that set SHARED_WAITING,
+  after X was released */
+  void shared_waiting_notify() noexcept;
 
   /** Release an exclusive lock of an atomic_shared_mutex */
   void unlock_inner() noexcept
   {
     assert(this->is_locked());
-    inner.store(0, std::memory_order_release);
+    if (policy == shared_mutex_policy::phase_fair)
+      unlock_inner_phase(0);
+    else if (policy == shared_mutex_policy::prefer_writer)
+    {
+      if (inner.exchange(0, std::memory_order_release) & SHARED_WAITING)
+        shared_waiting_notify();
+    }
+    else
+      inner.store(0, std::memory_order_release);
   }
 
-#if !defined _WIN32 && __cplusplus < 202002L /* Emulate the C++20 primitives */
-  void shared_unlock_inner_notify() noexcept;
-#else
   /** Notify waiters after shared_unlock_inner() returned true */
-  void shared_unlock_inner_notify() noexcept { inner.notify_one(); }
-#endif
+  void shared_unlock_inner_notify() noexcept;
 
-  /** For atomic_shared_mutex::update_lock() */
+  /** For atomic_shared_mutex::lock_update(). The update lock is
+  represented by outer alone, so that it will not write inner, which
+  would abort any memory transactions of elided lock_shared(). */
   void update_lock_inner() noexcept
-  {
-    assert(outer.get_storage().is_locked());
-#ifndef NDEBUG
-    type lk =
-#endif
-      inner.fetch_add(WAITER, std::memory_order_acquire);
-    assert(lk < X - WAITER);
-  }
-  /** For atomic_shared_mutex::update_lock_upgrade() */
+  { assert(outer.get_storage().is_locked()); }
+  /** For atomic_shared_mutex::update_lock_upgrade()
+  @return lock word to be passed to lock_inner_wait()
+  @retval 0 if the exclusive lock was granted */
   type update_lock_upgrade_inner() noexcept
   {
     assert(outer.get_storage().is_locked());
-    return inner.fetch_add(X - WAITER, std::memory_order_acquire) - WAITER;
+    return lock_inner();
   }
   /** For atomic_shared_mutex::update_lock_downgrade() */
   void update_lock_downgrade_inner() noexcept
   {
     assert(outer.get_storage().is_locked());
-    assert(this->is_locked());
-    inner.store(WAITER, std::memory_order_release);
+    unlock_inner();
   }
   /** For atomic_shared_mutex::unlock_update() */
   void update_unlock_inner() noexcept
+  { assert(outer.get_storage().is_locked()); assert(!this->is_locked()); }
+  /** For atomic_shared_mutex::try_lock_shared_upgrade(): convert
+  the S lock of the current thread into an update lock. No lock() can
+  be waiting for it, because we are holding outer. */
+  void shared_to_update_inner() noexcept
   {
     assert(outer.get_storage().is_locked());
 #ifndef NDEBUG
     type lk =
 #endif
-      inner.fetch_sub(WAITER, std::memory_order_release);
-    assert(lk);
-    assert(lk < X);
+      inner.fetch_sub(WAITER, std::memory_order_relaxed);
+    assert(lk & SHARED);
+    assert(!(lk & X));
+  }
+  /** For atomic_shared_mutex::lock_downgrade_to_shared() */
+  void update_to_shared_inner() noexcept
+  {
+    assert(outer.get_storage().is_locked());
+#ifndef NDEBUG
+    type lk =
+#endif
+      inner.fetch_add(WAITER, std::memory_order_relaxed);
+    assert(!(lk & X));
+    assert((lk & SHARED) < SHARED);
+  }
+};
+
+/** A drop-in alternative to shared_mutex_storage for locks that are
+rarely acquired in exclusive mode. Each thread increments and decrements
+a reader counter in a cache line of its own, so that lock_shared() on
+different cores will not contend for a single lock word. In exchange,
+lock() and update_lock_upgrade() must scan all the counters.
+
+Because the ownership of a shared lock may be transferred to another
+thread, an individual counter may wrap around, but their sum is exact.
+
+@tparam T       the type of the lock words
+@tparam shards  number of reader counters */
+template<typename T = uint32_t, unsigned shards = 64>
+class sharded_shared_mutex_storage
+{
+  /** A reader counter, padded to a typical cache line size */
+  struct alignas(64) shard { std::atomic<T> readers; };
+  // exposition only
+  shard reader[shards];
+  /** X, and a count that is incremented on unlock_shared() while X is set */
+  std::atomic<T> inner;
+  atomic_mutex<mutex_storage<T>> outer;
+  using type = T;
+  static constexpr type X = type(~(type(~type(0)) >> 1));
+  static constexpr type WAITER = 1;
+  static_assert(shards > 0, "at least one reader counter is needed");
+
+public:
+  /** @return whether an exclusive lock is being held or waited for */
+  constexpr bool is_locked() const noexcept
+  { return inner.load(std::memory_order_acquire) & X; }
+  constexpr bool is_locked_or_waiting() const noexcept
+  { return outer.get_storage().is_locked_or_waiting() || is_locked(); }
+  /** @return whether the mutex of lock() and lock_update() is being
+  held or waited for */
+  constexpr bool is_outer_locked_or_waiting() const noexcept
+  { return outer.get_storage().is_locked_or_waiting(); }
+private:
+  friend class atomic_shared_mutex<sharded_shared_mutex_storage>;
+  friend class profiled_shared_mutex_storage<sharded_shared_mutex_storage>;
+  /** @return default argument for spin_lock_outer() */
+  static unsigned default_spin_rounds();
+
+  /** @return the reader counter of the current thread */
+  std::atomic<T> &readers() noexcept
+  {
+    static std::atomic<unsigned> threads;
+    static thread_local const unsigned i =
+      threads.fetch_add(1, std::memory_order_relaxed) % shards;
+    return reader[i].readers;
+  }
+  /** @return the number of shared lock holders */
+  type count() const noexcept
+  {
+    type n = 0;
+    for (const shard &s : reader)
+      n += s.readers.load(std::memory_order_seq_cst);
+    return n;
+  }
+
+  /** For atomic_shared_mutex::set_lock_rank() */
+  void set_outer_lock_rank(unsigned rank) noexcept
+  { outer.set_lock_rank(rank); }
+  bool try_lock_outer() noexcept { return outer.try_lock(); }
+  void lock_outer() noexcept { outer.lock(); }
+  void spin_lock_outer(unsigned spin_rounds) noexcept
+  { outer.spin_lock(spin_rounds); }
+  void spin_lock_outer(adaptive_spin_rounds &spin) noexcept
+  { outer.spin_lock(spin); }
+  void unlock_outer() noexcept { outer.unlock(); }
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  { return outer.try_lock_until(deadline); }
+
+  /** Try to acquire a shared mutex
+  @return whether the shared mutex was acquired */
+  bool shared_lock_inner() noexcept
+  {
+    std::atomic<T> &r = readers();
+    r.fetch_add(WAITER, std::memory_order_seq_cst);
+    if (!(inner.load(std::memory_order_seq_cst) & X))
+      return true;
+    /* A lock() may have counted us; back off. */
+    if (shared_unlock_inner())
+      shared_unlock_inner_notify();
+    return false;
+  }
+  /** Wait for a shared lock after shared_lock_inner() failed */
+  void shared_lock_wait() noexcept
+  {
+    bool acquired;
+    do {
+      lock_outer();
+      acquired = shared_lock_inner();
+      unlock_outer();
+    } while (!acquired);
+  }
+  /** Wait for a shared lock after shared_lock_inner() failed,
+  with an initial spinloop */
+  template<typename Spin> void spin_shared_lock_wait(Spin &spin) noexcept
+  {
+    spin_lock_outer(spin);
+    bool acquired = shared_lock_inner();
+    unlock_outer();
+    if (!acquired)
+      shared_lock_wait();
+  }
+  /** Wait for a shared lock after shared_lock_inner() failed,
+  unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the shared lock was acquired */
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    while (lock_outer_until(deadline))
+    {
+      bool acquired = shared_lock_inner();
+      unlock_outer();
+      if (acquired)
+        return true;
+    }
+    return false;
+  }
+  /** Release a shared mutex
+  @return whether an exclusive mutex is being waited for */
+  bool shared_unlock_inner() noexcept
+  {
+    readers().fetch_sub(WAITER, std::memory_order_seq_cst);
+    return inner.load(std::memory_order_seq_cst) & X;
+  }
+  /** Notify waiters after shared_unlock_inner() returned true */
+  void shared_unlock_inner_notify() noexcept;
+
+  /** For atomic_shared_mutex::lock()
+  @return number of conflicting S lock holders
+  @retval 0 if the exclusive lock was granted */
+  type lock_inner() noexcept
+  {
+    assert(outer.get_storage().is_locked());
+    assert(!is_locked());
+    inner.store(X, std::memory_order_seq_cst);
+    return count();
+  }
+  /** Wait for an exclusive lock to be granted (any S locks to be released)
+  @param lk  recent number of conflicting S lock holders */
+  void lock_inner_wait(type lk) noexcept;
+  /** Wait for an exclusive lock to be granted, unless a deadline is reached.
+  On timeout, the lock_inner() will be rolled back.
+  @param lk        recent number of conflicting S lock holders
+  @param deadline  when to give up waiting
+  @return whether the exclusive lock was granted */
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept;
+  /** Release an exclusive lock of an atomic_shared_mutex */
+  void unlock_inner() noexcept
+  {
+    assert(is_locked());
+    inner.store(0, std::memory_order_release);
+  }
+
+  /** For atomic_shared_mutex::lock_update(). The update lock is
+  represented by outer alone. */
+  void update_lock_inner() noexcept
+  { assert(outer.get_storage().is_locked()); }
+  /** For atomic_shared_mutex::update_lock_upgrade()
+  @return number of conflicting S lock holders
+  @retval 0 if the exclusive lock was granted */
+  type update_lock_upgrade_inner() noexcept { return lock_inner(); }
+  /** For atomic_shared_mutex::update_lock_downgrade() */
+  void update_lock_downgrade_inner() noexcept { unlock_inner(); }
+  /** For atomic_shared_mutex::unlock_update() */
+  void update_unlock_inner() noexcept
+  { assert(outer.get_storage().is_locked()); assert(!is_locked()); }
+  /** For atomic_shared_mutex::try_lock_shared_upgrade(): convert
+  the S lock of the current thread into an update lock. No lock() can
+  be waiting for it, because we are holding outer. */
+  void shared_to_update_inner() noexcept
+  {
+    assert(outer.get_storage().is_locked());
+    assert(!is_locked());
+    readers().fetch_sub(WAITER, std::memory_order_relaxed);
+  }
+  /** For atomic_shared_mutex::lock_downgrade_to_shared() */
+  void update_to_shared_inner() noexcept
+  {
+    assert(outer.get_storage().is_locked());
+    assert(!is_locked());
+    readers().fetch_add(WAITER, std::memory_order_relaxed);
   }
 };
 
@@ -127,9 +528,15 @@ At most one thread may hold an update lock at a time.
 
 As long as no thread is holding an exclusive lock, any number of
 threads may hold a shared lock.
-If a thread is waiting for an exclusive lock(), further concurrent
-lock_shared() requests will be blocked until the exclusive lock has
-been granted and released in unlock().
+By default, if a thread is waiting for an exclusive lock(), further
+concurrent lock_shared() requests will be blocked until the exclusive
+lock has been granted and released in unlock(). Other policies may be
+chosen at compilation time, for example
+atomic_shared_mutex<shared_mutex_storage<uint32_t,
+                    shared_mutex_policy::phase_fair>>;
+see shared_mutex_policy. For locks that are rarely acquired in
+exclusive mode, sharded_shared_mutex_storage avoids contention between
+concurrent lock_shared().
 
 This is based on the ssux_lock in MariaDB Server 10.6.
 
@@ -145,41 +552,42 @@ lock(), but allows concurrent locks_shared().
 We also define the operations try_lock_update(), unlock_update().
 For conversions between update locks and exclusive locks, we define
 update_lock_upgrade(), lock_update_downgrade().
+A shared lock may be upgraded by try_lock_shared_upgrade(), which only
+succeeds if no update or exclusive lock is being held or waited for,
+and an exclusive lock may be downgraded by lock_downgrade_to_shared().
+
+Like std::shared_timed_mutex, we define try_lock_for(), try_lock_until(),
+try_lock_shared_for(), try_lock_shared_until(), and likewise
+try_lock_update_for() and try_lock_update_until().
 
 We define spin_lock(), spin_lock_shared(), and spin_lock_update(),
 which are like lock(), lock_shared(), lock_update(), but with an
-initial spinloop.
+initial spinloop. The spinloop budget may be specified as a number
+of rounds, by adaptive_spin_rounds, or by default (SPINLOOP).
 
 For efficiency, we rely on two wait queues that are provided by the
 runtime system or the operating system kernel: the one in the mutex for
 exclusive locking, and another for waking up an exclusive lock waiter
 that is already holding the mutex, once the last shared lock is released.
-We count shared locks to have necessary and sufficient notify_one() calls. */
+We count shared locks to have necessary and sufficient notify_one() calls.
+With prefer_writer or phase_fair, lock_shared() that conflict with an
+exclusive lock wait in the latter queue, so that unlock() can wake up
+all of them at once. */
 template<typename Storage = shared_mutex_storage<>>
 class atomic_shared_mutex
 {
   Storage storage;
 
   /** Wait for a shared lock to be granted (any X lock to be released) */
-  void shared_lock_wait() noexcept
-  {
-    bool acquired;
-    do {
-      storage.lock_outer();
-      acquired = storage.shared_lock_inner();
-      storage.unlock_outer();
-    } while (!acquired);
-  }
+  void shared_lock_wait() noexcept { storage.shared_lock_wait(); }
   /** Wait for a shared lock to be granted (any X lock to be released),
   with initial spinloop. */
   void spin_shared_lock_wait(unsigned spin_rounds) noexcept
-  {
-    storage.spin_lock_outer(spin_rounds);
-    bool acquired = storage.shared_lock_inner();
-    storage.unlock_outer();
-    if (!acquired)
-      shared_lock_wait();
-  }
+  { storage.spin_shared_lock_wait(spin_rounds); }
+  /** Wait for a shared lock to be granted (any X lock to be released),
+  with initial adaptive spinloop. */
+  void spin_shared_lock_wait(adaptive_spin_rounds &spin) noexcept
+  { storage.spin_shared_lock_wait(spin); }
 
   /** Increment the shared lock count while holding the mutex */
   void shared_acquire() noexcept
@@ -202,6 +610,22 @@ class atomic_shared_mutex
       __tsan_mutex_post_lock(&storage, __tsan_mutex_try_lock, 0);
   }
 
+  /** Acquire an exclusive lock while holding lock_outer(),
+  unless a deadline is reached
+  @param deadline  when to give up waiting
+  @return whether the exclusive lock was acquired */
+  bool lock_inner_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_lock);
+    auto lk = storage.lock_inner();
+    bool acquired = !lk || storage.lock_inner_wait_until(lk, deadline);
+    __tsan_mutex_post_lock(&storage, acquired
+                           ? __tsan_mutex_try_lock
+                           : __tsan_mutex_try_lock_failed, 0);
+    return acquired;
+  }
+
 public:
 #ifdef __SANITIZE_THREAD__
   atomic_shared_mutex()
@@ -219,6 +643,13 @@ public:
 
   constexpr const Storage& get_storage() const { return storage; }
 
+  /** Assign a rank to the lock, for WITH_LOCK_ORDER; see lock_order.h */
+  void set_lock_rank(unsigned rank) noexcept
+  {
+    lock_order_set_rank(&storage, rank);
+    storage.set_outer_lock_rank(rank);
+  }
+
   /** Try to acquire a shared lock.
   @return whether the S lock was acquired */
   bool try_lock_shared() noexcept
@@ -226,8 +657,8 @@ public:
     __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_read_lock);
     bool acquired = storage.shared_lock_inner();
     __tsan_mutex_post_lock(&storage, acquired
-                           ? __tsan_mutex_try_read_lock_failed
-                           : __tsan_mutex_try_read_lock, 0);
+                           ? __tsan_mutex_try_read_lock
+                           : __tsan_mutex_try_read_lock_failed, 0);
     return acquired;
   }
 
@@ -235,7 +666,7 @@ public:
   @return whether the U lock was acquired */
   bool try_lock_update() noexcept
   {
-    if (!storage.outer.try_lock())
+    if (!storage.try_lock_outer())
       return false;
     __tsan_mutex_pre_lock(&storage, __tsan_mutex_read_lock);
     storage.update_lock_inner();
@@ -247,14 +678,77 @@ public:
   @return whether the X lock was acquired */
   bool try_lock() noexcept
   {
-    if (!storage.outer.try_lock())
+    if (!storage.try_lock_outer())
       return false;
-    __tsan_mutex_pre_lock(&storage, 0);
     lock_inner();
-    __tsan_mutex_post_lock(&storage, 0, 0);
     return true;
   }
 
+  /** Try to acquire a shared lock, waiting until a deadline
+  @param deadline  when to give up waiting
+  @return whether the S lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_shared_until(const std::chrono::time_point<Clock,Duration>
+                             &deadline) noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_try_read_lock);
+    bool acquired = storage.shared_lock_inner() ||
+      storage.shared_lock_wait_until(steady_deadline(deadline));
+    __tsan_mutex_post_lock(&storage, acquired
+                           ? __tsan_mutex_try_read_lock
+                           : __tsan_mutex_try_read_lock_failed, 0);
+    return acquired;
+  }
+  /** Try to acquire a shared lock, waiting for at most a specified time
+  @param timeout  how long to wait
+  @return whether the S lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_shared_for(const std::chrono::duration<Rep,Period> &timeout)
+    noexcept
+  { return try_lock_shared_until(std::chrono::steady_clock::now() + timeout); }
+
+  /** Try to acquire an update lock, waiting until a deadline
+  @param deadline  when to give up waiting
+  @return whether the U lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_update_until(const std::chrono::time_point<Clock,Duration>
+                             &deadline) noexcept
+  {
+    if (!storage.lock_outer_until(steady_deadline(deadline)))
+      return false;
+    shared_acquire();
+    return true;
+  }
+  /** Try to acquire an update lock, waiting for at most a specified time
+  @param timeout  how long to wait
+  @return whether the U lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_update_for(const std::chrono::duration<Rep,Period> &timeout)
+    noexcept
+  { return try_lock_update_until(std::chrono::steady_clock::now() + timeout); }
+
+  /** Try to acquire an exclusive lock, waiting until a deadline
+  @param deadline  when to give up waiting
+  @return whether the X lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock,Duration> &deadline)
+    noexcept
+  {
+    const auto steady = steady_deadline(deadline);
+    if (!storage.lock_outer_until(steady))
+      return false;
+    if (lock_inner_until(steady))
+      return true;
+    storage.unlock_outer();
+    return false;
+  }
+  /** Try to acquire an exclusive lock, waiting for at most a specified time
+  @param timeout  how long to wait
+  @return whether the X lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep,Period> &timeout) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + timeout); }
+
   /** Acquire a shared lock (which can coexist with S or U locks). */
   void lock_shared() noexcept
   {
@@ -270,6 +764,13 @@ public:
       spin_shared_lock_wait(spin_rounds);
     __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
   }
+  void spin_lock_shared(adaptive_spin_rounds &spin) noexcept
+  {
+    __tsan_mutex_pre_lock(&storage, __tsan_mutex_read_lock);
+    if (!storage.shared_lock_inner())
+      spin_shared_lock_wait(spin);
+    __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
+  }
   void spin_lock_shared() noexcept
   { return spin_lock_shared(storage.default_spin_rounds()); }
 
@@ -277,6 +778,8 @@ public:
   void lock_update() noexcept { storage.lock_outer(); shared_acquire(); }
   void spin_lock_update(unsigned spin_rounds) noexcept
   { storage.spin_lock_outer(spin_rounds); shared_acquire(); }
+  void spin_lock_update(adaptive_spin_rounds &spin) noexcept
+  { storage.spin_lock_outer(spin); shared_acquire(); }
   void spin_lock_update() noexcept
   { return spin_lock_update(storage.default_spin_rounds()); }
 
@@ -284,9 +787,33 @@ public:
   void lock() noexcept { storage.lock_outer(); lock_inner(); }
   void spin_lock(unsigned spin_rounds) noexcept
   { storage.spin_lock_outer(spin_rounds); lock_inner(); }
+  void spin_lock(adaptive_spin_rounds &spin) noexcept
+  { storage.spin_lock_outer(spin); lock_inner(); }
   void spin_lock() noexcept
   { return spin_lock(storage.default_spin_rounds()); }
 
+#ifdef __cpp_impl_coroutine
+  /** Acquire a shared lock in a coroutine: co_await sux.async_lock_shared();
+  see async_mutex.h
+  @param e  optional async_executor for resuming the coroutine */
+  template<typename... Executor>
+  auto async_lock_shared(const Executor&... e) noexcept
+  { return async_shared_lock<Storage, async_lock_mode::shared>{storage, e...}; }
+  /** Acquire an update lock in a coroutine
+  @param e  optional async_executor for resuming the coroutine */
+  template<typename... Executor>
+  auto async_lock_update(const Executor&... e) noexcept
+  { return async_shared_lock<Storage, async_lock_mode::update>{storage, e...}; }
+  /** Acquire an exclusive lock in a coroutine
+  @param e  optional async_executor for resuming the coroutine */
+  template<typename... Executor>
+  auto async_lock(const Executor&... e) noexcept
+  {
+    return async_shared_lock<Storage, async_lock_mode::exclusive>
+      {storage, e...};
+  }
+#endif
+
   /** Upgrade an update lock to exclusive. */
   void update_lock_upgrade() noexcept
   {
@@ -306,8 +833,33 @@ public:
     storage.update_lock_downgrade_inner();
     __tsan_mutex_post_unlock(&storage, 0);
     __tsan_mutex_post_lock(&storage, __tsan_mutex_read_lock, 0);
-    /* Note: Any pending lock_shared() will not be woken up until
-       unlock_update() */
+    /* Note: With prefer_reader, any pending lock_shared() will not be
+       woken up until unlock_update() */
+  }
+
+  /** Try to upgrade a shared lock to exclusive, without releasing it.
+  This will only succeed if the mutex for lock() and lock_update() is
+  available; then, the shared lock will be converted into an update lock
+  and upgraded, waiting for any other shared locks to be released.
+  On failure, the shared lock will remain held. Before invoking lock(),
+  the caller must release it, or it could deadlock with an update lock
+  holder that is waiting in update_lock_upgrade().
+  @return whether the exclusive lock was acquired */
+  bool try_lock_shared_upgrade() noexcept
+  {
+    if (!storage.try_lock_outer())
+      return false;
+    storage.shared_to_update_inner();
+    update_lock_upgrade();
+    return true;
+  }
+  /** Downgrade an exclusive lock to shared. Unlike unlock() followed by
+  lock_shared(), this does not allow another exclusive lock in between. */
+  void lock_downgrade_to_shared() noexcept
+  {
+    update_lock_downgrade();
+    storage.update_to_shared_inner();
+    storage.unlock_outer();
   }
 
   /** Release a shared lock. */
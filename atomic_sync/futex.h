@@ -0,0 +1,389 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+
+Waiting for a 32-bit word to change, and waking up waiters.
+
+C++20 std::atomic::wait() does not support a timeout. Hence, timed waits
+will invoke the operating system directly.
+
+A thread that is blocked in futex_wait_until() is not known to the C++
+runtime library. Some implementations of std::atomic::notify_one() will
+skip the system call if the runtime library is not aware of any waiters,
+and conversely, a thread that is blocked in std::atomic::wait() might not
+be woken up by a direct system call. Therefore, whenever the operating
+system interface is available, futex_wait() will invoke it directly, and
+futex_wake_one() and futex_wake_all() must be used for waking up waiters,
+whether they are blocked in futex_wait() or futex_wait_until().
+
+Where the operating system only supports waiting for 32-bit words,
+waits for 16-bit or 64-bit words will use a side table of 32-bit
+sequence numbers. Because unrelated words may share an entry,
+futex_wake_one() will wake up all waiters of the entry.
+
+The functions with the suffix _shared, such as futex_wait_shared(),
+operate on 32-bit words in memory that may be shared between processes.
+They are only available (FUTEX_SHARED is defined) where the operating
+system supports this, and they always invoke it directly.
+
+With WITH_PARKING_LOT, all waits are implemented in user space by a
+global table of wait queues that are keyed by address; see
+parking_lot.h. This works for any word size and does not depend on
+std::atomic::wait(), which may be slow in some C++ runtime libraries.
+
+*/
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <climits>
+# include <cerrno>
+# include <ctime>
+# if defined __linux__
+#  include <linux/futex.h>
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#  define FUTEX(op,m,n,t)                                               \
+   syscall(SYS_futex, m, FUTEX_ ## op ## _PRIVATE, n, t, nullptr, 0)
+#  define FUTEX_SHARED(op,m,n,t)                                        \
+   syscall(SYS_futex, m, FUTEX_ ## op, n, t, nullptr, 0)
+#  define FUTEX_TIMEDOUT ETIMEDOUT
+# elif defined __OpenBSD__
+#  include <sys/time.h>
+#  include <sys/futex.h>
+#  define FUTEX(op,m,n,t)                                               \
+   futex((volatile uint32_t*) m, FUTEX_ ## op, n, t, nullptr)
+#  define FUTEX_SHARED FUTEX
+#  define FUTEX_TIMEDOUT ETIMEDOUT
+# elif defined __FreeBSD__
+#  include <sys/types.h>
+#  include <sys/umtx.h>
+#  define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
+#  define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
+#  define FUTEX(op,m,n,t)                                               \
+   _umtx_op((void*) m, FUTEX_ ## op, n, nullptr, (void*) t)
+#  define UMTX_SHARED_WAKE UMTX_OP_WAKE
+#  define UMTX_SHARED_WAIT UMTX_OP_WAIT_UINT
+#  define FUTEX_SHARED(op,m,n,t)                                        \
+   _umtx_op((void*) m, UMTX_SHARED_ ## op, n, nullptr, (void*) t)
+#  define FUTEX_TIMEDOUT ETIMEDOUT
+# elif defined __DragonFly__
+#  include <unistd.h>
+/* umtx_sleep() expects the timeout in microseconds; 0 means no timeout */
+#  define FUTEX_WAKE(m,n,t) umtx_wakeup(m,n)
+#  define FUTEX_WAIT(m,n,t) umtx_sleep(m,n,					\
+                                       t ? int(t->tv_sec * 1000000 +	\
+                                               t->tv_nsec / 1000) | 1 : 0)
+#  define FUTEX(op,m,n,t) FUTEX_ ## op((volatile int*) m, int(n), t)
+#  define FUTEX_SHARED FUTEX
+#  define FUTEX_TIMEDOUT EWOULDBLOCK
+# elif __cplusplus >= 202002L
+#  include <algorithm>
+#  include <thread>
+# elif !defined WITH_PARKING_LOT
+#  error "no C++20 nor futex support"
+# endif
+#endif
+#ifdef WITH_PARKING_LOT
+# include "parking_lot.h"
+#endif
+
+#ifdef FUTEX
+/** @return a relative timeout for FUTEX(WAIT)
+@param timeout  the positive time to wait */
+inline timespec futex_timespec(std::chrono::steady_clock::duration timeout)
+  noexcept
+{
+  const auto ns =
+    std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+  timespec ts;
+# ifdef __DragonFly__
+  /* Avoid an overflow of the microsecond count; the caller will retry. */
+  ts.tv_sec = ns >= 1000000000 ? 1 : 0;
+  ts.tv_nsec = ns >= 1000000000 ? 0 : long(ns);
+# else
+  ts.tv_sec = time_t(ns / 1000000000);
+  ts.tv_nsec = long(ns % 1000000000);
+# endif
+  return ts;
+}
+#endif
+
+/** Wait for a 32-bit word to change.
+@param a    the word
+@param old  the value of a that was last observed */
+inline void futex_wait(const std::atomic<uint32_t> &a, uint32_t old) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_wait(a, old);
+#elif defined _WIN32
+  WaitOnAddress(const_cast<std::atomic<uint32_t>*>(&a), &old, sizeof old,
+                INFINITE);
+#elif defined FUTEX
+  const timespec *t = nullptr;
+  FUTEX(WAIT, &a, old, t);
+#else
+  a.wait(old);
+#endif
+}
+
+/** Wait for a 32-bit word to change, or for a deadline to be reached.
+@param a         the word
+@param old       the value of a that was last observed
+@param deadline  when to give up waiting
+@return whether the wait ended before the deadline */
+inline bool futex_wait_until(const std::atomic<uint32_t> &a, uint32_t old,
+                             std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+#ifdef WITH_PARKING_LOT
+  return parking_lot_wait(a, old, deadline);
+#else
+  const auto timeout = deadline - std::chrono::steady_clock::now();
+  if (timeout <= timeout.zero())
+    return false;
+# ifdef _WIN32
+  const auto ms =
+    std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
+  if (WaitOnAddress(const_cast<std::atomic<uint32_t>*>(&a), &old, sizeof old,
+                    ms < INFINITE - 1 ? DWORD(ms) + 1 : INFINITE - 1) ||
+      GetLastError() != ERROR_TIMEOUT)
+    return true;
+# elif defined FUTEX
+  const timespec ts = futex_timespec(timeout), *t = &ts;
+  if (FUTEX(WAIT, &a, old, t) != -1 || errno != FUTEX_TIMEDOUT)
+    return true;
+# else
+  /* No timed wait is available; poll for a change. */
+  if (a.load(std::memory_order_relaxed) != old)
+    return true;
+  std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>
+                              (timeout, std::chrono::milliseconds(1)));
+# endif
+  return std::chrono::steady_clock::now() < deadline;
+#endif
+}
+
+/** Wake up one thread that is waiting for a 32-bit word to change. */
+inline void futex_wake_one(std::atomic<uint32_t> &a) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_unpark(&a, 1);
+#elif defined _WIN32
+  WakeByAddressSingle(&a);
+#elif defined FUTEX
+  FUTEX(WAKE, &a, 1, nullptr);
+#else
+  a.notify_one();
+#endif
+}
+
+/** Wake up one thread that is waiting for a 32-bit word to change,
+and make any other waiters wait for another word, unless the value
+of the first word has changed.
+@param a    the word
+@param old  the expected value of a
+@param to   the word that the remaining waiters will wait for
+@return whether the operation succeeded; if not, the waiters must be
+woken up by futex_wake_all(a) */
+inline bool futex_requeue(std::atomic<uint32_t> &a, uint32_t old,
+                          std::atomic<uint32_t> &to) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  return parking_lot_requeue(a, old, to);
+#elif defined __linux__
+  return syscall(SYS_futex, &a, FUTEX_CMP_REQUEUE_PRIVATE, 1, long(INT_MAX),
+                 &to, old) != -1;
+#else
+  /* FUTEX_CMP_REQUEUE is specific to Linux. */
+  (void) a; (void) old; (void) to;
+  return false;
+#endif
+}
+
+/** Wake up all threads that are waiting for a 32-bit word to change. */
+inline void futex_wake_all(std::atomic<uint32_t> &a) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_unpark(&a, ~0U);
+#elif defined _WIN32
+  WakeByAddressAll(&a);
+#elif defined FUTEX
+  FUTEX(WAKE, &a, INT_MAX, nullptr);
+#else
+  a.notify_all();
+#endif
+}
+
+#ifdef FUTEX_SHARED
+/** Wait for a 32-bit word in memory that may be shared between
+processes to change. Unlike futex_wait(), this never waits in
+the parking lot, which is specific to a process.
+@param a    the word
+@param old  the value of a that was last observed */
+inline void futex_wait_shared(const std::atomic<uint32_t> &a, uint32_t old)
+  noexcept
+{
+  const timespec *t = nullptr;
+  FUTEX_SHARED(WAIT, &a, old, t);
+}
+
+/** Wait for a 32-bit word in memory that may be shared between
+processes to change, or for a deadline to be reached.
+@param a         the word
+@param old       the value of a that was last observed
+@param deadline  when to give up waiting
+@return whether the wait ended before the deadline */
+inline bool futex_wait_until_shared(const std::atomic<uint32_t> &a,
+                                    uint32_t old,
+                                    std::chrono::steady_clock::time_point
+                                    deadline) noexcept
+{
+  const auto timeout = deadline - std::chrono::steady_clock::now();
+  if (timeout <= timeout.zero())
+    return false;
+  const timespec ts = futex_timespec(timeout), *t = &ts;
+  if (FUTEX_SHARED(WAIT, &a, old, t) != -1 || errno != FUTEX_TIMEDOUT)
+    return true;
+  return std::chrono::steady_clock::now() < deadline;
+}
+
+/** Wake up one thread that is waiting in futex_wait_shared() */
+inline void futex_wake_one_shared(std::atomic<uint32_t> &a) noexcept
+{ FUTEX_SHARED(WAKE, &a, 1, nullptr); }
+
+/** Wake up all threads that are waiting in futex_wait_shared() */
+inline void futex_wake_all_shared(std::atomic<uint32_t> &a) noexcept
+{ FUTEX_SHARED(WAKE, &a, INT_MAX, nullptr); }
+#endif
+
+#if defined FUTEX && !defined WITH_PARKING_LOT
+/** @return the side table entry for waiting for a 16-bit or 64-bit word
+@param a  the address of the word */
+inline std::atomic<uint32_t> &futex_side_word(const void *a) noexcept
+{
+  struct alignas(64) entry { std::atomic<uint32_t> seq; };
+  static entry table[64];
+  return table[uint32_t(uintptr_t(a) >> 1) * 0x9E3779B1U >> 26].seq;
+}
+#endif
+
+/** Wait for a 16-bit or 64-bit word to change.
+@param a    the word
+@param old  the value of a that was last observed */
+template<typename T>
+inline void futex_wait(const std::atomic<T> &a, T old) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_wait(a, old);
+#elif defined _WIN32
+  WaitOnAddress(const_cast<std::atomic<T>*>(&a), &old, sizeof old, INFINITE);
+#elif defined FUTEX
+  /* Read the sequence number before a, so that a wakeup cannot be missed. */
+  std::atomic<uint32_t> &seq = futex_side_word(&a);
+  const uint32_t s = seq.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (a.load(std::memory_order_relaxed) == old)
+    futex_wait(seq, s);
+#else
+  a.wait(old);
+#endif
+}
+
+/** Wait for a 16-bit or 64-bit word to change, or for a deadline.
+@param a         the word
+@param old       the value of a that was last observed
+@param deadline  when to give up waiting
+@return whether the wait ended before the deadline */
+template<typename T>
+inline bool futex_wait_until(const std::atomic<T> &a, T old,
+                             std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+#ifdef WITH_PARKING_LOT
+  return parking_lot_wait(a, old, deadline);
+#elif defined FUTEX
+  std::atomic<uint32_t> &seq = futex_side_word(&a);
+  const uint32_t s = seq.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return a.load(std::memory_order_relaxed) != old ||
+    futex_wait_until(seq, s, deadline);
+#else
+  const auto timeout = deadline - std::chrono::steady_clock::now();
+  if (timeout <= timeout.zero())
+    return false;
+# ifdef _WIN32
+  const auto ms =
+    std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
+  if (WaitOnAddress(const_cast<std::atomic<T>*>(&a), &old, sizeof old,
+                    ms < INFINITE - 1 ? DWORD(ms) + 1 : INFINITE - 1) ||
+      GetLastError() != ERROR_TIMEOUT)
+    return true;
+# else
+  /* No timed wait is available; poll for a change. */
+  if (a.load(std::memory_order_relaxed) != old)
+    return true;
+  std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>
+                              (timeout, std::chrono::milliseconds(1)));
+# endif
+  return std::chrono::steady_clock::now() < deadline;
+#endif
+}
+
+/** Wake up one thread that is waiting for a 16-bit or 64-bit word. */
+template<typename T>
+inline void futex_wake_one(std::atomic<T> &a) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_unpark(&a, 1);
+#elif defined _WIN32
+  WakeByAddressSingle(&a);
+#elif defined FUTEX
+  std::atomic<uint32_t> &seq = futex_side_word(&a);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  seq.fetch_add(1, std::memory_order_relaxed);
+  /* The waiter might not be the first one of the side table entry. */
+  futex_wake_all(seq);
+#else
+  a.notify_one();
+#endif
+}
+
+/** Wake up all threads that are waiting for a 16-bit or 64-bit word. */
+template<typename T>
+inline void futex_wake_all(std::atomic<T> &a) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  parking_lot_unpark(&a, ~0U);
+#elif defined _WIN32
+  WakeByAddressAll(&a);
+#elif defined FUTEX
+  std::atomic<uint32_t> &seq = futex_side_word(&a);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  seq.fetch_add(1, std::memory_order_relaxed);
+  futex_wake_all(seq);
+#else
+  a.notify_all();
+#endif
+}
+
+/** Like futex_requeue(), but make the waiters wait for a 16-bit or
+64-bit word.
+@return whether the operation succeeded */
+template<typename T>
+inline bool futex_requeue(std::atomic<uint32_t> &a, uint32_t old,
+                          std::atomic<T> &to) noexcept
+{
+#ifdef WITH_PARKING_LOT
+  return parking_lot_requeue(a, old, to);
+#elif defined __linux__
+  /* futex_wake_one(to) will wake up all waiters of the side word. */
+  return futex_requeue(a, old, futex_side_word(&to));
+#else
+  (void) a; (void) old; (void) to;
+  return false;
+#endif
+}
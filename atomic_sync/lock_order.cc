@@ -0,0 +1,220 @@
+#include "tsan.h"
+#ifdef WITH_LOCK_ORDER
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+
+namespace
+{
+/** The locks that are being held by a thread */
+struct held_locks
+{
+  /** maximum number of locks in the stack */
+  static constexpr unsigned MAX = 64;
+  /** the locks, in the order of acquisition */
+  const void *lock[MAX];
+  /** number of elements in lock[] */
+  unsigned n;
+  /** number of held locks that did not fit in lock[] */
+  unsigned overflow;
+  /** number of blocking acquisitions, for sampling */
+  unsigned requests;
+};
+
+thread_local held_locks held;
+
+/** A rank of a lock; an entry of an open addressing hash table */
+struct rank_entry
+{
+  /** the lock, FREED, or nullptr if the entry was never used */
+  std::atomic<const void*> lock;
+  /** the rank, or 0 if none */
+  std::atomic<unsigned> rank;
+};
+
+constexpr size_t RANKS = 1U << 16;
+rank_entry ranks[RANKS];
+/** rank_entry::lock of an entry that lock_order_forget() released */
+const void *const FREED = ranks;
+/** maximum number of entries to probe; a lock that does not fit
+will be unranked */
+constexpr size_t MAX_PROBES = 64;
+
+/** @return the initial hash table position of a lock */
+size_t rank_pos(const void *lock) noexcept
+{ return uint32_t(uintptr_t(lock) >> 2) * 0x9E3779B1U >> 16; }
+
+/** @return the hash table entry of a lock, or nullptr if none */
+rank_entry *rank_find(const void *lock) noexcept
+{
+  for (size_t i = rank_pos(lock), probes = MAX_PROBES; probes--;
+       i = (i + 1) % RANKS)
+  {
+    const void *l = ranks[i].lock.load(std::memory_order_acquire);
+    if (l == lock)
+      return &ranks[i];
+    if (!l)
+      break;
+  }
+  return nullptr;
+}
+
+/** @return the rank of a lock, or 0 if none */
+unsigned rank_of(const void *lock) noexcept
+{
+  const rank_entry *e = rank_find(lock);
+  return e ? e->rank.load(std::memory_order_relaxed) : 0;
+}
+
+/** An edge of the lock order graph: to was requested while holding from */
+struct edge
+{
+  const void *from, *to;
+  bool operator==(const edge &e) const noexcept
+  { return from == e.from && to == e.to; }
+};
+struct edge_hash
+{
+  size_t operator()(const edge &e) const noexcept
+  { return std::hash<const void*>()(e.from) * 31 ^
+      std::hash<const void*>()(e.to); }
+};
+
+/** maximum number of edges to record */
+constexpr size_t MAX_EDGES = 1U << 20;
+
+/** protects edges */
+std::mutex edges_mutex;
+/** the sampled lock order graph */
+std::unordered_set<edge, edge_hash> edges;
+
+std::atomic<unsigned> sampling{64};
+std::atomic<lock_order_handler> handler{nullptr};
+
+void report(lock_order_violation v, const void *held, const void *lock)
+  noexcept
+{
+  if (lock_order_handler h = handler.load(std::memory_order_acquire))
+    h(v, held, lock);
+  else
+    fprintf(stderr, "lock_order: %s: %p is being held, requested %p\n",
+            v == lock_order_violation::rank ? "rank"
+            : v == lock_order_violation::inversion ? "inversion"
+            : "sleeping", held, lock);
+}
+}
+
+void lock_order_set_handler(lock_order_handler h) noexcept
+{ handler.store(h, std::memory_order_release); }
+
+void lock_order_set_sampling(unsigned n) noexcept
+{ sampling.store(n, std::memory_order_relaxed); }
+
+void lock_order_set_rank(const void *lock, unsigned rank) noexcept
+{
+  if (rank_entry *e = rank_find(lock))
+  {
+    e->rank.store(rank, std::memory_order_relaxed);
+    if (!rank)
+      e->lock.store(FREED, std::memory_order_release);
+    return;
+  }
+  if (!rank)
+    return;
+  /* Reuse the first entry that is free or was freed. Concurrent
+  invocations for the same lock are not supported. */
+  for (size_t i = rank_pos(lock), probes = MAX_PROBES; probes--;
+       i = (i + 1) % RANKS)
+  {
+    const void *l = ranks[i].lock.load(std::memory_order_relaxed);
+    if ((!l || l == FREED) &&
+        ranks[i].lock.compare_exchange_strong(l, lock,
+                                              std::memory_order_relaxed))
+    {
+      ranks[i].rank.store(rank, std::memory_order_relaxed);
+      return;
+    }
+  }
+  fputs("lock_order: too many ranked locks\n", stderr);
+}
+
+void lock_order_forget(const void *lock) noexcept
+{
+  lock_order_set_rank(lock, 0);
+  std::lock_guard<std::mutex> g{edges_mutex};
+  for (auto i = edges.begin(); i != edges.end(); )
+    if (i->from == lock || i->to == lock)
+      i = edges.erase(i);
+    else
+      ++i;
+}
+
+void lock_order_pre_lock(const void *lock, unsigned flags) noexcept
+{
+  /* A try_lock() cannot deadlock. */
+  if (flags & __tsan_mutex_try_lock || !held.n)
+    return;
+
+  if (const unsigned r = rank_of(lock))
+    for (unsigned i = 0; i < held.n; i++)
+      if (rank_of(held.lock[i]) > r)
+      {
+        report(lock_order_violation::rank, held.lock[i], lock);
+        break;
+      }
+
+  const unsigned s = sampling.load(std::memory_order_relaxed);
+  if (!s || ++held.requests % s)
+    return;
+  /* The handler will be invoked without holding edges_mutex, because it
+  might acquire locks. */
+  const void *inverted = nullptr;
+  {
+    std::lock_guard<std::mutex> g{edges_mutex};
+    for (unsigned i = 0; i < held.n; i++)
+    {
+      const void *h = held.lock[i];
+      if (h == lock)
+        continue;
+      if (edges.count(edge{lock, h}))
+        inverted = h;
+      else if (edges.size() < MAX_EDGES)
+        edges.insert(edge{h, lock});
+    }
+  }
+  if (inverted)
+    report(lock_order_violation::inversion, inverted, lock);
+}
+
+void lock_order_post_lock(const void *lock, unsigned flags) noexcept
+{
+  if (flags & __tsan_mutex_try_lock_failed)
+    return;
+  if (held.n < held_locks::MAX)
+    held.lock[held.n++] = lock;
+  else
+    held.overflow++;
+}
+
+void lock_order_pre_unlock(const void *lock) noexcept
+{
+  for (unsigned i = held.n; i--; )
+    if (held.lock[i] == lock)
+    {
+      for (held.n--; i < held.n; i++)
+        held.lock[i] = held.lock[i + 1];
+      return;
+    }
+  if (held.overflow)
+    held.overflow--;
+}
+
+void lock_order_sleep(const void *cond) noexcept
+{
+  if (held.n)
+    report(lock_order_violation::sleep, held.lock[held.n - 1], cond);
+}
+#endif
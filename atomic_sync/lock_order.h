@@ -0,0 +1,89 @@
+#pragma once
+
+/*
+
+Opt-in validation of the order of lock acquisitions (-DWITH_LOCK_ORDER).
+
+The lock operations of atomic_mutex and atomic_shared_mutex are
+annotated for ThreadSanitizer; see tsan.h. With WITH_LOCK_ORDER (and
+without ThreadSanitizer, which has a deadlock detector of its own),
+the annotations will maintain a stack of the locks that each thread is
+holding, and check each blocking acquisition while locks are being held:
+
+* A lock may be assigned a rank (class), such as the level of a
+latch in a B-tree:
+
+  m.set_lock_rank(3);
+
+Requesting a lock while holding one of a higher rank will be reported.
+Locks of equal rank, such as the mutexes of a striped_lock_table, may
+be acquired in any order, and locks without a rank are not checked.
+
+* One out of every lock_order_set_sampling() blocking acquisitions
+will record the edges from all held locks to the requested one in a
+global graph. A lock order inversion of two locks (A then B, and B then
+A) will be reported when the opposite edge has already been recorded.
+
+* atomic_condition_variable will report any lock that is being held
+while the thread goes to sleep in wait(). Only the mutex that is
+passed to wait() is released during the wait.
+
+The rank check only reads a per-thread stack and a lock-free hash
+table, and only when a lock is requested while holding another one.
+The table has room for 65536 ranks, and a lookup probes at most 64
+entries; a lock that does not fit will be reported and left unranked.
+
+Locks are identified by the address of their Storage. If the memory of
+a lock is reused for another lock, lock_order_forget() must be invoked.
+Locks must be released by the thread that acquired them.
+
+*/
+
+#ifdef WITH_LOCK_ORDER
+/** The kind of a violation */
+enum class lock_order_violation
+{
+  /** a lock was requested while holding a lock of a higher rank */
+  rank,
+  /** two locks were requested in opposite orders */
+  inversion,
+  /** a thread went to sleep in a condition variable while holding a lock */
+  sleep
+};
+
+/** Handler of violations
+@param v     the kind of violation
+@param held  a lock that is being held by the current thread
+@param lock  the lock that is being requested (or the condition variable) */
+typedef void (*lock_order_handler)(lock_order_violation v, const void *held,
+                                   const void *lock);
+
+/** Set the handler of violations
+@param h  the handler, or nullptr to report on stderr */
+void lock_order_set_handler(lock_order_handler h) noexcept;
+/** Set the sampling ratio of the lock order graph
+@param n  one out of n blocking acquisitions will be recorded
+          (0 to disable; default: 64) */
+void lock_order_set_sampling(unsigned n) noexcept;
+/** Assign a rank to a lock
+@param lock  the Storage of the lock
+@param rank  the rank (0 to disable the checks) */
+void lock_order_set_rank(const void *lock, unsigned rank) noexcept;
+/** Discard the rank and the recorded edges of a lock that is being freed
+@param lock  the Storage of the lock */
+void lock_order_forget(const void *lock) noexcept;
+
+/** Check a request of a lock; see __tsan_mutex_pre_lock() */
+void lock_order_pre_lock(const void *lock, unsigned flags) noexcept;
+/** Note that a lock was acquired; see __tsan_mutex_post_lock() */
+void lock_order_post_lock(const void *lock, unsigned flags) noexcept;
+/** Note that a lock is being released; see __tsan_mutex_pre_unlock() */
+void lock_order_pre_unlock(const void *lock) noexcept;
+/** Check that no locks are being held before sleeping
+@param cond  the condition variable */
+void lock_order_sleep(const void *cond) noexcept;
+#else
+inline void lock_order_set_rank(const void *, unsigned) noexcept {}
+inline void lock_order_forget(const void *) noexcept {}
+inline void lock_order_sleep(const void *) noexcept {}
+#endif
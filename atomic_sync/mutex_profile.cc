@@ -0,0 +1,245 @@
+#include "mutex_profile.h"
+#include <algorithm>
+#include <cinttypes>
+#include <functional>
+#include <new>
+#include <unordered_map>
+
+/*
+
+Each thread owns a buffer, which is an open addressing hash table
+that is keyed by the address of the lock. Only the owner thread will
+write to a buffer, using relaxed loads and stores. mutex_profile_top()
+may concurrently read the buffers of all threads. The buffers are
+never freed; when a thread exits, its buffer will be reused by
+another thread.
+
+*/
+
+namespace
+{
+/** The counters of a lock in a thread_buffer */
+enum counter
+{
+  ACQUIRED, CONTENDED, SPUN, SLEPT, TIMEOUTS, WAIT_NS, MAX_HOLD_NS, N_COUNTERS
+};
+
+struct thread_buffer
+{
+  /** number of distinct locks that can be recorded per thread */
+  static constexpr size_t SLOTS = 256;
+  struct slot
+  {
+    /** the lock, or nullptr if the slot is free */
+    std::atomic<const void*> lock;
+    std::atomic<uint64_t> counters[N_COUNTERS];
+  };
+
+  slot slots[SLOTS];
+  /** whether a thread is using this buffer */
+  std::atomic<bool> in_use;
+  /** the next buffer; immutable once the buffer has been published */
+  thread_buffer *next;
+
+  /** @return the counters of a lock, or nullptr if the buffer is full */
+  std::atomic<uint64_t> *find(const void *lock) noexcept
+  {
+    const size_t start = std::hash<const void*>()(lock) % SLOTS;
+    size_t i = start;
+    do
+    {
+      slot &s = slots[i];
+      const void *l = s.lock.load(std::memory_order_relaxed);
+      if (l == lock)
+        return s.counters;
+      if (!l)
+      {
+        /* The counters are zero; publish the slot to readers. */
+        s.lock.store(lock, std::memory_order_release);
+        return s.counters;
+      }
+      i = (i + 1) % SLOTS;
+    }
+    while (i != start);
+    return nullptr;
+  }
+};
+
+/** All thread_buffer that have ever been allocated */
+std::atomic<thread_buffer*> buffers;
+/** Number of events that were lost because a thread_buffer was full */
+std::atomic<uint64_t> overflow;
+
+/** The thread_buffer of the current thread */
+class thread_buffer_owner
+{
+  thread_buffer *buf = nullptr;
+public:
+  ~thread_buffer_owner()
+  {
+    if (buf)
+      buf->in_use.store(false, std::memory_order_release);
+  }
+
+  thread_buffer *get() noexcept
+  {
+    if (buf)
+      return buf;
+    for (thread_buffer *b = buffers.load(std::memory_order_acquire); b;
+         b = b->next)
+    {
+      bool expected = false;
+      if (b->in_use.compare_exchange_strong(expected, true,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed))
+        return buf = b;
+    }
+    thread_buffer *b = new (std::nothrow) thread_buffer();
+    if (!b)
+      return nullptr;
+    b->in_use.store(true, std::memory_order_relaxed);
+    b->next = buffers.load(std::memory_order_relaxed);
+    while (!buffers.compare_exchange_weak(b->next, b,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+    return buf = b;
+  }
+};
+
+thread_local thread_buffer_owner owner;
+
+/** @return the counters of a lock for the current thread */
+std::atomic<uint64_t> *counters(const void *lock) noexcept
+{
+  if (thread_buffer *b = owner.get())
+    if (std::atomic<uint64_t> *c = b->find(lock))
+      return c;
+  overflow.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+/** Increment a counter that only the current thread writes to */
+inline void add(std::atomic<uint64_t> &c, uint64_t n) noexcept
+{ c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+/** Labels that were registered by mutex_profile_label() */
+atomic_mutex<> labels_mutex;
+std::unordered_map<const void*, const char*> *labels;
+}
+
+void mutex_profile_record(const void *lock, mutex_event e,
+                          std::chrono::steady_clock::duration wait) noexcept
+{
+  std::atomic<uint64_t> *c = counters(lock);
+  if (!c)
+    return;
+  switch (e) {
+  case mutex_event::uncontended:
+    add(c[ACQUIRED], 1);
+    return;
+  case mutex_event::spun:
+    add(c[ACQUIRED], 1);
+    add(c[SPUN], 1);
+    break;
+  case mutex_event::slept:
+    add(c[ACQUIRED], 1);
+    /* fall through */
+  case mutex_event::drained:
+    add(c[SLEPT], 1);
+    break;
+  case mutex_event::timed_out:
+    add(c[TIMEOUTS], 1);
+    break;
+  }
+  add(c[CONTENDED], 1);
+  add(c[WAIT_NS],
+      uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).
+               count()));
+}
+
+void mutex_profile_hold(const void *lock,
+                        std::chrono::steady_clock::duration hold) noexcept
+{
+  std::atomic<uint64_t> *c = counters(lock);
+  if (!c)
+    return;
+  const uint64_t ns =
+    uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(hold).
+             count());
+  if (ns > c[MAX_HOLD_NS].load(std::memory_order_relaxed))
+    c[MAX_HOLD_NS].store(ns, std::memory_order_relaxed);
+}
+
+void mutex_profile_label(const void *lock, const char *label)
+{
+  labels_mutex.lock();
+  if (!labels)
+    labels = new std::unordered_map<const void*, const char*>;
+  (*labels)[lock] = label;
+  labels_mutex.unlock();
+}
+
+std::vector<mutex_profile_entry> mutex_profile_top(size_t n)
+{
+  std::unordered_map<const void*, mutex_stats> merged;
+  for (thread_buffer *b = buffers.load(std::memory_order_acquire); b;
+       b = b->next)
+  {
+    for (const thread_buffer::slot &s : b->slots)
+    {
+      const void *lock = s.lock.load(std::memory_order_acquire);
+      if (!lock)
+        continue;
+      mutex_stats &m = merged[lock];
+      m.acquired += s.counters[ACQUIRED].load(std::memory_order_relaxed);
+      m.contended += s.counters[CONTENDED].load(std::memory_order_relaxed);
+      m.spun += s.counters[SPUN].load(std::memory_order_relaxed);
+      m.slept += s.counters[SLEPT].load(std::memory_order_relaxed);
+      m.timeouts += s.counters[TIMEOUTS].load(std::memory_order_relaxed);
+      m.wait_ns += s.counters[WAIT_NS].load(std::memory_order_relaxed);
+      m.max_hold_ns = std::max(m.max_hold_ns, s.counters[MAX_HOLD_NS].
+                               load(std::memory_order_relaxed));
+    }
+  }
+
+  std::vector<mutex_profile_entry> top;
+  top.reserve(merged.size());
+  labels_mutex.lock();
+  for (const auto &m : merged)
+  {
+    const char *label = nullptr;
+    if (labels)
+    {
+      auto l = labels->find(m.first);
+      if (l != labels->end())
+        label = l->second;
+    }
+    top.push_back(mutex_profile_entry{m.first, label, m.second});
+  }
+  labels_mutex.unlock();
+
+  std::sort(top.begin(), top.end(),
+            [](const mutex_profile_entry &a, const mutex_profile_entry &b)
+            {
+              return a.stats.contended != b.stats.contended
+                ? a.stats.contended > b.stats.contended
+                : a.stats.wait_ns > b.stats.wait_ns;
+            });
+  if (top.size() > n)
+    top.resize(n);
+  return top;
+}
+
+void mutex_profile_print(FILE *f, size_t n)
+{
+  for (const mutex_profile_entry &e : mutex_profile_top(n))
+    fprintf(f, "%p %s: acquired %" PRIu64 ", contended %" PRIu64
+            " (spun %" PRIu64 ", slept %" PRIu64 ", timeouts %" PRIu64
+            "), wait %" PRIu64 " ns, max hold %" PRIu64 " ns\n",
+            e.lock, e.label ? e.label : "-",
+            e.stats.acquired, e.stats.contended, e.stats.spun,
+            e.stats.slept, e.stats.timeouts, e.stats.wait_ns,
+            e.stats.max_hold_ns);
+  if (const uint64_t lost = overflow.load(std::memory_order_relaxed))
+    fprintf(f, "%" PRIu64 " events were not recorded\n", lost);
+}
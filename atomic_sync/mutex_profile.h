@@ -0,0 +1,377 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include "atomic_shared_mutex.h"
+
+/*
+
+Opt-in contention profiling of atomic_mutex and atomic_shared_mutex.
+
+A lock is profiled by wrapping its Storage:
+
+  atomic_mutex<profiled_mutex_storage<>> m;
+  atomic_shared_mutex<profiled_shared_mutex_storage<>> sux;
+  mutex_profile_label(&m.get_storage(), "buffer pool");
+
+Locks are identified by the address of their Storage.
+Locks whose Storage is not wrapped are not affected in any way.
+
+Each thread records the events in a buffer of its own, without any
+atomic read-modify-write operations. mutex_profile_top() will merge
+the buffers of all threads, including threads that have exited.
+Statistics are keyed by the address of the lock; if a profiled lock
+is destroyed and another one is created at the same address, their
+statistics will be merged.
+
+*/
+
+/** Statistics of a profiled lock */
+struct mutex_stats
+{
+  /** number of acquisitions */
+  uint64_t acquired;
+  /** number of acquisitions or timed attempts that had to wait */
+  uint64_t contended;
+  /** number of contended acquisitions that succeeded in a spinloop */
+  uint64_t spun;
+  /** number of waits that ended in futex_wait() or similar */
+  uint64_t slept;
+  /** number of timed attempts that failed */
+  uint64_t timeouts;
+  /** total waiting time, in nanoseconds */
+  uint64_t wait_ns;
+  /** maximum time that an exclusive lock was held, in nanoseconds */
+  uint64_t max_hold_ns;
+};
+
+/** An entry that is returned by mutex_profile_top() */
+struct mutex_profile_entry
+{
+  /** the profiled lock */
+  const void *lock;
+  /** the label that was registered by mutex_profile_label(), or nullptr */
+  const char *label;
+  mutex_stats stats;
+};
+
+/** The outcome of an acquisition */
+enum class mutex_event
+{
+  /** acquired without waiting */
+  uncontended,
+  /** acquired in a spinloop */
+  spun,
+  /** acquired after sleeping */
+  slept,
+  /** a timed attempt failed */
+  timed_out,
+  /** an exclusive lock had to wait for shared locks to be released */
+  drained
+};
+
+/** Record an acquisition attempt
+@param lock  the lock
+@param e     the outcome
+@param wait  the waiting time */
+void mutex_profile_record(const void *lock, mutex_event e,
+                          std::chrono::steady_clock::duration wait)
+  noexcept;
+/** Record the release of an exclusive lock
+@param lock  the lock
+@param hold  how long the lock was held */
+void mutex_profile_hold(const void *lock,
+                        std::chrono::steady_clock::duration hold) noexcept;
+/** Tag a lock with a label for mutex_profile_top()
+@param lock   the lock
+@param label  a string constant */
+void mutex_profile_label(const void *lock, const char *label);
+/** @return the n locks that were most frequently contended, in
+descending order of contended and wait_ns */
+std::vector<mutex_profile_entry> mutex_profile_top(size_t n);
+/** Output the n most contended locks */
+void mutex_profile_print(FILE *f, size_t n);
+
+/** Storage for atomic_mutex that records contention statistics.
+@tparam Storage  the storage to be profiled */
+template<typename Storage = mutex_storage<>>
+class profiled_mutex_storage
+{
+  Storage storage;
+  /** when the mutex was acquired; protected by the mutex */
+  std::chrono::steady_clock::time_point acquired_at;
+
+  static std::chrono::steady_clock::time_point now() noexcept
+  { return std::chrono::steady_clock::now(); }
+  /** Record an acquisition attempt
+  @param e      the outcome
+  @param start  when the waiting started */
+  void record(mutex_event e, std::chrono::steady_clock::time_point start)
+    noexcept
+  {
+    const auto t = now();
+    if (e != mutex_event::timed_out)
+      acquired_at = t;
+    mutex_profile_record(this, e, t - start);
+  }
+
+public:
+  bool is_locked() const noexcept { return storage.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return storage.is_locked_or_waiting(); }
+  bool is_locked_not_waiting() const noexcept
+  { return storage.is_locked_not_waiting(); }
+
+private:
+  friend class atomic_mutex<profiled_mutex_storage>;
+
+  static unsigned default_spin_rounds()
+  { return Storage::default_spin_rounds(); }
+
+  bool lock_impl() noexcept
+  {
+    if (!storage.lock_impl())
+      return false;
+    acquired_at = now();
+    mutex_profile_record(this, mutex_event::uncontended, {});
+    return true;
+  }
+  void lock_wait() noexcept
+  {
+    const auto start = now();
+    storage.lock_wait();
+    record(mutex_event::slept, start);
+  }
+  bool lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const auto start = now();
+    bool acquired = storage.lock_wait_until(deadline);
+    record(acquired ? mutex_event::slept : mutex_event::timed_out, start);
+    return acquired;
+  }
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept
+  {
+    const auto start = now();
+    const unsigned spun = storage.spin_lock_wait(spin_rounds);
+    record(spun < spin_rounds ? mutex_event::spun : mutex_event::slept,
+           start);
+    return spun;
+  }
+  bool requeue(std::atomic<uint32_t> &word, uint32_t val, uint32_t n)
+    noexcept
+  { return storage.requeue(word, val, n); }
+  void lock_requeued() noexcept
+  {
+    const auto start = now();
+    storage.lock_requeued();
+    record(mutex_event::slept, start);
+  }
+
+  bool unlock_impl() noexcept
+  {
+    mutex_profile_hold(this, now() - acquired_at);
+    return storage.unlock_impl();
+  }
+  void unlock_notify() noexcept { storage.unlock_notify(); }
+};
+
+/** Storage for atomic_shared_mutex that records contention statistics.
+Acquisitions of lock(), lock_update() and lock_shared() are counted.
+Because the spinloops are internal to Storage, a contended
+spin_lock_shared() or spin_lock() will be counted as slept.
+The hold time covers lock() and lock_update().
+@tparam Storage  the storage to be profiled */
+template<typename Storage = shared_mutex_storage<>>
+class profiled_shared_mutex_storage
+{
+  Storage storage;
+  /** when lock() or lock_update() was acquired; protected by them */
+  std::chrono::steady_clock::time_point acquired_at;
+  /** when a pending lock_outer_until() started waiting */
+  std::chrono::steady_clock::time_point pending_start;
+  /** the outcome of a pending lock_outer_until() */
+  mutex_event pending_event;
+  /** whether lock_outer_until() succeeded, but try_lock_until() may
+  still time out waiting for shared locks; protected by outer */
+  bool outer_pending;
+  using type = decltype(storage.lock_inner());
+
+  static std::chrono::steady_clock::time_point now() noexcept
+  { return std::chrono::steady_clock::now(); }
+  /** Record an acquisition attempt
+  @param e      the outcome
+  @param start  when the waiting started */
+  void record(mutex_event e, std::chrono::steady_clock::time_point start)
+    noexcept
+  { mutex_profile_record(this, e, now() - start); }
+  /** Record an acquisition of lock_outer()
+  @param e      the outcome
+  @param start  when the waiting started */
+  void record_outer(mutex_event e,
+                    std::chrono::steady_clock::time_point start) noexcept
+  {
+    const auto t = now();
+    if (e != mutex_event::timed_out)
+      acquired_at = t;
+    mutex_profile_record(this, e, t - start);
+  }
+  /** Record a pending acquisition of lock_outer_until() */
+  void record_pending() noexcept
+  {
+    if (!outer_pending)
+      return;
+    outer_pending = false;
+    mutex_profile_record(this, pending_event, acquired_at - pending_start);
+  }
+
+public:
+  bool is_locked() const noexcept { return storage.is_locked(); }
+  bool is_locked_or_waiting() const noexcept
+  { return storage.is_locked_or_waiting(); }
+  bool is_outer_locked_or_waiting() const noexcept
+  { return storage.is_outer_locked_or_waiting(); }
+
+private:
+  friend class atomic_shared_mutex<profiled_shared_mutex_storage>;
+
+  static unsigned default_spin_rounds()
+  { return Storage::default_spin_rounds(); }
+
+  void set_outer_lock_rank(unsigned rank) noexcept
+  { storage.set_outer_lock_rank(rank); }
+  bool try_lock_outer() noexcept
+  {
+    if (!storage.try_lock_outer())
+      return false;
+    acquired_at = now();
+    mutex_profile_record(this, mutex_event::uncontended, {});
+    return true;
+  }
+  void lock_outer() noexcept
+  {
+    if (try_lock_outer())
+      return;
+    const auto start = now();
+    storage.lock_outer();
+    record_outer(mutex_event::slept, start);
+  }
+  template<typename Spin> void spin_lock_outer(Spin &&spin) noexcept
+  {
+    if (try_lock_outer())
+      return;
+    const auto start = now();
+    storage.spin_lock_outer(spin);
+    record_outer(mutex_event::slept, start);
+  }
+  void unlock_outer() noexcept
+  {
+    mutex_profile_hold(this, now() - acquired_at);
+    storage.unlock_outer();
+  }
+  /** Acquire lock_outer(), but defer the recording until it is known
+  whether try_lock_until() or try_lock_update_until() succeeded */
+  bool lock_outer_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    if (storage.try_lock_outer())
+    {
+      pending_start = acquired_at = now();
+      pending_event = mutex_event::uncontended;
+    }
+    else
+    {
+      const auto start = now();
+      if (!storage.lock_outer_until(deadline))
+      {
+        record(mutex_event::timed_out, start);
+        return false;
+      }
+      acquired_at = now();
+      pending_start = start;
+      pending_event = mutex_event::slept;
+    }
+    outer_pending = true;
+    return true;
+  }
+
+  bool shared_lock_inner() noexcept
+  {
+    if (!storage.shared_lock_inner())
+      return false;
+    mutex_profile_record(this, mutex_event::uncontended, {});
+    return true;
+  }
+  void shared_lock_wait() noexcept
+  {
+    const auto start = now();
+    storage.shared_lock_wait();
+    record(mutex_event::slept, start);
+  }
+  template<typename Spin> void spin_shared_lock_wait(Spin &spin) noexcept
+  {
+    const auto start = now();
+    storage.spin_shared_lock_wait(spin);
+    record(mutex_event::slept, start);
+  }
+  bool shared_lock_wait_until(std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const auto start = now();
+    bool acquired = storage.shared_lock_wait_until(deadline);
+    record(acquired ? mutex_event::slept : mutex_event::timed_out, start);
+    return acquired;
+  }
+  bool shared_unlock_inner() noexcept { return storage.shared_unlock_inner(); }
+  void shared_unlock_inner_notify() noexcept
+  { storage.shared_unlock_inner_notify(); }
+
+  type lock_inner() noexcept
+  {
+    const type lk = storage.lock_inner();
+    if (!lk)
+      record_pending();
+    return lk;
+  }
+  void lock_inner_wait(type lk) noexcept
+  {
+    const auto start = now();
+    storage.lock_inner_wait(lk);
+    record(mutex_event::drained, start);
+  }
+  bool lock_inner_wait_until(type lk,
+                             std::chrono::steady_clock::time_point deadline)
+    noexcept
+  {
+    const auto start = now();
+    bool acquired = storage.lock_inner_wait_until(lk, deadline);
+    if (acquired)
+    {
+      record_pending();
+      record(mutex_event::drained, start);
+    }
+    else if (outer_pending)
+    {
+      /* The whole try_lock_until() timed out. */
+      outer_pending = false;
+      record(mutex_event::timed_out, pending_start);
+    }
+    else
+      record(mutex_event::timed_out, start);
+    return acquired;
+  }
+  void unlock_inner() noexcept { storage.unlock_inner(); }
+
+  void update_lock_inner() noexcept
+  {
+    record_pending();
+    storage.update_lock_inner();
+  }
+  type update_lock_upgrade_inner() noexcept
+  { return storage.update_lock_upgrade_inner(); }
+  void update_lock_downgrade_inner() noexcept
+  { storage.update_lock_downgrade_inner(); }
+  void update_unlock_inner() noexcept { storage.update_unlock_inner(); }
+  void shared_to_update_inner() noexcept { storage.shared_to_update_inner(); }
+  void update_to_shared_inner() noexcept { storage.update_to_shared_inner(); }
+};
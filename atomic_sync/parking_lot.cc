@@ -0,0 +1,214 @@
+#include "parking_lot.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace
+{
+/** A thread that is blocked in parking_lot_park() */
+struct parked_thread
+{
+  /** the address being waited for; modified by parking_lot_requeue()
+  while holding the mutex of the old and the new bucket */
+  std::atomic<const void*> addr;
+  /** the next thread in the bucket; protected by the bucket mutex */
+  parked_thread *next;
+  /** whether this is in a bucket; protected by the bucket mutex */
+  bool queued;
+  /** protects woken */
+  std::mutex mutex;
+  /** signalled when woken is set */
+  std::condition_variable cond;
+  /** whether the thread was removed from its bucket and woken up */
+  bool woken;
+};
+
+/** A wait queue, padded to a typical cache line size */
+struct alignas(64) bucket
+{
+  /** protects the queue */
+  std::mutex mutex;
+  /** the oldest waiter */
+  parked_thread *head;
+  /** the most recently queued waiter */
+  parked_thread *tail;
+
+  /** Append a thread to the queue */
+  void push_back(parked_thread *t) noexcept
+  {
+    t->next = nullptr;
+    t->queued = true;
+    if (tail)
+      tail->next = t;
+    else
+      head = t;
+    tail = t;
+  }
+
+  /** Remove a thread from the queue
+  @param t     the thread
+  @param prev  the predecessor of t, or nullptr if t is head */
+  void remove(parked_thread *t, parked_thread *prev) noexcept
+  {
+    (prev ? prev->next : head) = t->next;
+    if (tail == t)
+      tail = prev;
+    t->queued = false;
+  }
+
+  /** Remove a thread from the queue */
+  void remove(parked_thread *t) noexcept
+  {
+    parked_thread *prev = nullptr;
+    for (parked_thread *p = head; p != t; prev = p, p = p->next);
+    remove(t, prev);
+  }
+};
+
+constexpr unsigned BUCKETS = 256;
+bucket buckets[BUCKETS];
+
+/** @return the wait queue for an address */
+bucket &bucket_for(const void *addr) noexcept
+{
+  return buckets[uint32_t(uintptr_t(addr) >> 2) * 0x9E3779B1U >> 24];
+}
+
+/** Wake up threads that were removed from their buckets
+@param t  threads, linked by next */
+void wake(parked_thread *t) noexcept
+{
+  while (t)
+  {
+    /* Once woken is set, the thread may return and destroy *t. */
+    parked_thread *next = t->next;
+    std::lock_guard<std::mutex> g{t->mutex};
+    t->woken = true;
+    t->cond.notify_one();
+    t = next;
+  }
+}
+}
+
+bool parking_lot_park(const void *addr, bool (*validate)(const void *ctx),
+                      const void *ctx,
+                      std::chrono::steady_clock::time_point deadline)
+  noexcept
+{
+  parked_thread t;
+  t.addr.store(addr, std::memory_order_relaxed);
+  t.woken = false;
+
+  {
+    bucket &b = bucket_for(addr);
+    std::lock_guard<std::mutex> g{b.mutex};
+    if (!validate(ctx))
+      return true;
+    b.push_back(&t);
+  }
+
+  std::unique_lock<std::mutex> lk{t.mutex};
+  if (deadline == std::chrono::steady_clock::time_point::max())
+  {
+    while (!t.woken)
+      t.cond.wait(lk);
+    return true;
+  }
+
+  while (!t.woken)
+    if (t.cond.wait_until(lk, deadline) == std::cv_status::timeout)
+      break;
+  if (t.woken)
+    return true;
+  lk.unlock();
+
+  /* Remove ourselves, unless we are just about to be woken up. */
+  for (;;)
+  {
+    bucket &b = bucket_for(t.addr.load(std::memory_order_relaxed));
+    std::lock_guard<std::mutex> g{b.mutex};
+    if (&bucket_for(t.addr.load(std::memory_order_relaxed)) != &b)
+      continue; /* we were requeued meanwhile */
+    if (!t.queued)
+      break;
+    b.remove(&t);
+    return false;
+  }
+
+  lk.lock();
+  while (!t.woken)
+    t.cond.wait(lk);
+  return true;
+}
+
+unsigned parking_lot_unpark(const void *addr, unsigned n) noexcept
+{
+  bucket &b = bucket_for(addr);
+  parked_thread *woken = nullptr, **last = &woken;
+  unsigned count = 0;
+  {
+    std::lock_guard<std::mutex> g{b.mutex};
+    for (parked_thread *t = b.head, *prev = nullptr, *next; t && count < n;
+         t = next)
+    {
+      next = t->next;
+      if (t->addr.load(std::memory_order_relaxed) != addr)
+        prev = t;
+      else
+      {
+        b.remove(t, prev);
+        t->next = nullptr;
+        *last = t;
+        last = &t->next;
+        count++;
+      }
+    }
+  }
+  wake(woken);
+  return count;
+}
+
+bool parking_lot_requeue(const void *from, const void *to,
+                         bool (*validate)(const void *ctx), const void *ctx)
+  noexcept
+{
+  bucket &bf = bucket_for(from), &bt = bucket_for(to);
+  /* Acquire the bucket mutexes in address order. */
+  std::unique_lock<std::mutex> first{&bf < &bt ? bf.mutex : bt.mutex},
+    second;
+  if (&bf != &bt)
+    second = std::unique_lock<std::mutex>{&bf < &bt ? bt.mutex : bf.mutex};
+  if (!validate(ctx))
+    return false;
+
+  parked_thread *woken = nullptr;
+  for (parked_thread *t = bf.head, *prev = nullptr, *next; t; t = next)
+  {
+    next = t->next;
+    if (t->addr.load(std::memory_order_relaxed) != from)
+      prev = t;
+    else if (!woken)
+    {
+      bf.remove(t, prev);
+      t->next = nullptr;
+      woken = t;
+    }
+    else if (&bf == &bt)
+    {
+      t->addr.store(to, std::memory_order_relaxed);
+      prev = t;
+    }
+    else
+    {
+      bf.remove(t, prev);
+      t->addr.store(to, std::memory_order_relaxed);
+      bt.push_back(t);
+    }
+  }
+
+  if (second)
+    second.unlock();
+  first.unlock();
+  wake(woken);
+  return true;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+
+/*
+
+A global table of wait queues that are keyed by address (parking lot),
+in the spirit of WTF::ParkingLot in WebKit.
+
+A thread that parks on an address will be queued in one of a fixed
+number of buckets, each one protected by a std::mutex, and it will
+block on a std::condition_variable of its own. No state needs to be
+associated with the address itself, and the address may point to a
+word of any size. Waiters on the same address are woken up in FIFO
+order, and requeueing is implemented in user space.
+
+With WITH_PARKING_LOT, futex.h will wait and wake up by these functions
+instead of the operating system or std::atomic::wait().
+
+*/
+
+/** Block the current thread until parking_lot_unpark() or
+parking_lot_requeue() for the address, or until a deadline
+@param addr      the address to wait for
+@param validate  invoked on ctx while the wait queue is locked;
+                 the thread will only be blocked if it returns true
+@param ctx       argument of validate
+@param deadline  when to give up waiting
+@return whether the wait ended before the deadline */
+bool parking_lot_park(const void *addr, bool (*validate)(const void *ctx),
+                      const void *ctx,
+                      std::chrono::steady_clock::time_point deadline)
+  noexcept;
+
+/** Wake up threads that are parked on an address
+@param addr  the address
+@param n     maximum number of threads to wake up
+@return number of threads that were woken up */
+unsigned parking_lot_unpark(const void *addr, unsigned n) noexcept;
+
+/** Wake up one thread that is parked on an address, and make the rest
+wait for another address, like FUTEX_CMP_REQUEUE
+@param from      the address that threads are parked on
+@param to        the address that the remaining threads will wait for
+@param validate  invoked on ctx while the wait queues are locked;
+                 nothing will be done unless it returns true
+@param ctx       argument of validate
+@return the return value of validate */
+bool parking_lot_requeue(const void *from, const void *to,
+                         bool (*validate)(const void *ctx), const void *ctx)
+  noexcept;
+
+/** Park until a word differs from an expected value
+@param a         the word
+@param old       the value of a that was last observed
+@param deadline  when to give up waiting
+@return whether the wait ended before the deadline */
+template<typename T>
+inline bool parking_lot_wait(const std::atomic<T> &a, T old,
+                             std::chrono::steady_clock::time_point deadline =
+                             std::chrono::steady_clock::time_point::max())
+  noexcept
+{
+  struct expected { const std::atomic<T> &a; T old; } e{a, old};
+  return parking_lot_park(&a, [](const void *ctx) {
+    const expected &e = *static_cast<const expected*>(ctx);
+    return e.a.load(std::memory_order_relaxed) == e.old;
+  }, &e, deadline);
+}
+
+/** Like parking_lot_requeue(), unless a word differs from an expected value
+@param a    the word that threads are parked on
+@param old  the expected value of a
+@param to   the word that the remaining threads will wait for
+@return whether a matched old */
+template<typename T, typename U>
+inline bool parking_lot_requeue(const std::atomic<T> &a, T old,
+                                const std::atomic<U> &to) noexcept
+{
+  struct expected { const std::atomic<T> &a; T old; } e{a, old};
+  return parking_lot_requeue(&a, &to, [](const void *ctx) {
+    const expected &e = *static_cast<const expected*>(ctx);
+    return e.a.load(std::memory_order_relaxed) == e.old;
+  }, &e);
+}
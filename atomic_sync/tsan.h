@@ -8,7 +8,24 @@
 #endif
 
 #ifdef __SANITIZE_THREAD__
+# undef WITH_LOCK_ORDER
 # include <sanitizer/tsan_interface.h>
+#elif defined WITH_LOCK_ORDER
+/* The flags of the annotations, as in <sanitizer/tsan_interface.h> */
+constexpr unsigned __tsan_mutex_read_lock = 1U << 3;
+constexpr unsigned __tsan_mutex_try_lock = 1U << 4;
+constexpr unsigned __tsan_mutex_try_lock_failed = 1U << 5;
+constexpr unsigned __tsan_mutex_try_read_lock =
+  __tsan_mutex_read_lock | __tsan_mutex_try_lock;
+constexpr unsigned __tsan_mutex_try_read_lock_failed =
+  __tsan_mutex_try_read_lock | __tsan_mutex_try_lock_failed;
+# define __tsan_mutex_pre_lock(addr, flags) lock_order_pre_lock(addr, flags)
+# define __tsan_mutex_post_lock(addr, flags, recursion)     \
+  lock_order_post_lock(addr, flags)
+# define __tsan_mutex_pre_unlock(addr, flags) lock_order_pre_unlock(addr)
+# define __tsan_mutex_post_unlock(addr, flags) while (false)
+# define __tsan_mutex_pre_signal(addr, flags) while (false)
+# define __tsan_mutex_post_signal(addr, flags) while (false)
 #else
 # define __tsan_mutex_pre_lock(addr, flags) while (false)
 # define __tsan_mutex_post_lock(addr, flags, recursion) while (false)
@@ -17,3 +34,5 @@
 # define __tsan_mutex_pre_signal(addr, flags) while (false)
 # define __tsan_mutex_post_signal(addr, flags) while (false)
 #endif
+
+#include "lock_order.h"
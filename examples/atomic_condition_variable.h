@@ -1,6 +1,6 @@
 #pragma once
-#include <atomic>
-#include <cassert>
+#include "atomic_mutex.h"
+#include "futex.h"
 
 /** Tiny condition variable that keeps a count of waiters.
 
@@ -9,8 +9,11 @@ The interface intentionally resembles std::condition_variable.
 In addition to wait(), we also define wait_shared() and wait_update(),
 to go with atomic_shared_mutex.
 
-A straightforward implementation of wait_until() would require the
-existence of std::atomic::wait_until().
+Because std::atomic::wait_until() does not exist, the timed waits
+wait_until(), wait_for(), wait_shared_until(), wait_shared_for(),
+wait_update_until(), wait_update_for() invoke the operating system
+directly, like the timed operations of atomic_mutex. Unlike
+std::condition_variable, they return a bool: whether the wait timed out.
 
 We define the predicate is_waiting().
 
@@ -20,62 +23,98 @@ The object is expected to be zero-initialized, so that
 
 The implementation counts pending wait() requests, so that signal()
 and broadcast() will only invoke notify_one() or notify_all() when
-pending requests exist. */
-
-#ifdef _WIN32
-#elif __cplusplus >= 202002L
-#else /* Emulate the C++20 primitives */
-# include <climits>
-# if defined __linux__
-#  include <linux/futex.h>
-#  include <unistd.h>
-#  include <sys/syscall.h>
-#  define FUTEX(op,n) \
-   syscall(SYS_futex, this, FUTEX_ ## op ## _PRIVATE, n, nullptr, nullptr, 0)
-# elif defined __OpenBSD__
-#  include <sys/time.h>
-#  include <sys/futex.h>
-#  define FUTEX(op,n) \
-   futex((volatile uint32_t*) this, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __FreeBSD__
-#   include <sys/types.h>
-#   include <sys/umtx.h>
-#   define FUTEX_WAKE UMTX_OP_WAKE_PRIVATE
-#   define FUTEX_WAIT UMTX_OP_WAIT_UINT_PRIVATE
-#   define FUTEX(op,n) _umtx_op(this, FUTEX_ ## op, n, nullptr, nullptr)
-# elif defined __DragonFly__
-#   include <unistd.h>
-#   define FUTEX_WAKE(a,n) umtx_wakeup(a,n)
-#   define FUTEX_WAIT(a,n) umtx_sleep(a,n,0)
-#   define FUTEX(op,n) FUTEX_ ## op((volatile int*) this, int(n))
-# else
-#  error "no C++20 nor futex support"
-# endif
-#endif
+pending requests exist.
+
+The variant broadcast(m) avoids a "thundering herd" of waiters that
+would be contending for m right after being woken up. It requires
+that all waiters be in wait(m), wait_until(m, ...) or wait_for(m, ...)
+with the same atomic_mutex<> m. The waiters will be removed from
+is_waiting() and counted in m as waiting for the mutex. On Linux,
+FUTEX_CMP_REQUEUE will make them wait for m.unlock(), which will wake
+them up one at a time. Elsewhere, all waiters will be woken up.
+
+The 64-bit word holds up to 65535 waiters in the least significant bits,
+a 32-bit count of broadcast(m) above them, and a 16-bit count of
+signal() and broadcast() in the most significant bits. A waiter detects
+that broadcast(m) removed it from the waiters by comparing the count
+of broadcast(m), which would have to wrap around during a single wait
+to go unnoticed. The waiters wait on the most significant 32 bits. */
 
-class atomic_condition_variable : private std::atomic<uint32_t>
+class atomic_condition_variable : private std::atomic<uint64_t>
 {
-#if defined _WIN32 || __cplusplus >= 202002L
-  void wait(uint32_t old) const noexcept { atomic::wait(old); }
-#else /* Emulate the C++20 primitives */
-  void notify_one() noexcept { FUTEX(WAKE, 1); }
-  void notify_all() noexcept { FUTEX(WAKE, INT_MAX); }
-  void wait(uint32_t old) const noexcept { FUTEX(WAIT, old); }
+  /** @return the most significant half of the word, which is waited for */
+  std::atomic<uint32_t> &word() noexcept
+  {
+    static_assert(sizeof(std::atomic<uint64_t>) ==
+                  2 * sizeof(std::atomic<uint32_t>), "");
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return reinterpret_cast<std::atomic<uint32_t>*>(this)[0];
+#else
+    return reinterpret_cast<std::atomic<uint32_t>*>(this)[1];
 #endif
-  static constexpr uint32_t EVENT = 1U << 16;
+  }
+  /* Waiters in wait_until() are not known to the C++ runtime library;
+  see futex.h. */
+  void notify_one() noexcept { futex_wake_one(word()); }
+  void notify_all() noexcept { futex_wake_all(word()); }
+  void wait(uint64_t old) noexcept { futex_wait(word(), uint32_t(old >> 32)); }
+  bool wait_until(uint64_t old, std::chrono::steady_clock::time_point t)
+    noexcept
+  { return futex_wait_until(word(), uint32_t(old >> 32), t); }
+  /** number of threads in wait() */
+  static constexpr uint64_t WAITERS = (1U << 16) - 1;
+  /** count of broadcast(m) that removed the waiters from WAITERS */
+  static constexpr uint64_t REQUEUE = 1U << 16;
+  /** count of signal() and broadcast(); a waiter that misses exactly
+  a multiple of 65536 of them before its futex wait would keep waiting */
+  static constexpr uint64_t EVENT = uint64_t{1} << 48;
+
+  /** Start waiting.
+  @return the value before our fetch_add(1) */
+  uint64_t enter() noexcept
+  {
+    const uint64_t val = fetch_add(1, std::memory_order_acquire);
+    assert((val & WAITERS) != WAITERS); /* too many waiters */
+    return val;
+  }
+  /** Stop waiting.
+  @param val  the value that enter() returned
+  @return whether broadcast(m) made us wait for m */
+  bool leave(uint64_t val) noexcept
+  {
+    uint64_t v = load(std::memory_order_relaxed);
+    do
+      if ((v ^ val) & (EVENT - REQUEUE))
+        return true;
+    while (!compare_exchange_weak(v, v - 1, std::memory_order_relaxed));
+    return false;
+  }
 public:
   /** Default constructor */
-  constexpr atomic_condition_variable() : std::atomic<uint32_t>(0) {}
+  constexpr atomic_condition_variable() : std::atomic<uint64_t>(0) {}
   /** No copy constructor */
   atomic_condition_variable(const atomic_condition_variable&) = delete;
   /** No assignment operator */
   atomic_condition_variable& operator=(const atomic_condition_variable&) =
     delete;
 
+  void wait(atomic_mutex<> &m)
+  {
+    const uint64_t val = enter();
+    m.unlock();
+    lock_order_sleep(this);
+    wait(1 + val);
+    if (leave(val))
+      m.lock_requeued();
+    else
+      m.lock();
+  }
+
   template<class mutex> void wait(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = enter();
     m.unlock();
+    lock_order_sleep(this);
     wait(1 + val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock();
@@ -83,8 +122,9 @@ public:
 
   template<class mutex> void wait_shared(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = enter();
     m.unlock_shared();
+    lock_order_sleep(this);
     wait(1 + val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock_shared();
@@ -92,25 +132,139 @@ public:
 
   template<class mutex> void wait_update(mutex &m)
   {
-    const uint32_t val = fetch_add(1, std::memory_order_acquire);
+    const uint64_t val = enter();
     m.unlock_update();
+    lock_order_sleep(this);
     wait(1 + val);
     fetch_sub(1, std::memory_order_relaxed);
     m.lock_update();
   }
 
+  /** Wait for signal() or broadcast(), or for a deadline to be reached
+  @param m         the mutex that the caller is holding
+  @param deadline  when to give up waiting
+  @return whether the wait timed out */
+  template<class Clock, class Duration>
+  bool wait_until(atomic_mutex<> &m,
+                  const std::chrono::time_point<Clock,Duration> &deadline)
+  {
+    const auto t = steady_deadline(deadline);
+    const uint64_t val = enter();
+    m.unlock();
+    lock_order_sleep(this);
+    const bool notified = wait_until(1 + val, t);
+    if (leave(val))
+    {
+      m.lock_requeued();
+      return false;
+    }
+    m.lock();
+    return !notified;
+  }
+  /** Wait for signal() or broadcast(), or for a deadline to be reached
+  @param m         the mutex that the caller is holding
+  @param deadline  when to give up waiting
+  @return whether the wait timed out */
+  template<class mutex, class Clock, class Duration>
+  bool wait_until(mutex &m,
+                  const std::chrono::time_point<Clock,Duration> &deadline)
+  {
+    const auto t = steady_deadline(deadline);
+    const uint64_t val = enter();
+    m.unlock();
+    lock_order_sleep(this);
+    const bool notified = wait_until(1 + val, t);
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock();
+    return !notified;
+  }
+  /** Wait for signal() or broadcast(), or for a timeout
+  @param m        the mutex that the caller is holding
+  @param timeout  how long to wait
+  @return whether the wait timed out */
+  template<class mutex, class Rep, class Period>
+  bool wait_for(mutex &m, const std::chrono::duration<Rep,Period> &timeout)
+  { return wait_until(m, std::chrono::steady_clock::now() + timeout); }
+
+  /** Wait for signal() or broadcast(), or for a deadline to be reached
+  @param m         the mutex that the caller is holding a shared lock on
+  @param deadline  when to give up waiting
+  @return whether the wait timed out */
+  template<class mutex, class Clock, class Duration>
+  bool wait_shared_until(mutex &m, const std::chrono::time_point<Clock,Duration>
+                         &deadline)
+  {
+    const auto t = steady_deadline(deadline);
+    const uint64_t val = enter();
+    m.unlock_shared();
+    lock_order_sleep(this);
+    const bool notified = wait_until(1 + val, t);
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock_shared();
+    return !notified;
+  }
+  /** Wait for signal() or broadcast(), or for a timeout
+  @param m        the mutex that the caller is holding a shared lock on
+  @param timeout  how long to wait
+  @return whether the wait timed out */
+  template<class mutex, class Rep, class Period>
+  bool wait_shared_for(mutex &m,
+                       const std::chrono::duration<Rep,Period> &timeout)
+  { return wait_shared_until(m, std::chrono::steady_clock::now() + timeout); }
+
+  /** Wait for signal() or broadcast(), or for a deadline to be reached
+  @param m         the mutex that the caller is holding an update lock on
+  @param deadline  when to give up waiting
+  @return whether the wait timed out */
+  template<class mutex, class Clock, class Duration>
+  bool wait_update_until(mutex &m, const std::chrono::time_point<Clock,Duration>
+                         &deadline)
+  {
+    const auto t = steady_deadline(deadline);
+    const uint64_t val = enter();
+    m.unlock_update();
+    lock_order_sleep(this);
+    const bool notified = wait_until(1 + val, t);
+    fetch_sub(1, std::memory_order_relaxed);
+    m.lock_update();
+    return !notified;
+  }
+  /** Wait for signal() or broadcast(), or for a timeout
+  @param m        the mutex that the caller is holding an update lock on
+  @param timeout  how long to wait
+  @return whether the wait timed out */
+  template<class mutex, class Rep, class Period>
+  bool wait_update_for(mutex &m,
+                       const std::chrono::duration<Rep,Period> &timeout)
+  { return wait_update_until(m, std::chrono::steady_clock::now() + timeout); }
+
   bool is_waiting() const noexcept
-  { return load(std::memory_order_acquire) & (EVENT - 1); }
+  { return load(std::memory_order_acquire) & WAITERS; }
 
   void signal() noexcept
   {
-    if (fetch_add(EVENT, std::memory_order_release) & (EVENT - 1))
+    if (fetch_add(EVENT, std::memory_order_release) & WAITERS)
       notify_one();
   }
 
   void broadcast() noexcept
   {
-    if (fetch_add(EVENT, std::memory_order_release) & (EVENT - 1))
+    if (fetch_add(EVENT, std::memory_order_release) & WAITERS)
+      notify_all();
+  }
+
+  /** Wake up all waiters, and make them wait for m
+  @param m  the mutex that all waiters were invoked with */
+  void broadcast(atomic_mutex<> &m) noexcept
+  {
+    /* Also count an EVENT, so that the waited-for word will change. */
+    uint64_t v = load(std::memory_order_relaxed), n;
+    while (!compare_exchange_weak(v, (n = v & WAITERS)
+                                  ? v - n + REQUEUE + EVENT : v + EVENT,
+                                  std::memory_order_release,
+                                  std::memory_order_relaxed));
+    if (n && !m.requeue(word(), uint32_t((v - n + REQUEUE + EVENT) >> 32),
+                        uint32_t(n)))
       notify_all();
   }
 };
@@ -0,0 +1,231 @@
+#pragma once
+#include <cassert>
+#include "futex.h"
+
+/** A mutex and a condition variable, fused in a single 64-bit word.
+
+Unlike atomic_condition_variable, which is separate from the mutex
+and must wake up a waiter in signal() only for it to block again on
+the mutex, signal() and broadcast() must be invoked while holding the
+lock, and they will only mark waiters as signaled. The wakeup will be
+deferred until unlock(), which will hand over the lock to one signaled
+waiter (wait morphing). A signaled waiter will be woken up exactly
+once, and it will return from wait() holding the lock. Neither
+signal() nor broadcast() will invoke the operating system.
+
+The lower half of the word is the lock: HOLDER and the number of
+threads that are holding or waiting for the lock, like mutex_storage.
+The upper half holds the sequence numbers of waiters that entered
+wait() and were signaled, and the GRANT flag of unlock(). Threads in
+lock() and wait() wait for different halves of the word, so that
+unlock() can wake up lock waiters and signaled waiters separately.
+
+Each wait() takes a ticket. signal() and broadcast() signal the waiters
+in the order of their tickets, and only a signaled waiter may claim a
+GRANT. Should some other waiter be woken up by unlock(), it will pass
+the wakeup on.
+
+There are no timed waits, because an unsignaled waiter cannot leave
+the sequence of tickets.
+
+There is no explicit constructor or destructor; the object is expected
+to be zero-initialized. */
+class atomic_monitor
+{
+  std::atomic<uint64_t> m;
+
+  /** number of threads that are holding or waiting for the lock */
+  static constexpr uint64_t LOCKERS = (1U << 16) - 1;
+  /** the lock is being held */
+  static constexpr uint64_t HOLDER = 1U << 31;
+  /** unlock() handed over the lock to a signaled waiter */
+  static constexpr uint64_t GRANT = uint64_t{1} << 62;
+
+  /** mask of a sequence number */
+  static constexpr uint32_t SEQ = (1U << 15) - 1;
+  /** count of waiters that returned from wait() */
+  static constexpr unsigned CLAIMED = 16;
+  /** count of wait() */
+  static constexpr unsigned ARRIVED = 32;
+  /** count of waiters that were signaled */
+  static constexpr unsigned SIGNALED = 47;
+
+  /** @return a sequence number
+  @param w      the word
+  @param shift  CLAIMED, ARRIVED or SIGNALED */
+  static uint32_t seq(uint64_t w, unsigned shift) noexcept
+  { return uint32_t(w >> shift) & SEQ; }
+  /** @return w with a sequence number replaced
+  @param w      the word
+  @param shift  CLAIMED, ARRIVED or SIGNALED
+  @param s      the new sequence number */
+  static uint64_t set_seq(uint64_t w, unsigned shift, uint32_t s) noexcept
+  { return (w & ~(uint64_t{SEQ} << shift)) | uint64_t{s & SEQ} << shift; }
+
+  /** @return whether a waiter has been signaled
+  @param w       the word
+  @param ticket  the ARRIVED sequence number at the start of wait() */
+  static bool signaled(uint64_t w, uint32_t ticket) noexcept
+  {
+    const uint32_t s = seq(w, SIGNALED);
+    return ((ticket - s) & SEQ) >= ((seq(w, ARRIVED) - s) & SEQ);
+  }
+
+  /** @return the half of the word that threads wait for
+  @param upper  false=lock waiters, true=waiters in wait() */
+  std::atomic<uint32_t> &half(bool upper) noexcept
+  {
+    static_assert(sizeof m == 2 * sizeof(std::atomic<uint32_t>), "");
+#if defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    upper = !upper;
+#endif
+    return reinterpret_cast<std::atomic<uint32_t>*>(&m)[upper];
+  }
+
+  /** Wait for the lock after the fast path of lock() failed */
+  void lock_wait() noexcept
+  {
+    uint64_t w = m.fetch_add(1, std::memory_order_relaxed) + 1;
+    assert(w & LOCKERS);
+    for (;;)
+    {
+      if (!(w & HOLDER))
+      {
+        w = m.fetch_or(HOLDER, std::memory_order_acquire);
+        if (!(w & HOLDER))
+          return;
+      }
+      futex_wait(half(false), uint32_t(w));
+      w = m.load(std::memory_order_relaxed);
+    }
+  }
+
+public:
+  /** @return whether the lock is being held or waited for */
+  bool is_locked_or_waiting() const noexcept
+  { return m.load(std::memory_order_acquire) & (HOLDER | LOCKERS); }
+  /** @return whether the lock is being held */
+  bool is_locked() const noexcept
+  { return m.load(std::memory_order_acquire) & HOLDER; }
+  /** @return whether any thread is in wait() */
+  bool is_waiting() const noexcept
+  {
+    const uint64_t w = m.load(std::memory_order_acquire);
+    return seq(w, ARRIVED) != seq(w, CLAIMED);
+  }
+
+  /** Try to acquire the lock
+  @return whether the lock was acquired */
+  bool try_lock() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    while (!(w & HOLDER))
+      if (m.compare_exchange_weak(w, w + HOLDER + 1,
+                                  std::memory_order_acquire,
+                                  std::memory_order_relaxed))
+        return true;
+    return false;
+  }
+
+  /** Acquire the lock */
+  void lock() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    if (w & (HOLDER | LOCKERS) ||
+        !m.compare_exchange_strong(w, w + HOLDER + 1,
+                                   std::memory_order_acquire,
+                                   std::memory_order_relaxed))
+      lock_wait();
+  }
+
+  /** Release the lock, or hand it over to a signaled waiter */
+  void unlock() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      assert(w & HOLDER);
+      assert(!(w & GRANT));
+      if (seq(w, SIGNALED) != seq(w, CLAIMED))
+      {
+        /* The signaled waiter will inherit HOLDER and our LOCKERS. */
+        if (m.compare_exchange_weak(w, w | GRANT, std::memory_order_release,
+                                    std::memory_order_relaxed))
+        {
+          futex_wake_one(half(true));
+          return;
+        }
+      }
+      else if (m.compare_exchange_weak(w, w - (HOLDER + 1),
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed))
+      {
+        if ((w & LOCKERS) != 1)
+          futex_wake_one(half(false));
+        return;
+      }
+    }
+  }
+
+  /** Release the lock and wait for signal() or broadcast(), and
+  reacquire the lock */
+  void wait() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    uint32_t ticket;
+    do
+    {
+      assert(w & HOLDER);
+      ticket = seq(w, ARRIVED);
+      assert(((ticket - seq(w, CLAIMED)) & SEQ) < SEQ);
+    }
+    while (!m.compare_exchange_weak(w, set_seq(w, ARRIVED, ticket + 1),
+                                    std::memory_order_relaxed));
+    unlock();
+
+    for (bool woken = false;; woken = true)
+    {
+      w = m.load(std::memory_order_acquire);
+      while (w & GRANT)
+      {
+        if (!signaled(w, ticket))
+        {
+          /* The wakeup was meant for a signaled waiter. */
+          if (woken)
+            futex_wake_one(half(true));
+          break;
+        }
+        if (m.compare_exchange_weak(w, set_seq(w & ~GRANT, CLAIMED,
+                                               seq(w, CLAIMED) + 1),
+                                    std::memory_order_acquire,
+                                    std::memory_order_relaxed))
+          return;
+      }
+      futex_wait(half(true), uint32_t(w >> 32));
+    }
+  }
+
+  /** Signal the oldest unsignaled waiter, if any, while holding the lock.
+  It will be woken up by unlock(). */
+  void signal() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    assert(w & HOLDER);
+    while (seq(w, SIGNALED) != seq(w, ARRIVED) &&
+           !m.compare_exchange_weak(w, set_seq(w, SIGNALED,
+                                               seq(w, SIGNALED) + 1),
+                                    std::memory_order_relaxed));
+  }
+
+  /** Signal all waiters while holding the lock. They will be woken up
+  one at a time, by unlock(). */
+  void broadcast() noexcept
+  {
+    uint64_t w = m.load(std::memory_order_relaxed);
+    assert(w & HOLDER);
+    while (seq(w, SIGNALED) != seq(w, ARRIVED) &&
+           !m.compare_exchange_weak(w, set_seq(w, SIGNALED,
+                                               seq(w, ARRIVED)),
+                                    std::memory_order_relaxed));
+  }
+};
@@ -0,0 +1,214 @@
+#pragma once
+#include <exception>
+#include "atomic_mutex.h"
+
+/** Per-thread tokens for atomic_recursive_mutex. A token is a small
+nonzero integer that is unique among the threads that are running.
+It will be assigned on first use, and released when the thread exits. */
+class recursive_mutex_token
+{
+public:
+  /** the largest token */
+  static constexpr uint32_t MAX = 0xffff;
+
+  /** @return the token of the current thread */
+  static uint32_t get() noexcept
+  {
+    const uint32_t t = current();
+    return t ? t : assign();
+  }
+
+private:
+  /** @return the token of the current thread, or 0 if none was assigned */
+  static uint32_t &current() noexcept
+  {
+    static thread_local uint32_t token;
+    return token;
+  }
+
+  /** @return bitmap of assigned tokens, starting from 1 */
+  static std::atomic<uint64_t> *assigned() noexcept
+  {
+    static std::atomic<uint64_t> bitmap[(MAX + 63) / 64];
+    return bitmap;
+  }
+
+  /** Assign a token to the current thread
+  @return the token */
+  static uint32_t assign() noexcept
+  {
+    /** Releases the token when the thread exits */
+    struct owner
+    {
+      uint32_t token;
+      ~owner()
+      {
+        current() = 0;
+        const uint32_t i = token - 1;
+        assigned()[i / 64].fetch_and(~(uint64_t{1} << i % 64),
+                                     std::memory_order_release);
+      }
+    };
+    static thread_local owner o;
+
+    std::atomic<uint64_t> *bitmap = assigned();
+    for (uint32_t i = 0; i < (MAX + 63) / 64; i++)
+    {
+      uint64_t b = bitmap[i].load(std::memory_order_relaxed);
+      while (~b)
+      {
+        uint32_t bit = 0;
+        while (b & uint64_t{1} << bit)
+          bit++;
+        const uint32_t token = i * 64 + bit + 1;
+        if (token > MAX)
+          break;
+        if (bitmap[i].compare_exchange_weak(b, b | uint64_t{1} << bit,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed))
+          return current() = o.token = token;
+      }
+    }
+    /* More than MAX threads are running. */
+    assert(!"out of recursive_mutex_token");
+    std::terminate();
+  }
+};
+
+/** Exclusive lock with recursion (re-entrancy), without shared locks.
+
+Unlike atomic_recursive_shared_mutex, which identifies the holder by
+std::atomic<std::thread::id>, this packs a per-thread token (see
+recursive_mutex_token) and the recursion count into a single 32-bit
+word next to the lock word. With the default mutex_storage<>, the
+object occupies 8 bytes. A re-entrant lock() costs one thread-local
+load, one load of the word and a comparison; the mutex itself will
+only be acquired and released by the outermost lock() and unlock().
+
+The word is written only by the holder of the mutex. Another thread
+may read it without synchronization, because it can never contain
+the token of the reading thread.
+
+There is no explicit constructor or destructor; the object may be
+zero-initialized. */
+template<typename storage = mutex_storage<>>
+class atomic_recursive_mutex : atomic_mutex<storage>
+{
+  using super = atomic_mutex<storage>;
+
+  /** The token of the holder, multiplied by OWNER, plus the recursion
+  count. Protected by atomic_mutex. */
+  std::atomic<uint32_t> owner;
+
+  /** The multiplier in owner for the token */
+  static constexpr uint32_t OWNER = 1U << 16;
+  /** The maximum allowed level of recursion */
+  static constexpr uint32_t RECURSIVE_MAX = OWNER - 1;
+  static_assert(recursive_mutex_token::MAX <= ~0U / OWNER,
+                "the token must fit in owner");
+
+  /** @return the token of the current thread, multiplied by OWNER */
+  static uint32_t self() noexcept
+  { return recursive_mutex_token::get() * OWNER; }
+
+  /** Acquire a recursive lock while holding the mutex
+  @param o  the current value of owner */
+  void recurse(uint32_t o) noexcept
+  {
+    assert(o & RECURSIVE_MAX);
+    assert((o & RECURSIVE_MAX) < RECURSIVE_MAX);
+    owner.store(o + 1, std::memory_order_relaxed);
+  }
+
+public:
+  void init() noexcept
+  {
+    assert(!this->get_storage().is_locked_or_waiting());
+    assert(!owner.load(std::memory_order_relaxed));
+  }
+
+  void destroy() noexcept
+  {
+    assert(!this->get_storage().is_locked_or_waiting());
+    assert(!owner.load(std::memory_order_relaxed));
+  }
+
+  /** @return whether the current thread is holding the mutex */
+  bool holding_lock() const noexcept
+  {
+    return (owner.load(std::memory_order_relaxed) & ~RECURSIVE_MAX) ==
+      self();
+  }
+
+  /** Acquire the mutex, or increment the recursion count */
+  void lock() noexcept
+  {
+    const uint32_t id = self();
+    const uint32_t o = owner.load(std::memory_order_relaxed);
+    if ((o & ~RECURSIVE_MAX) == id)
+      recurse(o);
+    else
+    {
+      super::lock();
+      assert(!owner.load(std::memory_order_relaxed));
+      owner.store(id + 1, std::memory_order_relaxed);
+    }
+  }
+
+  /** Acquire the mutex with an initial spinloop, or increment the
+  recursion count */
+  void spin_lock(unsigned spin_rounds) noexcept
+  {
+    const uint32_t id = self();
+    const uint32_t o = owner.load(std::memory_order_relaxed);
+    if ((o & ~RECURSIVE_MAX) == id)
+      recurse(o);
+    else
+    {
+      super::spin_lock(spin_rounds);
+      assert(!owner.load(std::memory_order_relaxed));
+      owner.store(id + 1, std::memory_order_relaxed);
+    }
+  }
+
+  /** Try to acquire the mutex, or increment the recursion count
+  @return whether the mutex is being held by the current thread */
+  bool try_lock() noexcept
+  {
+    const uint32_t id = self();
+    const uint32_t o = owner.load(std::memory_order_relaxed);
+    if ((o & ~RECURSIVE_MAX) == id)
+    {
+      recurse(o);
+      return true;
+    }
+    if (!super::try_lock())
+      return false;
+    assert(!owner.load(std::memory_order_relaxed));
+    owner.store(id + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /** Acquire a recursive lock, known to be already held by the
+  current thread */
+  void lock_recursive() noexcept
+  {
+    assert(holding_lock());
+    recurse(owner.load(std::memory_order_relaxed));
+  }
+
+  /** Release a recursive lock, and the mutex if this was the last one */
+  void unlock() noexcept
+  {
+    const uint32_t o = owner.load(std::memory_order_relaxed);
+    assert((o & ~RECURSIVE_MAX) == self());
+    assert(o & RECURSIVE_MAX);
+    if ((o & RECURSIVE_MAX) != 1)
+      owner.store(o - 1, std::memory_order_relaxed);
+    else
+    {
+      owner.store(0, std::memory_order_relaxed);
+      super::unlock();
+    }
+  }
+};
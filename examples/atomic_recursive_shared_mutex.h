@@ -19,6 +19,8 @@ has been granted and released in unlock().
 This extends atomic_shared_mutex by allowing re-entrant
 lock() and lock_update() calls. In lock_update_upgrade() and
 update_lock_downgrade(), all locks will be transformed.
+try_lock_shared_upgrade() and lock_downgrade_to_shared() convert
+between a shared lock and a single, non-recursive exclusive lock.
 
 There is no explicit constructor or destructor.
 The object may be zero-initialized, depending on the
@@ -272,6 +274,31 @@ public:
     super::update_lock_downgrade();
   }
 
+  /** Try to upgrade a shared lock to a non-recursive exclusive lock
+  @return whether the exclusive lock was acquired */
+  bool try_lock_shared_upgrade() noexcept
+  {
+    const std::thread::id id = std::this_thread::get_id();
+    assert(!(writer.load(std::memory_order_relaxed) == id));
+    if (!super::try_lock_shared_upgrade())
+      return false;
+    assert(writer.load(std::memory_order_relaxed) == std::thread::id{});
+    assert(!recursive);
+    recursive = RECURSIVE_X;
+    set_holder(id);
+    return true;
+  }
+
+  /** Downgrade a non-recursive exclusive lock to a shared lock */
+  void lock_downgrade_to_shared() noexcept
+  {
+    assert(holding_lock());
+    assert(recursive == RECURSIVE_X);
+    recursive = 0;
+    set_holder(std::thread::id{});
+    super::lock_downgrade_to_shared();
+  }
+
   /** Acquire an exclusive lock or upgrade an update lock
   @return whether U locks were upgraded to X */
   bool lock_upgraded() noexcept
@@ -0,0 +1,124 @@
+#pragma once
+#include "atomic_shared_mutex.h"
+
+/** Shared/Update/Exclusive lock with optimistic readers (sequence lock).
+
+This extends atomic_shared_mutex with a sequence number that is
+incremented when an exclusive lock is acquired and when it is released.
+It is odd while an exclusive lock is being held.
+
+Readers that only copy a small amount of data may avoid writing to
+the lock altogether:
+
+  for (;;) {
+    const uint32_t s = m.read_begin();
+    copy the data, by relaxed std::atomic loads;
+    if (m.read_validate(s)) break;
+  }
+
+See also transactional_optimistic_lock_guard, which falls back
+to lock_shared() after a number of failed attempts.
+
+Because an optimistic reader may observe torn or inconsistent data,
+it must not dereference any pointers that it copied before
+read_validate() has returned true.
+
+An update lock does not change the sequence number. While holding
+lock_update(), a thread may only modify data that is not being read
+by optimistic readers or lock_shared() holders. */
+template<typename storage = shared_mutex_storage<>>
+class atomic_seqlock : atomic_shared_mutex<storage>
+{
+  using super = atomic_shared_mutex<storage>;
+
+  /** The sequence number, odd while an exclusive lock is held */
+  std::atomic<uint32_t> seq;
+
+  /** Make the sequence number odd after acquiring an exclusive lock */
+  void write_begin() noexcept
+  {
+    const uint32_t s = seq.load(std::memory_order_relaxed);
+    assert(!(s & 1));
+    seq.store(s + 1, std::memory_order_relaxed);
+    /* Order our subsequent stores after the sequence number */
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  /** Make the sequence number even before releasing an exclusive lock */
+  void write_end() noexcept
+  {
+    const uint32_t s = seq.load(std::memory_order_relaxed);
+    assert(s & 1);
+    seq.store(s + 1, std::memory_order_release);
+  }
+
+public:
+  using super::get_storage;
+
+  /** Start an optimistic read.
+  @return the sequence number to be passed to read_validate() */
+  uint32_t read_begin() const noexcept
+  { return seq.load(std::memory_order_acquire); }
+  /** Validate an optimistic read.
+  @param s  the return value of read_begin()
+  @return whether the data that was read since read_begin() is consistent */
+  bool read_validate(uint32_t s) const noexcept
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(s & 1) && seq.load(std::memory_order_relaxed) == s;
+  }
+
+  bool try_lock_shared() noexcept { return super::try_lock_shared(); }
+  void lock_shared() noexcept { super::lock_shared(); }
+  void spin_lock_shared(unsigned spin_rounds) noexcept
+  { super::spin_lock_shared(spin_rounds); }
+  void unlock_shared() noexcept { super::unlock_shared(); }
+
+  bool try_lock_update() noexcept { return super::try_lock_update(); }
+  void lock_update() noexcept { super::lock_update(); }
+  void spin_lock_update(unsigned spin_rounds) noexcept
+  { super::spin_lock_update(spin_rounds); }
+  void unlock_update() noexcept { super::unlock_update(); }
+
+  /** Try to acquire an exclusive lock.
+  @return whether the exclusive lock was acquired */
+  bool try_lock() noexcept
+  {
+    if (!super::try_lock())
+      return false;
+    write_begin();
+    return true;
+  }
+  /** Try to acquire an exclusive lock, waiting until a deadline
+  @param deadline  when to give up waiting
+  @return whether the exclusive lock was acquired */
+  template<class Clock, class Duration>
+  bool try_lock_until(const std::chrono::time_point<Clock,Duration> &deadline)
+    noexcept
+  {
+    if (!super::try_lock_until(deadline))
+      return false;
+    write_begin();
+    return true;
+  }
+  /** Try to acquire an exclusive lock, waiting for at most a specified time
+  @param timeout  how long to wait
+  @return whether the exclusive lock was acquired */
+  template<class Rep, class Period>
+  bool try_lock_for(const std::chrono::duration<Rep,Period> &timeout) noexcept
+  { return try_lock_until(std::chrono::steady_clock::now() + timeout); }
+
+  /** Acquire an exclusive lock */
+  void lock() noexcept { super::lock(); write_begin(); }
+  void spin_lock(unsigned spin_rounds) noexcept
+  { super::spin_lock(spin_rounds); write_begin(); }
+
+  /** Upgrade an update lock to exclusive */
+  void update_lock_upgrade() noexcept
+  { super::update_lock_upgrade(); write_begin(); }
+  /** Downgrade an exclusive lock to update */
+  void update_lock_downgrade() noexcept
+  { write_end(); super::update_lock_downgrade(); }
+
+  /** Release an exclusive lock */
+  void unlock() noexcept { write_end(); super::unlock(); }
+};
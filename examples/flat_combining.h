@@ -0,0 +1,157 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include "atomic_mutex.h"
+#include "transactional_lock_guard.h"
+
+/** Flat combining: a data structure that is protected by atomic_mutex,
+where the lock holder applies the operations of other threads.
+
+  static flat_combining<std::priority_queue<int>> q;
+  q.apply([&](std::priority_queue<int> &d){ d.push(x); });
+
+A thread publishes its operation in a per-thread slot. If try_lock()
+succeeds, it becomes the combiner: it applies all published operations
+in a single pass and marks them done. Other threads spin on their own
+request for a while, and then acquire the mutex by spin_lock(), to
+combine whatever is still pending. Instead of moving the cache lines
+of T and the mutex to each thread in turn, the combiner will access
+them once per batch.
+
+With WITH_ELISION, the combiner pass will first be attempted as a
+memory transaction that only reads the mutex. Since every combiner
+writes to the slots that it empties, concurrent passes will conflict
+unless they find disjoint sets of requests.
+
+The operation may be any callable that accepts T&. It will be invoked
+by some thread while holding the mutex, before apply() returns, so it
+may safely refer to local variables of the caller. It must not invoke
+apply() on the same object.
+
+Each thread is assigned one of N_SLOTS slots in a round-robin
+fashion. If more threads share a slot, only one of them can publish
+at a time, and the others apply their operation while holding the
+mutex. */
+template<typename T, typename Storage = mutex_storage<>,
+         size_t N_SLOTS = 64>
+class flat_combining
+{
+  /** a published operation */
+  struct request
+  {
+    /** whether the operation was applied */
+    std::atomic<bool> done;
+    /** apply the operation */
+    void (*fn)(T&, request*);
+  };
+  /** a published operation */
+  template<typename F> struct request_for : request
+  {
+    F &f;
+    request_for(F &f) : request{{false}, invoke}, f(f) {}
+    static void invoke(T &data, request *r)
+    { static_cast<request_for*>(r)->f(data); }
+  };
+  /** a per-thread slot, padded to a typical cache line size */
+  struct alignas(64) slot
+  {
+    /** the published operation, or nullptr; protected by m */
+    std::atomic<request*> r;
+  };
+
+  atomic_mutex<Storage> m;
+  T data;
+  slot slots[N_SLOTS];
+
+  /** @return the slot of the current thread */
+  std::atomic<request*> &get_slot() noexcept
+  {
+    static std::atomic<size_t> next;
+    static thread_local size_t i =
+      next.fetch_add(1, std::memory_order_relaxed) % N_SLOTS;
+    return slots[i].r;
+  }
+
+public:
+  /** default number of polls for completion before acquiring the mutex */
+  static constexpr unsigned SPIN_ROUNDS = 100;
+
+private:
+  /** Apply all published operations, while holding m
+  or in a memory transaction */
+  void combine() noexcept
+  {
+    for (slot &s : slots)
+      if (request *r = s.r.load(std::memory_order_acquire))
+      {
+        s.r.store(nullptr, std::memory_order_relaxed);
+        r->fn(data, r);
+        r->done.store(true, std::memory_order_release);
+      }
+  }
+
+  /** Try to combine in a memory transaction
+  @return whether the transaction was committed */
+  TRANSACTIONAL_INLINE bool combine_elided() noexcept
+  {
+#ifdef WITH_ELISION
+    if (xbegin())
+    {
+      if (m.get_storage().is_locked_or_waiting())
+        xabort();
+      combine();
+      xend();
+      return true;
+    }
+#endif
+    return false;
+  }
+
+public:
+  /** @return the data structure, for access while no thread can be
+  in apply() */
+  T &get() noexcept { return data; }
+  /** @return the mutex */
+  atomic_mutex<Storage> &get_mutex() noexcept { return m; }
+
+  /** Apply an operation to the data structure
+  @param f            callable that accepts T&
+  @param spin_rounds  how many times to poll for completion
+                      before acquiring the mutex */
+  template<typename F>
+  TRANSACTIONAL_TARGET
+  void apply(F &&f, unsigned spin_rounds = SPIN_ROUNDS)
+    noexcept
+  {
+    request_for<F> r{f};
+    std::atomic<request*> &s = get_slot();
+    request *expected = nullptr;
+    if (!s.compare_exchange_strong(expected, &r, std::memory_order_release,
+                                   std::memory_order_relaxed))
+    {
+      /* Another thread is using our slot. */
+      m.spin_lock(spin_rounds);
+      f(data);
+      combine();
+      m.unlock();
+      return;
+    }
+
+    if (combine_elided());
+    else if (m.try_lock())
+    {
+      combine();
+      m.unlock();
+    }
+    else
+    {
+      for (unsigned spin = spin_rounds; spin--; spin_pause())
+        if (r.done.load(std::memory_order_acquire))
+          return;
+      m.spin_lock(spin_rounds);
+      combine();
+      m.unlock();
+    }
+    assert(r.done.load(std::memory_order_relaxed));
+  }
+};
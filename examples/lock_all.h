@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+#include "atomic_mutex.h"
+#include "atomic_shared_mutex.h"
+#include "transactional_lock_guard.h"
+
+/*
+
+Acquisition of several atomic_mutex or atomic_shared_mutex at once.
+
+Unlike std::lock(), which keeps invoking try_lock() and backing off,
+lock_all() sorts the mutexes by address and removes duplicates, and
+then acquires them in that order. Because every caller acquires the
+mutexes in the same order, there cannot be any deadlock. Uncontended
+mutexes are acquired by a single atomic operation (the lock_impl() of
+the Storage). A thread will wait for each contended mutex in turn,
+while holding the mutexes with a lower address. Unlike std::lock(),
+it will not release them and retry.
+
+  atomic_mutex<> *m[] = {&a, &b, &c};
+  size_t n = lock_all(m);
+  ...
+  unlock_all(m, n);
+
+The array will be reordered in place, and the return value is the
+number of distinct mutexes at its start, to be passed to unlock_all().
+
+While holding lock_all_update(), update_lock_upgrade() must not be
+invoked on any but the last mutex. A lock_shared() that conflicts with
+an exclusive lock will wait for the outer mutex, which is also held by
+lock_update(). Upgrading a mutex while holding update locks on mutexes
+with a higher address could therefore deadlock with lock_all_shared().
+Use lock_all() instead.
+
+*/
+
+/** Sort mutexes by address and remove duplicates
+@param m  mutexes; will be sorted in place
+@param n  number of mutexes
+@return number of distinct mutexes at the start of m */
+template<class Mutex> size_t lock_all_sort(Mutex **m, size_t n) noexcept
+{
+  std::sort(m, m + n, std::less<Mutex*>());
+  return size_t(std::unique(m, m + n) - m);
+}
+
+/** Acquire exclusive locks on mutexes
+@param m  mutexes; will be sorted in place
+@param n  number of mutexes
+@return the number of mutexes to pass to unlock_all() */
+template<class Mutex> size_t lock_all(Mutex **m, size_t n) noexcept
+{
+  n = lock_all_sort(m, n);
+  for (size_t i = 0; i < n; i++)
+    m[i]->lock();
+  return n;
+}
+template<class Mutex, size_t n> size_t lock_all(Mutex *(&m)[n]) noexcept
+{ return lock_all(m, n); }
+/** Release the locks that were acquired by lock_all()
+@param m  mutexes
+@param n  the return value of lock_all() */
+template<class Mutex> void unlock_all(Mutex *const *m, size_t n) noexcept
+{
+  while (n--)
+    m[n]->unlock();
+}
+
+/** Acquire shared locks on atomic_shared_mutex
+@param m  mutexes; will be sorted in place
+@param n  number of mutexes
+@return the number of mutexes to pass to unlock_all_shared() */
+template<class Mutex> size_t lock_all_shared(Mutex **m, size_t n) noexcept
+{
+  n = lock_all_sort(m, n);
+  for (size_t i = 0; i < n; i++)
+    m[i]->lock_shared();
+  return n;
+}
+template<class Mutex, size_t n>
+size_t lock_all_shared(Mutex *(&m)[n]) noexcept
+{ return lock_all_shared(m, n); }
+/** Release the locks that were acquired by lock_all_shared()
+@param m  mutexes
+@param n  the return value of lock_all_shared() */
+template<class Mutex>
+void unlock_all_shared(Mutex *const *m, size_t n) noexcept
+{
+  while (n--)
+    m[n]->unlock_shared();
+}
+
+/** Acquire update locks on atomic_shared_mutex
+@param m  mutexes; will be sorted in place
+@param n  number of mutexes
+@return the number of mutexes to pass to unlock_all_update() */
+template<class Mutex> size_t lock_all_update(Mutex **m, size_t n) noexcept
+{
+  n = lock_all_sort(m, n);
+  for (size_t i = 0; i < n; i++)
+    m[i]->lock_update();
+  return n;
+}
+template<class Mutex, size_t n>
+size_t lock_all_update(Mutex *(&m)[n]) noexcept
+{ return lock_all_update(m, n); }
+/** Release the locks that were acquired by lock_all_update()
+@param m  mutexes
+@param n  the return value of lock_all_update() */
+template<class Mutex>
+void unlock_all_update(Mutex *const *m, size_t n) noexcept
+{
+  while (n--)
+    m[n]->unlock_update();
+}
+
+/** Like transactional_lock_guard, but for lock_all(). With
+WITH_ELISION, all the mutexes will be elided in a single memory
+transaction, or else acquired by lock_all().
+@tparam Mutex  atomic_mutex or atomic_shared_mutex
+@tparam n      number of mutexes */
+template<class Mutex, size_t n>
+class transactional_lock_all_guard
+{
+  /** the mutexes, sorted by address */
+  Mutex *m[n];
+  /** the number of distinct mutexes */
+  size_t count;
+#ifdef WITH_ELISION
+  bool elided;
+#else
+  static constexpr bool elided = false;
+#endif
+
+public:
+  TRANSACTIONAL_INLINE
+  transactional_lock_all_guard(Mutex *const (&mutexes)[n])
+  {
+    std::copy(mutexes, mutexes + n, m);
+#ifdef WITH_ELISION
+    if (xbegin())
+    {
+      for (size_t i = 0; i < n; i++)
+        if (m[i]->get_storage().is_locked_or_waiting())
+          xabort();
+      elided = true;
+      count = n;
+      return;
+    }
+    elided = false;
+#endif
+    count = lock_all(m, n);
+  }
+  transactional_lock_all_guard(const transactional_lock_all_guard &) = delete;
+  TRANSACTIONAL_INLINE ~transactional_lock_all_guard() noexcept
+  {
+#ifdef WITH_ELISION
+    if (was_elided()) xend(); else
+#endif
+    unlock_all(m, count);
+  }
+
+  bool was_elided() const noexcept { return elided; }
+};
+
+/** Like transactional_shared_lock_guard, but for lock_all_shared().
+@tparam Mutex  atomic_shared_mutex
+@tparam n      number of mutexes */
+template<class Mutex, size_t n>
+class transactional_shared_lock_all_guard
+{
+  /** the mutexes, sorted by address */
+  Mutex *m[n];
+  /** the number of distinct mutexes */
+  size_t count;
+#ifdef WITH_ELISION
+  bool elided;
+#else
+  static constexpr bool elided = false;
+#endif
+
+public:
+  TRANSACTIONAL_INLINE
+  transactional_shared_lock_all_guard(Mutex *const (&mutexes)[n])
+  {
+    std::copy(mutexes, mutexes + n, m);
+#ifdef WITH_ELISION
+    if (xbegin())
+    {
+      for (size_t i = 0; i < n; i++)
+        if (m[i]->get_storage().is_locked())
+          xabort();
+      elided = true;
+      count = n;
+      return;
+    }
+    elided = false;
+#endif
+    count = lock_all_shared(m, n);
+  }
+  transactional_shared_lock_all_guard
+  (const transactional_shared_lock_all_guard &) = delete;
+  TRANSACTIONAL_INLINE ~transactional_shared_lock_all_guard() noexcept
+  {
+#ifdef WITH_ELISION
+    if (was_elided()) xend(); else
+#endif
+    unlock_all_shared(m, count);
+  }
+
+  bool was_elided() const noexcept { return elided; }
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include "atomic_mutex.h"
+
+/*
+
+Wrappers of the operating system's own locks, for comparison.
+
+native_mutex_storage is a Storage for atomic_mutex that is implemented
+by pthread_mutex_t or SRWLOCK. Because the operating system implements
+the waiting, atomic_mutex::spin_lock() is not available.
+
+native_shared_mutex is a shared_mutex that is implemented by
+pthread_rwlock_t or SRWLOCK. It does not support lock_update().
+
+*/
+
+#ifndef _WIN32
+# include <pthread.h>
+
+class native_mutex_storage
+{
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+public:
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept
+  {
+    return pthread_mutex_trylock(&mutex) == 0;
+  }
+  void lock_wait() noexcept { pthread_mutex_lock(&mutex); }
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept; // not defined
+
+  /** Release a mutex
+  @return whether the lock is being waited for */
+  bool unlock_impl() noexcept
+  {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+  /** Notify waiters after unlock_impl() returned true */
+  void unlock_notify() noexcept {}
+};
+
+class native_shared_mutex
+{
+  pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+public:
+  void lock_shared() noexcept { pthread_rwlock_rdlock(&rwlock); }
+  void unlock_shared() noexcept { pthread_rwlock_unlock(&rwlock); }
+  void lock() noexcept { pthread_rwlock_wrlock(&rwlock); }
+  void unlock() noexcept { pthread_rwlock_unlock(&rwlock); }
+};
+#else
+# include <synchapi.h>
+
+class native_mutex_storage
+{
+  SRWLOCK mutex = SRWLOCK_INIT;
+
+public:
+  /** Try to acquire a mutex
+  @return whether the mutex was acquired */
+  bool lock_impl() noexcept { return TryAcquireSRWLockExclusive(&mutex); }
+  void lock_wait() noexcept { AcquireSRWLockExclusive(&mutex); }
+  unsigned spin_lock_wait(unsigned spin_rounds) noexcept; // not defined
+
+  /** Release a mutex
+  @return whether the lock is being waited for */
+  bool unlock_impl() noexcept
+  {
+    ReleaseSRWLockExclusive(&mutex);
+    return false;
+  }
+  /** Notify waiters after unlock_impl() returned true */
+  void unlock_notify() noexcept {}
+};
+
+class native_shared_mutex
+{
+  SRWLOCK rwlock = SRWLOCK_INIT;
+
+public:
+  void lock_shared() noexcept { AcquireSRWLockShared(&rwlock); }
+  void unlock_shared() noexcept { ReleaseSRWLockShared(&rwlock); }
+  void lock() noexcept { AcquireSRWLockExclusive(&rwlock); }
+  void unlock() noexcept { ReleaseSRWLockExclusive(&rwlock); }
+};
+#endif
@@ -0,0 +1,176 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include "atomic_mutex.h"
+#include "transactional_lock_guard.h"
+
+/** A hash table whose cells are protected by one mutex per cache line.
+
+Each cache-line-aligned slab consists of a mutex, followed by as many
+payload cells as fit in the rest of the cache line, like the
+lock_sys_t::hash_table in MariaDB Server 10.6. Acquiring the mutex
+of a cell will thus not cause false sharing with any other mutex,
+and the cell will typically be in the same cache line.
+
+The cells are zero-initialized when the table resides in static storage.
+
+For single cells, the mutex may be acquired with
+transactional_lock_guard<Mutex> g{table.mutex_for(hash)};
+or without elision by lock_for(hash) and mutex_for(hash).unlock().
+To avoid deadlocks, multiple cells should only be protected by
+lock_many() or transactional_lock_many_guard, which acquire the
+mutexes in ascending order of address.
+
+@tparam T        payload element, such as a pointer to a bucket chain
+@tparam Mutex    atomic_mutex or atomic_shared_mutex
+@tparam n_slabs  number of mutexes */
+template<typename T = void*, typename Mutex = atomic_mutex<>,
+         size_t n_slabs = 64>
+class striped_lock_table
+{
+public:
+  /** a typical cache line size */
+  static constexpr size_t CACHE_LINE = 64;
+  /** number of cells per mutex */
+  static constexpr size_t ELEMENTS =
+    (CACHE_LINE - (sizeof(Mutex) + alignof(T) - 1) / alignof(T) * alignof(T))
+    / sizeof(T);
+  static_assert(ELEMENTS > 0, "T and Mutex do not fit in a cache line");
+
+private:
+  /** A mutex and the cells that it protects */
+  struct alignas(CACHE_LINE) slab
+  {
+    Mutex mutex;
+    T cells[ELEMENTS];
+  };
+  static_assert(sizeof(slab) == CACHE_LINE, "padding");
+
+  slab slabs[n_slabs];
+
+  /** @return the slab of a hash value */
+  static constexpr size_t slab_for(size_t hash) noexcept
+  { return hash % size() / ELEMENTS; }
+
+public:
+  /** @return the number of cells */
+  static constexpr size_t size() noexcept { return n_slabs * ELEMENTS; }
+
+  /** @return the cell of a hash value */
+  T &at(size_t hash) noexcept
+  {
+    const size_t i = hash % size();
+    return slabs[i / ELEMENTS].cells[i % ELEMENTS];
+  }
+  /** @return the mutex that protects at(hash) */
+  Mutex &mutex_for(size_t hash) noexcept
+  { return slabs[slab_for(hash)].mutex; }
+  /** Acquire the mutex that protects at(hash)
+  @return the mutex, for invoking unlock() */
+  Mutex &lock_for(size_t hash) noexcept
+  {
+    Mutex &m = mutex_for(hash);
+    m.lock();
+    return m;
+  }
+
+  /** Convert hash values to the distinct mutexes that protect them,
+  in the order in which they must be acquired.
+  @param hashes  hash values; will be replaced with slab numbers
+  @param n       number of hash values
+  @return number of distinct slab numbers at the start of hashes */
+  static size_t slabs_for(size_t *hashes, size_t n) noexcept
+  {
+    for (size_t i = 0; i < n; i++)
+      hashes[i] = slab_for(hashes[i]);
+    std::sort(hashes, hashes + n);
+    return size_t(std::unique(hashes, hashes + n) - hashes);
+  }
+  /** Acquire the mutexes that protect several cells.
+  @param hashes  hash values; will be replaced with slab numbers
+  @param n       number of hash values
+  @return the number of slab numbers to pass to unlock_many() */
+  size_t lock_many(size_t *hashes, size_t n) noexcept
+  {
+    n = slabs_for(hashes, n);
+    lock_slabs(hashes, n);
+    return n;
+  }
+  /** Acquire mutexes after slabs_for()
+  @param s  slab numbers, in ascending order
+  @param n  number of slab numbers */
+  void lock_slabs(const size_t *s, size_t n) noexcept
+  {
+    for (size_t i = 0; i < n; i++)
+      slabs[s[i]].mutex.lock();
+  }
+  /** Release the mutexes that were acquired by lock_many()
+  @param s  slab numbers that were returned by lock_many()
+  @param n  the return value of lock_many() */
+  void unlock_many(const size_t *s, size_t n) noexcept
+  {
+    while (n--)
+      slabs[s[n]].mutex.unlock();
+  }
+  /** @return whether none of the mutexes are locked or waited for
+  @param s  slab numbers
+  @param n  number of slab numbers */
+  bool is_unlocked(const size_t *s, size_t n) const noexcept
+  {
+    for (size_t i = 0; i < n; i++)
+      if (slabs[s[i]].mutex.get_storage().is_locked_or_waiting())
+        return false;
+    return true;
+  }
+};
+
+/** Like transactional_lock_guard, but for several cells of a
+striped_lock_table.
+@tparam table  striped_lock_table
+@tparam n      number of hash values */
+template<class table, size_t n>
+class transactional_lock_many_guard
+{
+  table &t;
+  /** the slab numbers */
+  size_t s[n];
+  /** the number of distinct slab numbers */
+  size_t count;
+#ifdef WITH_ELISION
+  bool elided;
+#else
+  static constexpr bool elided = false;
+#endif
+
+public:
+  TRANSACTIONAL_INLINE
+  transactional_lock_many_guard(table &t, const size_t (&hashes)[n]) : t(t)
+  {
+    std::copy(hashes, hashes + n, s);
+    count = t.slabs_for(s, n);
+#ifdef WITH_ELISION
+    if (xbegin())
+    {
+      if (t.is_unlocked(s, count))
+      {
+        elided = true;
+        return;
+      }
+      xabort();
+    }
+    elided = false;
+#endif
+    t.lock_slabs(s, count);
+  }
+  transactional_lock_many_guard(const transactional_lock_many_guard &) =
+    delete;
+  TRANSACTIONAL_INLINE ~transactional_lock_many_guard() noexcept
+  {
+#ifdef WITH_ELISION
+    if (was_elided()) xend(); else
+#endif
+    t.unlock_many(s, count);
+  }
+
+  bool was_elided() const noexcept { return elided; }
+};
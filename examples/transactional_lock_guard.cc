@@ -61,14 +61,49 @@ bool xbegin()
     __TM_simple_begin() == _HTM_TBEGIN_STARTED;
 }
 
+__attribute__((target("hot","htm")))
+unsigned xbegin_status()
+{
+  /* large enough for the s390x transaction diagnostic block */
+  alignas(8) unsigned char buf[256];
+  if (__TM_begin(buf) == _HTM_TBEGIN_STARTED)
+    return XBEGIN_STARTED;
+  unsigned char code;
+  return (__TM_is_user_abort(buf) ? XABORT_EXPLICIT : 0) |
+    (__TM_is_failure_persistent(buf) ? 0 : XABORT_RETRY) |
+    (__TM_is_conflict(buf) ? XABORT_CONFLICT : 0) |
+    (__TM_is_footprint_exceeded(buf) ? XABORT_CAPACITY : 0) |
+    (__TM_is_named_user_abort(buf, &code) && code == 0xfe
+     ? XABORT_EXPLICIT | XABORT_UPGRADE : 0);
+}
+
 __attribute__((target("hot","htm")))
 void xabort() { __TM_abort(); }
 
+__attribute__((target("hot","htm")))
+void xabort_upgrade() { __TM_named_abort(0xfe); }
+
 __attribute__((target("hot","htm")))
 void xend() { __TM_end(); }
 
 #elif defined __aarch64__
-/* FIXME: Implement a runtime check for Transactional Memory Extension (TME) */
+# ifdef __linux__
+#  include <sys/auxv.h>
+#  ifndef HWCAP2_TME
+#   define HWCAP2_TME (1UL << 17)
+#  endif
+# endif
+
+static bool can_elide()
+{
+# ifdef __linux__
+  return getauxval(AT_HWCAP2) & HWCAP2_TME;
+# else
+  return false;
+# endif
+}
+
+bool have_transactional_memory = can_elide();
 #elif defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
 # include <intrin.h>
 
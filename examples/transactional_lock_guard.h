@@ -1,4 +1,8 @@
 #pragma once
+#include <cassert>
+#include <atomic>
+#include <cstdint>
+#include "atomic_mutex.h"
 
 #ifndef WITH_ELISION
 #elif defined __powerpc64__
@@ -11,6 +15,22 @@
 # error /* Transactional memory has not been implemented for this ISA */
 #endif
 
+/** The return value of xbegin_status() when a transaction was started */
+constexpr unsigned XBEGIN_STARTED = ~0U;
+/* Abort status bits of xbegin_status(), using the IA-32 RTM encoding */
+/** xabort() was invoked */
+constexpr unsigned XABORT_EXPLICIT = 1U << 0;
+/** the transaction may succeed on a retry */
+constexpr unsigned XABORT_RETRY = 1U << 1;
+/** another thread accessed the same memory */
+constexpr unsigned XABORT_CONFLICT = 1U << 2;
+/** the transaction accessed too much memory */
+constexpr unsigned XABORT_CAPACITY = 1U << 3;
+/** the abort code of xabort_upgrade(), in addition to XABORT_EXPLICIT */
+constexpr unsigned XABORT_UPGRADE = 0xfeU << 24;
+/** mask of the abort code that was passed to xabort() */
+constexpr unsigned XABORT_CODE = 0xffU << 24;
+
 #ifndef WITH_ELISION
 # define TRANSACTIONAL_TARGET /* nothing */
 # define TRANSACTIONAL_INLINE /* nothing */
@@ -28,7 +48,13 @@ extern bool have_transactional_memory;
 
 TRANSACTIONAL_INLINE static inline bool xbegin()
 { return have_transactional_memory && _xbegin() == _XBEGIN_STARTED; }
+/** Start a transaction, if have_transactional_memory holds
+@return XBEGIN_STARTED, or the cause of an abort */
+TRANSACTIONAL_INLINE static inline unsigned xbegin_status()
+{ return _xbegin(); }
 TRANSACTIONAL_INLINE static inline void xabort() { _xabort(0); }
+/** Abort a transaction because an exclusive lock is needed */
+TRANSACTIONAL_INLINE static inline void xabort_upgrade() { _xabort(0xfe); }
 TRANSACTIONAL_INLINE static inline void xend() { _xend(); }
 # elif defined __powerpc64__ || defined __s390__
 #  define TRANSACTIONAL_TARGET __attribute__((target("hot")))
@@ -36,11 +62,13 @@ TRANSACTIONAL_INLINE static inline void xend() { _xend(); }
 extern bool have_transactional_memory;
 
 bool xbegin();
-bool xabort();
-bool xend();
+unsigned xbegin_status();
+void xabort();
+/** Abort a transaction because an exclusive lock is needed */
+void xabort_upgrade();
+void xend();
 # elif defined __aarch64__
-/* FIXME: No runtime detection of TME has been implemented! */
-constexpr bool have_transactional_memory = true;
+extern bool have_transactional_memory;
 
 #  define TRANSACTIONAL_INLINE __attribute__((always_inline))
 #  ifdef __clang__
@@ -51,29 +79,251 @@ constexpr bool have_transactional_memory = true;
 
 TRANSACTIONAL_INLINE static inline bool xbegin()
 {
-  int ret;
+  if (!have_transactional_memory)
+    return false;
+  uint64_t ret;
   __asm__ __volatile__ ("tstart %x0" : "=r"(ret) :: "memory");
   return !ret;
 }
 
+/** Start a transaction, if have_transactional_memory holds
+@return XBEGIN_STARTED, or the cause of an abort */
+TRANSACTIONAL_INLINE static inline unsigned xbegin_status()
+{
+  uint64_t ret;
+  __asm__ __volatile__ ("tstart %x0" : "=r"(ret) :: "memory");
+  if (!ret)
+    return XBEGIN_STARTED;
+  /* Translate the TME failure cause */
+  return (ret & 1U << 16 ? XABORT_EXPLICIT : 0) |
+    (ret & 1U << 15 ? XABORT_RETRY : 0) |
+    (ret & 1U << 17 ? XABORT_CONFLICT : 0) |
+    (ret & 1U << 20 ? XABORT_CAPACITY : 0) |
+    ((ret & (1U << 16 | 0x7fff)) == (1U << 16 | 0xfe) ? XABORT_UPGRADE : 0);
+}
+
 TRANSACTIONAL_INLINE static inline void xabort()
-{ __asm__ __volatile__ ("tcancel %x0" :: "n"(i) :: "memory"); }
+{ __asm__ __volatile__ ("tcancel #0" ::: "memory"); }
+
+/** Abort a transaction because an exclusive lock is needed */
+TRANSACTIONAL_INLINE static inline void xabort_upgrade()
+{ __asm__ __volatile__ ("tcancel #0xfe" ::: "memory"); }
 
 TRANSACTIONAL_INLINE static inline void xend()
 { __asm__ volatile ("tcommit" ::: "memory"); }
 # endif
 #endif
 
+/** Abort statistics, retries and adaptive disabling of lock elision.
+
+An object may be associated with a call site or with a mutex:
+
+  static transactional_elision elision;
+  transactional_lock_guard<typeof m> g{m, elision};
+
+If a transaction was aborted for a transient reason (XABORT_RETRY),
+or because the lock was being held (XABORT_EXPLICIT), it will be
+retried up to max_retries() times. Before each retry, we will spin
+for at most spin_rounds until the lock is no longer being held,
+instead of waiting for it like the non-elided acquisition would.
+A transaction that was aborted by xabort_upgrade() will not be
+retried, and it will not disable elision.
+
+After the retries were exhausted, the following acquisitions will not
+be elided, but acquire the lock. The number of such acquisitions
+starts at MIN_SKIP and is doubled whenever a transaction is aborted
+for a reason that is likely to persist (such as exceeding the capacity
+or a system call), up to MIN_SKIP << MAX_SHIFT. A committed transaction
+resets it to MIN_SKIP.
+
+The counters of committed transactions are not maintained, so that
+an elided section will not write to any shared memory.
+
+The state is updated with relaxed loads and stores, like in
+adaptive_spin_rounds. A lost update will do no harm. */
+class transactional_elision
+{
+public:
+  /** classification of aborts */
+  enum abort_cause
+  {
+    /** xabort(), typically because the lock was being held */
+    EXPLICIT,
+    /** a memory access conflict with another thread */
+    CONFLICT,
+    /** the transaction accessed too much memory */
+    CAPACITY,
+    /** any other reason, such as an interrupt or a system call */
+    OTHER,
+    N_CAUSES
+  };
+
+  /** minimum number of acquisitions that will not be elided after
+  an abort */
+  static constexpr uint32_t MIN_SKIP = 4;
+  /** the maximum number of skipped acquisitions is MIN_SKIP << MAX_SHIFT */
+  static constexpr uint32_t MAX_SHIFT = 8;
+
+private:
+  /** number of acquisitions that will not be elided */
+  std::atomic<uint32_t> skip;
+  /** how many times MIN_SKIP will be doubled on the next abort */
+  std::atomic<uint32_t> shift;
+  /** number of aborts, by abort_cause */
+  std::atomic<uint32_t> n_aborts[N_CAUSES];
+  /** number of acquisitions that were not elided due to skip */
+  std::atomic<uint32_t> n_skipped;
+  /** number of retried transactions */
+  std::atomic<uint32_t> n_retries;
+  /** maximum number of retries per acquisition */
+  const uint16_t retries;
+  /** maximum number of spinloop rounds while the lock is being held */
+  const uint16_t spin_rounds;
+
+  static void increment(std::atomic<uint32_t> &c) noexcept
+  { c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+public:
+  /** Constructor
+  @param retries      maximum number of retries per acquisition
+  @param spin_rounds  maximum number of spinloop rounds before a retry */
+  constexpr transactional_elision(uint16_t retries = 3,
+                                  uint16_t spin_rounds = 100) noexcept
+    : skip(0), shift(0), n_aborts(), n_skipped(0), n_retries(0),
+      retries(retries), spin_rounds(spin_rounds) {}
+  /** No copy constructor */
+  transactional_elision(const transactional_elision&) = delete;
+  /** No assignment operator */
+  transactional_elision& operator=(const transactional_elision&) = delete;
+
+  /** @return whether the next acquisition may be elided */
+  bool is_enabled() const noexcept
+  { return !skip.load(std::memory_order_relaxed); }
+  /** @return the maximum number of retries per acquisition */
+  unsigned max_retries() const noexcept { return retries; }
+  /** @return number of aborts due to a cause */
+  uint32_t aborts(abort_cause cause) const noexcept
+  { return n_aborts[cause].load(std::memory_order_relaxed); }
+  /** @return number of acquisitions that were not elided due to aborts */
+  uint32_t skipped() const noexcept
+  { return n_skipped.load(std::memory_order_relaxed); }
+  /** @return number of transactions that were retried */
+  uint32_t retried() const noexcept
+  { return n_retries.load(std::memory_order_relaxed); }
+
+  /** Determine whether to attempt lock elision
+  @return whether a transaction should be started */
+  bool should_elide() noexcept
+  {
+    const uint32_t s = skip.load(std::memory_order_relaxed);
+    if (!s)
+      return true;
+    skip.store(s - 1, std::memory_order_relaxed);
+    increment(n_skipped);
+    return false;
+  }
+  /** Count an aborted transaction
+  @param status  the abort status returned by xbegin_status() */
+  void count(unsigned status) noexcept
+  {
+    increment(n_aborts[status & XABORT_EXPLICIT ? EXPLICIT
+                       : status & XABORT_CONFLICT ? CONFLICT
+                       : status & XABORT_CAPACITY ? CAPACITY : OTHER]);
+  }
+  /** @return whether a transaction was aborted by xabort_upgrade()
+  @param status  the abort status returned by xbegin_status() */
+  static bool is_upgrade(unsigned status) noexcept
+  {
+    return (status & (XABORT_EXPLICIT | XABORT_CODE)) ==
+      (XABORT_EXPLICIT | XABORT_UPGRADE);
+  }
+  /** Determine whether an aborted transaction should be retried,
+  and wait for the lock to be released
+  @param status  the abort status returned by xbegin_status()
+  @param busy    predicate: whether the lock is being held
+  @return whether the transaction should be retried */
+  template<class Busy> bool may_retry(unsigned status, Busy busy) noexcept
+  {
+    if (!(status & (XABORT_EXPLICIT | XABORT_RETRY)) ||
+        status & XABORT_CAPACITY || is_upgrade(status))
+      return false;
+    for (unsigned spin = spin_rounds; busy(); spin_pause())
+      if (!spin--)
+        return false;
+    increment(n_retries);
+    return true;
+  }
+  /** Disable elision after a transaction could not be retried,
+  unless it was aborted by xabort_upgrade()
+  @param status  the abort status returned by xbegin_status() */
+  void disable(unsigned status) noexcept
+  {
+    if (is_upgrade(status))
+      return;
+    const uint32_t sh = shift.load(std::memory_order_relaxed);
+    skip.store(MIN_SKIP << sh, std::memory_order_relaxed);
+    if ((!(status & XABORT_RETRY) || status & XABORT_CAPACITY) &&
+        sh < MAX_SHIFT)
+      shift.store(sh + 1, std::memory_order_relaxed);
+  }
+  /** Note that a transaction was aborted and will not be retried
+  @param status  the abort status returned by xbegin_status() */
+  void aborted(unsigned status) noexcept { count(status); disable(status); }
+  /** Note that an elided section was committed */
+  void committed() noexcept
+  {
+    if (shift.load(std::memory_order_relaxed))
+      shift.store(0, std::memory_order_relaxed);
+  }
+};
+
+#ifdef WITH_ELISION
+/** Try to start a transaction, subject to a policy
+@param e     the policy, or nullptr to try once
+@param busy  predicate: whether the lock is being held
+@return whether a transaction was started */
+template<class Busy>
+TRANSACTIONAL_INLINE static inline bool xbegin(transactional_elision *e,
+                                               Busy busy)
+{
+  if (!e)
+    return xbegin();
+  if (!have_transactional_memory || !e->should_elide())
+    return false;
+  for (unsigned retries = e->max_retries(); ; retries--)
+  {
+    const unsigned status = xbegin_status();
+    if (status == XBEGIN_STARTED)
+      return true;
+    e->count(status);
+    if (!retries || !e->may_retry(status, busy))
+    {
+      e->disable(status);
+      return false;
+    }
+  }
+}
+/** Commit a transaction that was started by xbegin(e, busy) */
+TRANSACTIONAL_INLINE static inline void xend(transactional_elision *e)
+{
+  xend();
+  if (e)
+    e->committed();
+}
+#endif
+
 template<class mutex>
 class transactional_lock_guard
 {
   mutex &m;
+#ifdef WITH_ELISION
+  transactional_elision *const e;
+#endif
 
-public:
-  TRANSACTIONAL_INLINE transactional_lock_guard(mutex &m) : m(m)
+  TRANSACTIONAL_INLINE void lock()
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    if (xbegin(e, [this]{ return !was_elided(); }))
     {
       if (was_elided())
         return;
@@ -82,11 +332,25 @@ public:
 #endif
     m.lock();
   }
+
+public:
+  TRANSACTIONAL_INLINE transactional_lock_guard(mutex &m) : m(m)
+#ifdef WITH_ELISION
+    , e(nullptr)
+#endif
+  { lock(); }
+  /** Acquire a lock, with an adaptive policy for elision */
+  TRANSACTIONAL_INLINE
+  transactional_lock_guard(mutex &m, transactional_elision &e) : m(m)
+#ifdef WITH_ELISION
+    , e(&e)
+#endif
+  { (void) e; lock(); }
   transactional_lock_guard(const transactional_lock_guard &) = delete;
   TRANSACTIONAL_INLINE ~transactional_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided()) xend(e); else
 #endif
     m.unlock();
   }
@@ -104,16 +368,18 @@ class transactional_shared_lock_guard
 {
   mutex &m;
 #ifdef WITH_ELISION
+  transactional_elision *const e;
   bool elided;
 #else
   static constexpr bool elided = false;
 #endif
+  /** whether try_upgrade() acquired an exclusive lock */
+  bool exclusive = false;
 
-public:
-  TRANSACTIONAL_INLINE transactional_shared_lock_guard(mutex &m) : m(m)
+  TRANSACTIONAL_INLINE void lock_shared()
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    if (xbegin(e, [this]{ return m.get_storage().is_locked(); }))
     {
       if (!m.get_storage().is_locked())
       {
@@ -126,14 +392,51 @@ public:
 #endif
     m.lock_shared();
   }
+
+public:
+  TRANSACTIONAL_INLINE transactional_shared_lock_guard(mutex &m) : m(m)
+#ifdef WITH_ELISION
+    , e(nullptr)
+#endif
+  { lock_shared(); }
+  /** Acquire a shared lock, with an adaptive policy for elision */
+  TRANSACTIONAL_INLINE
+  transactional_shared_lock_guard(mutex &m, transactional_elision &e) : m(m)
+#ifdef WITH_ELISION
+    , e(&e)
+#endif
+  { (void) e; lock_shared(); }
   transactional_shared_lock_guard(const transactional_shared_lock_guard &) =
     delete;
   TRANSACTIONAL_INLINE ~transactional_shared_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided()) xend(e); else
 #endif
-    m.unlock_shared();
+    if (exclusive) m.unlock(); else m.unlock_shared();
+  }
+
+  /** Try to upgrade the shared lock to exclusive, by
+  mutex::try_lock_shared_upgrade(). An elided shared lock does not
+  exclude other shared lock holders, so the memory transaction will be
+  aborted, and the critical section will be re-executed from the start,
+  possibly without elision.
+  @return whether the exclusive lock was acquired */
+  TRANSACTIONAL_INLINE bool try_upgrade() noexcept
+  {
+    assert(!exclusive);
+#ifdef WITH_ELISION
+    if (was_elided())
+      xabort_upgrade();
+#endif
+    return exclusive = m.try_lock_shared_upgrade();
+  }
+  /** Downgrade an exclusive lock that was acquired by try_upgrade() */
+  void downgrade() noexcept
+  {
+    assert(exclusive);
+    m.lock_downgrade_to_shared();
+    exclusive = false;
   }
 
   bool was_elided() const noexcept { return elided; }
@@ -143,12 +446,14 @@ template<class mutex>
 class transactional_update_lock_guard
 {
   mutex &m;
+#ifdef WITH_ELISION
+  transactional_elision *const e;
+#endif
 
-public:
-  TRANSACTIONAL_INLINE transactional_update_lock_guard(mutex &m) : m(m)
+  TRANSACTIONAL_INLINE void lock_update()
   {
 #ifdef WITH_ELISION
-    if (xbegin())
+    if (xbegin(e, [this]{ return !was_elided(); }))
     {
       if (was_elided())
         return;
@@ -157,20 +462,117 @@ public:
 #endif
     m.lock_update();
   }
+
+public:
+  TRANSACTIONAL_INLINE transactional_update_lock_guard(mutex &m) : m(m)
+#ifdef WITH_ELISION
+    , e(nullptr)
+#endif
+  { lock_update(); }
+  /** Acquire an update lock, with an adaptive policy for elision */
+  TRANSACTIONAL_INLINE
+  transactional_update_lock_guard(mutex &m, transactional_elision &e) : m(m)
+#ifdef WITH_ELISION
+    , e(&e)
+#endif
+  { (void) e; lock_update(); }
   transactional_update_lock_guard(const transactional_update_lock_guard &) =
     delete;
   TRANSACTIONAL_INLINE ~transactional_update_lock_guard() noexcept
   {
 #ifdef WITH_ELISION
-    if (was_elided()) xend(); else
+    if (was_elided()) xend(e); else
 #endif
     m.unlock_update();
   }
 
 #ifdef WITH_ELISION
+  /* Any exclusive lock is also holding the mutex of lock_update().
+  Shared locks are compatible with our update lock, and the memory
+  transaction will not subscribe to the word that they modify. */
   bool was_elided() const noexcept
-  { return !m.get_storage().is_locked_or_waiting(); }
+  { return !m.get_storage().is_outer_locked_or_waiting(); }
 #else
   bool was_elided() const noexcept { return false; }
 #endif
 };
+
+/** A read section of atomic_seqlock that is tried as a memory transaction,
+then optimistically, and finally with lock_shared(). The section must be
+written as a loop that is repeated until validate() returns true:
+
+  for (transactional_optimistic_lock_guard<typeof m> g{m}; ; ) {
+    copy the data, by relaxed std::atomic loads;
+    if (g.validate()) break;
+  }
+*/
+template<class mutex>
+class transactional_optimistic_lock_guard
+{
+  mutex &m;
+  /** the return value of read_begin() */
+  uint32_t seq = 0;
+  /** number of remaining optimistic attempts; 0 if lock_shared() */
+  unsigned rounds;
+#ifdef WITH_ELISION
+  bool elided;
+#else
+  static constexpr bool elided = false;
+#endif
+
+public:
+  /** Start a read section.
+  @param m       the lock
+  @param rounds  number of optimistic attempts before lock_shared() */
+  TRANSACTIONAL_INLINE
+  transactional_optimistic_lock_guard(mutex &m, unsigned rounds = 3) :
+    m(m), rounds(rounds)
+  {
+#ifdef WITH_ELISION
+    if (xbegin())
+    {
+      if (!m.get_storage().is_locked())
+      {
+        elided = true;
+        return;
+      }
+      xabort();
+    }
+    elided = false;
+#endif
+    if (rounds)
+      seq = m.read_begin();
+    else
+      m.lock_shared();
+  }
+  transactional_optimistic_lock_guard
+  (const transactional_optimistic_lock_guard &) = delete;
+  TRANSACTIONAL_INLINE ~transactional_optimistic_lock_guard() noexcept
+  {
+#ifdef WITH_ELISION
+    if (was_elided()) xend(); else
+#endif
+    if (!rounds)
+      m.unlock_shared();
+  }
+
+  /** Validate the data that was read
+  @return whether the read section is complete; false if it must be
+  repeated */
+  bool validate() noexcept
+  {
+    if (elided || !rounds)
+      return true;
+    if (m.read_validate(seq))
+      return true;
+    if (--rounds)
+      seq = m.read_begin();
+    else
+      m.lock_shared();
+    return false;
+  }
+
+  bool was_elided() const noexcept { return elided; }
+  /** @return whether lock_shared() is being held */
+  bool was_shared() const noexcept { return !rounds && !elided; }
+};
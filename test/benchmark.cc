@@ -0,0 +1,699 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <type_traits>
+
+#if __cplusplus >= 201703L
+# include <shared_mutex>
+#endif
+#ifndef _WIN32
+# include <sys/utsname.h>
+#endif
+#include "atomic_shared_mutex.h"
+#include "atomic_condition_variable.h"
+#include "native_mutex_storage.h"
+#include "transactional_lock_guard.h"
+
+/*
+
+Throughput, latency and fairness of the locks, for tracking regressions.
+
+Each benchmark is run for every combination of the thread counts (-t)
+and critical section lengths (-c) for a fixed duration (-d). During
+that time, each thread repeatedly executes operations, measuring the
+latency of each operation (acquiring the lock, executing the critical
+section and releasing the lock).
+
+For every run, one line of CSV or one JSON object is output:
+  ops_per_sec          the throughput of all threads
+  p50_ns ... p999_ns   latency percentiles, with a precision of 1/8
+  fairness             Jain's fairness index of the per-thread operation
+                       counts: 1.0 if every thread completed the same
+                       number of operations, 1/threads if one thread
+                       completed all of them
+
+The benchmarks are as follows:
+  mutex     exclusive locks: atomic_mutex with various Storage,
+            std::mutex, and atomic_mutex<native_mutex_storage>
+            (pthread_mutex_t or SRWLOCK)
+  shared    mixes of S/U/X locks of atomic_shared_mutex with various
+            Storage, std::shared_mutex, and native_shared_mutex
+            (pthread_rwlock_t or SRWLOCK); for the latter two,
+            an update lock is replaced with an exclusive lock
+  condvar   passing a token between threads: atomic_condition_variable
+            and std::condition_variable
+  elision   (WITH_ELISION) transactional_lock_guard and
+            transactional_shared_lock_guard, with and without
+            transactional_elision, for comparison with the
+            corresponding rows of the mutex and shared benchmarks
+
+*/
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-t THREADS,...] [-c LENGTH,...] [-d MILLISECONDS]\n"
+          "       [-u UPGRADE_PERCENT] [-f csv|json] [-b BENCHMARK]\n", argv0);
+  exit(1);
+}
+
+/** Options */
+static std::vector<unsigned> n_threads, cs_lengths;
+static unsigned duration_ms = 100;
+/** percentage of the update locks that will be upgraded to exclusive */
+static unsigned upgrade_percent = 50;
+static bool json;
+static const char *only;
+
+/** The data that critical sections access */
+static volatile uint64_t shared_data[8];
+
+/** Execute a critical section
+@param cs     number of accesses to shared_data
+@param write  whether to modify shared_data */
+static inline void critical_section(unsigned cs, bool write)
+{
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < cs; i++)
+    if (write)
+      shared_data[i & 7] = shared_data[i & 7] + 1;
+    else
+      sum += shared_data[i & 7];
+  (void) sum;
+}
+
+/** A histogram of latencies in nanoseconds, with 8 sub-buckets for
+each power of 2 */
+class histogram
+{
+  static constexpr unsigned SUB = 8;
+  static constexpr unsigned BUCKETS = 62 * SUB;
+  uint64_t count[BUCKETS];
+
+  static unsigned log2(uint64_t n)
+  {
+#if defined __GNUC__ || defined __clang__
+    return 63 - unsigned(__builtin_clzll(n));
+#else
+    unsigned l = 0;
+    while (n >>= 1)
+      l++;
+    return l;
+#endif
+  }
+  static unsigned bucket(uint64_t ns)
+  {
+    if (ns < SUB)
+      return unsigned(ns);
+    const unsigned l = log2(ns);
+    return (l - 2) * SUB + unsigned(ns >> (l - 3)) % SUB;
+  }
+  /** @return the smallest value of a bucket */
+  static uint64_t lower(unsigned b)
+  {
+    if (b < SUB)
+      return b;
+    return uint64_t(SUB + b % SUB) << (b / SUB - 1);
+  }
+
+public:
+  histogram() : count() {}
+
+  void add(uint64_t ns) { count[bucket(ns)]++; }
+  void merge(const histogram &h)
+  {
+    for (unsigned b = 0; b < BUCKETS; b++)
+      count[b] += h.count[b];
+  }
+  /** @return an upper bound of the q-quantile */
+  uint64_t quantile(double q) const
+  {
+    uint64_t total = 0;
+    for (unsigned b = 0; b < BUCKETS; b++)
+      total += count[b];
+    const uint64_t rank = uint64_t(q * double(total));
+    uint64_t sum = 0;
+    for (unsigned b = 0; b < BUCKETS; b++)
+      if ((sum += count[b]) > rank)
+        return b + 1 < BUCKETS ? lower(b + 1) - 1 : ~uint64_t(0);
+    return 0;
+  }
+};
+
+/** The state of a benchmark thread */
+struct alignas(64) worker
+{
+  uint64_t ops = 0;
+  uint32_t seed;
+  histogram latency;
+
+  /** @return a pseudo-random number (xorshift32) */
+  uint32_t random() noexcept
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+};
+
+static std::atomic<bool> go, stop;
+static std::atomic<unsigned> ready;
+
+template<class Benchmark>
+static void work(Benchmark &b, worker &w, unsigned cs)
+{
+  ready.fetch_add(1);
+  while (!go.load(std::memory_order_acquire))
+    std::this_thread::yield();
+  while (!stop.load(std::memory_order_relaxed))
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if (!b.op(w, cs))
+      break;
+    const auto end = std::chrono::steady_clock::now();
+    w.latency.add(uint64_t(std::chrono::duration_cast
+                           <std::chrono::nanoseconds>(end - start).count()));
+    w.ops++;
+  }
+}
+
+/** Output a string as a JSON or CSV value */
+static void print_string(const char *s)
+{
+  putchar('"');
+  for (; *s; s++)
+  {
+    if (*s == '"')
+      putchar(json ? '\\' : '"');
+    else if (*s == '\\' && json)
+      putchar('\\');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+/** @return the compiler version */
+static const char *compiler()
+{
+#if defined __clang__
+  return "clang " __clang_version__;
+#elif defined __GNUC__
+  return "gcc " __VERSION__;
+#elif defined _MSC_VER
+# define STR(x) #x
+# define XSTR(x) STR(x)
+  return "msvc " XSTR(_MSC_FULL_VER);
+#else
+  return "unknown";
+#endif
+}
+
+/** The operating system version */
+static std::string os;
+
+static bool first_result = true;
+
+/** Run a benchmark and output the result
+@param benchmark  name of the benchmark
+@param lock       name of the lock
+@param mix        the kind of operations
+@param b          the benchmark
+@param threads    number of threads
+@param cs         the critical section length */
+template<class Benchmark>
+static void run(const char *benchmark, const char *lock, const char *mix,
+                Benchmark &b, unsigned threads, unsigned cs)
+{
+  std::vector<worker> w(threads);
+  std::vector<std::thread> t(threads);
+  go.store(false);
+  stop.store(false);
+  ready.store(0);
+  for (unsigned i = 0; i < threads; i++)
+  {
+    w[i].seed = 2463534242U + i;
+    t[i] = std::thread(work<Benchmark>, std::ref(b), std::ref(w[i]), cs);
+  }
+  while (ready.load() != threads)
+    std::this_thread::yield();
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+  stop.store(true);
+  b.finish();
+  for (unsigned i = 0; i < threads; i++)
+    t[i].join();
+  const double seconds = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+
+  histogram latency;
+  uint64_t ops = 0;
+  double sum = 0, sum_sq = 0;
+  for (const worker &i : w)
+  {
+    latency.merge(i.latency);
+    ops += i.ops;
+    sum += double(i.ops);
+    sum_sq += double(i.ops) * double(i.ops);
+  }
+  const double fairness = sum_sq ? sum * sum / (threads * sum_sq) : 0;
+
+  if (json)
+  {
+    fputs(first_result ? "\n" : ",\n", stdout);
+    fputs("{\"benchmark\": ", stdout); print_string(benchmark);
+    fputs(", \"lock\": ", stdout); print_string(lock);
+    fputs(", \"mix\": ", stdout); print_string(mix);
+    printf(", \"threads\": %u, \"cs\": %u, \"ops\": %llu, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+           "\"fairness\": %.4f}",
+           threads, cs, (unsigned long long) ops, seconds, ops / seconds,
+           (unsigned long long) latency.quantile(0.5),
+           (unsigned long long) latency.quantile(0.99),
+           (unsigned long long) latency.quantile(0.999), fairness);
+  }
+  else
+  {
+    print_string(benchmark); putchar(',');
+    print_string(lock); putchar(',');
+    print_string(mix);
+    printf(",%u,%u,%llu,%.6f,%.0f,%llu,%llu,%llu,%.4f,",
+           threads, cs, (unsigned long long) ops, seconds, ops / seconds,
+           (unsigned long long) latency.quantile(0.5),
+           (unsigned long long) latency.quantile(0.99),
+           (unsigned long long) latency.quantile(0.999), fairness);
+    print_string(compiler()); putchar(',');
+    print_string(os.c_str()); putchar('\n');
+  }
+  fflush(stdout);
+  first_result = false;
+}
+
+/** Like atomic_mutex, but with an adaptive spinloop in lock() */
+template<typename storage = mutex_storage<>>
+class atomic_adaptive_mutex : public atomic_mutex<storage>
+{
+  adaptive_spin_rounds spin;
+public:
+  void lock() noexcept { atomic_mutex<storage>::spin_lock(spin); }
+};
+
+/** Exclusive locking */
+template<class Mutex>
+class mutex_benchmark
+{
+  /** value-initialized, like a lock in static storage */
+  Mutex m{};
+public:
+  bool op(worker &, unsigned cs) noexcept
+  {
+    m.lock();
+    critical_section(cs, true);
+    m.unlock();
+    return true;
+  }
+  void finish() noexcept {}
+};
+
+/** A mix of shared, update and exclusive locks */
+struct lock_mix
+{
+  const char *name;
+  /** percentage of update locks */
+  unsigned u;
+  /** percentage of exclusive locks */
+  unsigned x;
+};
+
+static const lock_mix mixes[] = {
+  {"S98/X2", 0, 2}, {"S80/X20", 0, 20}, {"S70/U20/X10", 20, 10}
+};
+
+/** Shared, update and exclusive locking */
+template<class Mutex>
+class shared_benchmark
+{
+  Mutex m{};
+  const lock_mix &mix;
+
+  /** Execute an update lock operation on atomic_shared_mutex */
+  template<class M>
+  static auto update(M &m, bool upgrade, unsigned cs, int)
+    -> decltype(m.update_lock_upgrade())
+  {
+    m.lock_update();
+    critical_section(cs, false);
+    if (upgrade)
+    {
+      m.update_lock_upgrade();
+      critical_section(cs, true);
+      m.update_lock_downgrade();
+    }
+    m.unlock_update();
+  }
+  /** Execute an update lock operation on a lock without lock_update() */
+  template<class M>
+  static void update(M &m, bool upgrade, unsigned cs, long)
+  {
+    m.lock();
+    critical_section(cs, false);
+    if (upgrade)
+      critical_section(cs, true);
+    m.unlock();
+  }
+
+public:
+  explicit shared_benchmark(const lock_mix &mix) : mix(mix) {}
+
+  bool op(worker &w, unsigned cs) noexcept
+  {
+    const unsigned r = w.random() % 100;
+    if (r < mix.x)
+    {
+      m.lock();
+      critical_section(cs, true);
+      m.unlock();
+    }
+    else if (r < mix.x + mix.u)
+      update(m, w.random() % 100 < upgrade_percent, cs, 0);
+    else
+    {
+      m.lock_shared();
+      critical_section(cs, false);
+      m.unlock_shared();
+    }
+    return true;
+  }
+  void finish() noexcept {}
+};
+
+/** Passing a token between threads by atomic_condition_variable */
+class atomic_condvar_benchmark
+{
+  atomic_mutex<> m{};
+  atomic_condition_variable cv;
+  unsigned turn = 0, threads;
+  std::atomic<unsigned> next{0};
+  static thread_local unsigned id;
+public:
+  explicit atomic_condvar_benchmark(unsigned threads) : threads(threads) {}
+
+  bool op(worker &w, unsigned cs) noexcept
+  {
+    if (!w.ops)
+      id = next.fetch_add(1);
+    m.lock();
+    while (turn != id && !stop.load(std::memory_order_relaxed))
+      cv.wait(m);
+    critical_section(cs, true);
+    turn = (id + 1) % threads;
+    m.unlock();
+    cv.broadcast();
+    return !stop.load(std::memory_order_relaxed);
+  }
+  void finish() noexcept
+  {
+    m.lock();
+    m.unlock();
+    cv.broadcast();
+  }
+};
+thread_local unsigned atomic_condvar_benchmark::id;
+
+/** Passing a token between threads by std::condition_variable */
+class std_condvar_benchmark
+{
+  std::mutex m;
+  std::condition_variable cv;
+  unsigned turn = 0, threads;
+  std::atomic<unsigned> next{0};
+  static thread_local unsigned id;
+public:
+  explicit std_condvar_benchmark(unsigned threads) : threads(threads) {}
+
+  bool op(worker &w, unsigned cs)
+  {
+    if (!w.ops)
+      id = next.fetch_add(1);
+    {
+      std::unique_lock<std::mutex> g{m};
+      while (turn != id && !stop.load(std::memory_order_relaxed))
+        cv.wait(g);
+      critical_section(cs, true);
+      turn = (id + 1) % threads;
+    }
+    cv.notify_all();
+    return !stop.load(std::memory_order_relaxed);
+  }
+  void finish() noexcept
+  {
+    { std::lock_guard<std::mutex> g{m}; }
+    cv.notify_all();
+  }
+};
+thread_local unsigned std_condvar_benchmark::id;
+
+#ifdef WITH_ELISION
+/** transactional_lock_guard or transactional_shared_lock_guard,
+optionally with an adaptive transactional_elision policy */
+template<class Mutex, bool shared, bool adaptive>
+class elision_benchmark
+{
+  Mutex m{};
+  transactional_elision e{};
+
+  TRANSACTIONAL_TARGET void guarded(unsigned cs, std::false_type) noexcept
+  {
+    if (adaptive)
+    {
+      transactional_lock_guard<Mutex> g{m, e};
+      critical_section(cs, true);
+    }
+    else
+    {
+      transactional_lock_guard<Mutex> g{m};
+      critical_section(cs, true);
+    }
+  }
+  TRANSACTIONAL_TARGET void guarded(unsigned cs, std::true_type) noexcept
+  {
+    if (adaptive)
+    {
+      transactional_shared_lock_guard<Mutex> g{m, e};
+      critical_section(cs, false);
+    }
+    else
+    {
+      transactional_shared_lock_guard<Mutex> g{m};
+      critical_section(cs, false);
+    }
+  }
+public:
+  bool op(worker &, unsigned cs) noexcept
+  {
+    guarded(cs, std::integral_constant<bool, shared>());
+    return true;
+  }
+  void finish() noexcept {}
+};
+#endif
+
+/** @return whether a benchmark was selected by -b */
+static bool selected(const char *benchmark)
+{ return !only || !strcmp(only, benchmark); }
+
+template<class Mutex>
+static void run_mutex(const char *lock)
+{
+  for (unsigned threads : n_threads)
+    for (unsigned cs : cs_lengths)
+    {
+      mutex_benchmark<Mutex> b;
+      run("mutex", lock, "X", b, threads, cs);
+    }
+}
+
+template<class Mutex>
+static void run_shared(const char *lock)
+{
+  for (const lock_mix &mix : mixes)
+    for (unsigned threads : n_threads)
+      for (unsigned cs : cs_lengths)
+      {
+        shared_benchmark<Mutex> b{mix};
+        run("shared", lock, mix.name, b, threads, cs);
+      }
+}
+
+template<class Benchmark>
+static void run_condvar(const char *lock)
+{
+  for (unsigned threads : n_threads)
+    if (threads > 1)
+      for (unsigned cs : cs_lengths)
+      {
+        Benchmark b{threads};
+        run("condvar", lock, "X", b, threads, cs);
+      }
+}
+
+#ifdef WITH_ELISION
+template<class Mutex, bool shared, bool adaptive>
+static void run_elision(const char *lock)
+{
+  for (unsigned threads : n_threads)
+    for (unsigned cs : cs_lengths)
+    {
+      elision_benchmark<Mutex, shared, adaptive> b;
+      run("elision", lock, shared ? "S" : "X", b, threads, cs);
+    }
+}
+#endif
+
+/** Parse a comma-separated list of numbers */
+static bool parse_list(const char *s, std::vector<unsigned> &v)
+{
+  v.clear();
+  for (;;)
+  {
+    char *endp;
+    const unsigned long n = strtoul(s, &endp, 0);
+    if (endp == s)
+      return false;
+    v.push_back(unsigned(n));
+    if (!*endp)
+      return true;
+    if (*endp != ',')
+      return false;
+    s = endp + 1;
+  }
+}
+
+template<shared_mutex_policy policy>
+using atomic_policy_shared_mutex =
+  atomic_shared_mutex<shared_mutex_storage<uint32_t, policy>>;
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (arg[0] != '-' || !arg[1] || arg[2] || ++i == argc)
+      usage(*argv);
+    const char *val = argv[i];
+    char *endp;
+    switch (arg[1]) {
+    case 't':
+      if (!parse_list(val, n_threads))
+        usage(*argv);
+      break;
+    case 'c':
+      if (!parse_list(val, cs_lengths))
+        usage(*argv);
+      break;
+    case 'd':
+      duration_ms = unsigned(strtoul(val, &endp, 0));
+      if (endp == val || *endp)
+        usage(*argv);
+      break;
+    case 'u':
+      upgrade_percent = unsigned(strtoul(val, &endp, 0));
+      if (endp == val || *endp || upgrade_percent > 100)
+        usage(*argv);
+      break;
+    case 'f':
+      if (!strcmp(val, "json"))
+        json = true;
+      else if (strcmp(val, "csv"))
+        usage(*argv);
+      break;
+    case 'b':
+      only = val;
+      break;
+    default:
+      usage(*argv);
+    }
+  }
+
+  if (n_threads.empty())
+  {
+    const unsigned max = 2 * std::max(std::thread::hardware_concurrency(), 1U);
+    for (unsigned n = 1; n <= max; n *= 2)
+      n_threads.push_back(n);
+  }
+  if (cs_lengths.empty())
+    cs_lengths = {0, 10, 100};
+
+#ifdef _WIN32
+  os = "Windows";
+#else
+  utsname u;
+  if (!uname(&u))
+    os = std::string(u.sysname) + ' ' + u.release + ' ' + u.machine;
+#endif
+
+  if (json)
+  {
+    fputs("{\"compiler\": ", stdout); print_string(compiler());
+    fputs(", \"os\": ", stdout); print_string(os.c_str());
+    fputs(", \"results\": [", stdout);
+  }
+  else
+    puts("benchmark,lock,mix,threads,cs,ops,seconds,ops_per_sec,"
+         "p50_ns,p99_ns,p999_ns,fairness,compiler,os");
+
+  if (selected("mutex"))
+  {
+    run_mutex<atomic_mutex<>>("atomic_mutex");
+    run_mutex<atomic_adaptive_mutex<>>("atomic_adaptive_mutex");
+    run_mutex<atomic_mutex<fair_mutex_storage<>>>("atomic_fair_mutex");
+    run_mutex<atomic_mutex<mcs_mutex_storage>>("atomic_mcs_mutex");
+    run_mutex<atomic_mutex<cohort_mutex_storage<>>>("atomic_cohort_mutex");
+    run_mutex<atomic_mutex<native_mutex_storage>>("native_mutex");
+    run_mutex<std::mutex>("std::mutex");
+  }
+  if (selected("shared"))
+  {
+    run_shared<atomic_policy_shared_mutex<shared_mutex_policy::prefer_writer>>
+      ("atomic_shared_mutex");
+    run_shared<atomic_policy_shared_mutex<shared_mutex_policy::prefer_reader>>
+      ("atomic_shared_mutex(prefer_reader)");
+    run_shared<atomic_policy_shared_mutex<shared_mutex_policy::phase_fair>>
+      ("atomic_shared_mutex(phase_fair)");
+    run_shared<atomic_shared_mutex<sharded_shared_mutex_storage<>>>
+      ("atomic_shared_mutex(sharded)");
+    run_shared<native_shared_mutex>("native_shared_mutex");
+#if __cplusplus >= 201703L
+    run_shared<std::shared_mutex>("std::shared_mutex");
+#endif
+  }
+  if (selected("condvar"))
+  {
+    run_condvar<atomic_condvar_benchmark>("atomic_condition_variable");
+    run_condvar<std_condvar_benchmark>("std::condition_variable");
+  }
+#ifdef WITH_ELISION
+  if (selected("elision"))
+  {
+    run_elision<atomic_mutex<>, false, false>("atomic_mutex");
+    run_elision<atomic_mutex<>, false, true>("atomic_mutex(adaptive)");
+    run_elision<atomic_shared_mutex<>, true, false>("atomic_shared_mutex");
+    run_elision<atomic_shared_mutex<>, true, true>
+      ("atomic_shared_mutex(adaptive)");
+  }
+#endif
+
+  if (json)
+    puts("\n]}");
+  return 0;
+}
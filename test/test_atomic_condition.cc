@@ -4,6 +4,7 @@
 #include "atomic_mutex.h"
 #include "atomic_shared_mutex.h"
 #include "atomic_condition_variable.h"
+#include "atomic_monitor.h"
 #include "transactional_lock_guard.h"
 
 static unsigned pending;
@@ -32,6 +33,21 @@ TRANSACTIONAL_TARGET static void test_condition_variable()
   pending--;
 }
 
+static std::atomic<unsigned> timeouts;
+
+TRANSACTIONAL_TARGET static void test_timed_condition_variable()
+{
+  transactional_lock_guard<typeof m> g{m};
+#ifdef WITH_ELISION
+  if (!pending && g.was_elided())
+    xabort();
+#endif
+  while (!pending)
+    if (cv.wait_for(m, std::chrono::milliseconds(1)))
+      timeouts.fetch_add(1, std::memory_order_relaxed);
+  pending--;
+}
+
 #include <condition_variable>
 static std::condition_variable_any cva;
 
@@ -63,6 +79,17 @@ TRANSACTIONAL_TARGET static void test_shared_condition_variable()
     cv.wait_shared(sux);
 }
 
+static atomic_monitor monitor;
+
+static void test_monitor()
+{
+  monitor.lock();
+  while (!pending)
+    monitor.wait();
+  pending--;
+  monitor.unlock();
+}
+
 TRANSACTIONAL_TARGET
 int main(int, char **)
 {
@@ -96,6 +123,46 @@ int main(int, char **)
 
   fputs("atomic_mutex ", stderr);
 
+  for (auto j = N_ROUNDS / 10; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_timed_condition_variable);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    {
+      transactional_lock_guard<typeof m> g{m};
+      pending = N_THREADS;
+      if (cv.is_waiting())
+        cv.broadcast();
+    }
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!cv.is_waiting());
+    assert(!pending);
+  }
+
+  assert(timeouts);
+  fputs("(timed), ", stderr);
+
+  for (auto j = N_ROUNDS; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_condition_variable);
+    std::this_thread::yield();
+    {
+      transactional_lock_guard<typeof m> g{m};
+      pending = N_THREADS;
+      if (cv.is_waiting())
+        cv.broadcast(m);
+    }
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!cv.is_waiting());
+    assert(!pending);
+    assert(!m.get_storage().is_locked_or_waiting());
+  }
+
+  fputs("(requeue), ", stderr);
+
   for (auto j = N_ROUNDS; j--; )
   {
     for (auto i = N_THREADS; i--; )
@@ -131,6 +198,38 @@ int main(int, char **)
     pending = 0;
   }
 
-  fputs("atomic_shared_mutex.\n", stderr);
+  fputs("atomic_shared_mutex, ", stderr);
+
+  for (auto j = N_ROUNDS; j--; )
+  {
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_monitor);
+    for (auto i = N_THREADS; i--; )
+    {
+      monitor.lock();
+      pending++;
+      monitor.signal();
+      monitor.unlock();
+    }
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!monitor.is_waiting());
+    assert(!pending);
+
+    for (auto i = N_THREADS; i--; )
+      t[i] = std::thread(test_monitor);
+    std::this_thread::yield();
+    monitor.lock();
+    pending = N_THREADS;
+    monitor.broadcast();
+    monitor.unlock();
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    assert(!monitor.is_waiting());
+    assert(!pending);
+    assert(!monitor.is_locked_or_waiting());
+  }
+
+  fputs("atomic_monitor.\n", stderr);
   return 0;
 }
@@ -1,11 +1,27 @@
 #include <cstdio>
 #include <thread>
+#include <functional>
 #include <cassert>
 #include "atomic_mutex.h"
 #include "atomic_shared_mutex.h"
+#include "mutex_profile.h"
 #include "atomic_recursive_shared_mutex.h"
+#include "atomic_recursive_mutex.h"
+#include "atomic_seqlock.h"
+#include "striped_lock_table.h"
+#include "lock_all.h"
+#include "flat_combining.h"
 #include "atomic_condition_variable.h"
 #include "transactional_lock_guard.h"
+#ifdef __cpp_impl_coroutine
+# include <vector>
+# include "async_mutex.h"
+#endif
+#ifdef __linux__
+# include <sys/mman.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
 
 static bool critical;
 
@@ -50,6 +66,13 @@ public:
 # define atomic_spin_recursive_shared_mutex atomic_recursive_shared_mutex
 #endif
 static atomic_spin_mutex<> m;
+static atomic_spin_mutex<mcs_mutex_storage> mcs_m;
+static atomic_spin_mutex<cohort_mutex_storage<>> cohort_m;
+static atomic_spin_mutex<mutex_storage<uint16_t>> m16;
+static atomic_spin_mutex<mutex_storage<uint64_t>> m64;
+#ifdef __linux__
+static atomic_spin_mutex<pi_mutex_storage> pi_m;
+#endif
 
 #if !defined WITH_ELISION || defined NDEBUG
 # define transactional_assert(x) assert(x)
@@ -57,11 +80,12 @@ static atomic_spin_mutex<> m;
 # define transactional_assert(x) if (!x) goto abort;
 #endif
 
-TRANSACTIONAL_TARGET static void test_atomic_mutex()
+template<typename mutex>
+TRANSACTIONAL_TARGET static void test_atomic_mutex(mutex &m)
 {
   for (auto i = N_ROUNDS * M_ROUNDS; i--; )
   {
-    transactional_lock_guard<typeof m> g{m};
+    transactional_lock_guard<mutex> g{m};
     transactional_assert(!critical);
     critical = true;
     critical = false;
@@ -75,13 +99,20 @@ abort:
 }
 
 static atomic_spin_shared_mutex<> sux;
+static atomic_spin_shared_mutex
+<shared_mutex_storage<uint32_t, shared_mutex_policy::prefer_reader>> reader_sux;
+static atomic_spin_shared_mutex
+<shared_mutex_storage<uint32_t, shared_mutex_policy::phase_fair>> fair_sux;
+static atomic_spin_shared_mutex<sharded_shared_mutex_storage<>> sharded_sux;
+static atomic_spin_shared_mutex<shared_mutex_storage<uint64_t>> sux64;
 
-TRANSACTIONAL_TARGET static void test_shared_mutex()
+template<typename shared_mutex>
+TRANSACTIONAL_TARGET static void test_shared_mutex(shared_mutex &sux)
 {
   for (auto i = N_ROUNDS; i--; )
   {
     {
-      transactional_lock_guard<typeof sux> g{sux};
+      transactional_lock_guard<shared_mutex> g{sux};
       transactional_assert(!critical);
       critical = true;
       critical = false;
@@ -89,13 +120,26 @@ TRANSACTIONAL_TARGET static void test_shared_mutex()
 
     for (auto j = M_ROUNDS; j--; )
     {
-      transactional_shared_lock_guard<typeof sux> g{sux};
+      transactional_shared_lock_guard<shared_mutex> g{sux};
+      transactional_assert(!critical);
+    }
+
+    for (auto j = M_ROUNDS; j--; )
+    {
+      transactional_shared_lock_guard<shared_mutex> g{sux};
+      transactional_assert(!critical);
+      if (j & 1 || !g.try_upgrade())
+        continue;
+      transactional_assert(!critical);
+      critical = true;
+      critical = false;
+      g.downgrade();
       transactional_assert(!critical);
     }
 
     for (auto j = M_ROUNDS; j--; )
     {
-      transactional_update_lock_guard<typeof sux> g{sux};
+      transactional_update_lock_guard<shared_mutex> g{sux};
       transactional_assert(!critical);
       if (!g.was_elided())
         sux.update_lock_upgrade();
@@ -114,6 +158,37 @@ abort:
 #endif
 }
 
+static transactional_elision elision;
+
+TRANSACTIONAL_TARGET static void test_transactional_elision()
+{
+  for (auto i = N_ROUNDS * M_ROUNDS; i--; )
+  {
+    transactional_lock_guard<typeof m> g{m, elision};
+    transactional_assert(!critical);
+    critical = true;
+    critical = false;
+  }
+#if !defined WITH_ELISION || defined NDEBUG
+#else
+  return;
+abort:
+  abort();
+#endif
+}
+
+static atomic_spin_mutex<profiled_mutex_storage<>> profiled_m;
+static atomic_spin_shared_mutex<profiled_shared_mutex_storage<>> profiled_sux;
+
+/** @return the statistics of a profiled lock */
+static mutex_stats profiled_stats(const void *lock)
+{
+  for (const mutex_profile_entry &e : mutex_profile_top(~size_t(0)))
+    if (e.lock == lock)
+      return e.stats;
+  return mutex_stats{};
+}
+
 static atomic_spin_recursive_shared_mutex<> recursive_sux;
 
 static void test_recursive_shared_mutex()
@@ -152,9 +227,589 @@ static void test_recursive_shared_mutex()
       recursive_sux.update_lock_downgrade();
       recursive_sux.unlock_update();
     }
+
+    for (auto j = M_ROUNDS / 2; j--; )
+    {
+      recursive_sux.lock_shared();
+      assert(!critical);
+      if (recursive_sux.try_lock_shared_upgrade())
+      {
+        assert(recursive_sux.holding_lock());
+        assert(!critical);
+        critical = true;
+        critical = false;
+        recursive_sux.lock_downgrade_to_shared();
+        assert(!recursive_sux.holding_lock_update_or_lock());
+      }
+      assert(!critical);
+      recursive_sux.unlock_shared();
+    }
   }
 }
 
+static atomic_recursive_mutex<> recursive_m;
+static_assert(sizeof recursive_m == 8, "compactness");
+
+static void test_recursive_mutex()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    recursive_m.lock();
+    assert(recursive_m.holding_lock());
+    assert(!critical);
+    critical = true;
+    for (auto j = M_ROUNDS; j--; )
+    {
+      if (j & 1)
+        recursive_m.lock();
+      else if (!recursive_m.try_lock())
+        abort();
+    }
+    recursive_m.lock_recursive();
+    for (auto j = M_ROUNDS + 1; j--; )
+      recursive_m.unlock();
+    assert(critical);
+    critical = false;
+    recursive_m.unlock();
+
+    if (recursive_m.try_lock())
+    {
+      assert(!critical);
+      recursive_m.unlock();
+    }
+  }
+}
+
+static atomic_seqlock<> seqlock;
+/** Data that is protected by seqlock; both must always be equal */
+static std::atomic<unsigned> seq_a, seq_b;
+
+TRANSACTIONAL_TARGET static void test_seqlock()
+{
+  for (auto i = N_ROUNDS; i--; )
+  {
+    seqlock.lock();
+    seq_a.store(seq_a.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    seq_b.store(seq_b.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    seqlock.unlock();
+
+    for (auto j = M_ROUNDS; j--; )
+    {
+      unsigned a, b;
+      for (transactional_optimistic_lock_guard<typeof seqlock>
+             g{seqlock, j % 4}; ; )
+      {
+        a = seq_a.load(std::memory_order_relaxed);
+        b = seq_b.load(std::memory_order_relaxed);
+        if (g.validate())
+          break;
+      }
+      assert(a == b);
+    }
+
+    seqlock.lock_update();
+    seqlock.update_lock_upgrade();
+    seq_a.fetch_add(1, std::memory_order_relaxed);
+    seq_b.fetch_add(1, std::memory_order_relaxed);
+    seqlock.update_lock_downgrade();
+    seqlock.unlock_update();
+  }
+}
+
+static striped_lock_table<unsigned, atomic_spin_mutex<>, 16> table;
+
+TRANSACTIONAL_TARGET static void test_striped_lock_table()
+{
+  for (unsigned i = 0; i < N_ROUNDS * M_ROUNDS; i++)
+  {
+    {
+      transactional_lock_guard<atomic_spin_mutex<>> g{table.mutex_for(i)};
+      table.at(i)++;
+    }
+
+    /* Move one unit between two cells, possibly in the same slab */
+    const size_t from = i * 7, to = i * 13;
+    transactional_lock_many_guard<typeof table, 2> g{table, {from, to}};
+    table.at(from)--;
+    table.at(to)++;
+  }
+}
+
+static atomic_spin_mutex<> all_m[4];
+static atomic_spin_shared_mutex<> all_sux[4];
+/** protected by all_m[] and all_sux[] */
+static unsigned all_m_count[4], all_sux_count[4];
+
+TRANSACTIONAL_TARGET static void test_lock_all()
+{
+  for (unsigned i = 0; i < N_ROUNDS * M_ROUNDS / 10; i++)
+  {
+    /* Three mutexes in a varying order, possibly with duplicates */
+    const unsigned a = i % 4, b = i * 3 % 4, c = (i + 1) % 4;
+    /* a == b in even rounds; a != c and b != c in all rounds */
+    {
+      atomic_spin_mutex<> *m[] = {&all_m[a], &all_m[b], &all_m[c]};
+      const size_t n = lock_all(m);
+      assert(n == 2 + (a != b));
+      for (size_t j = 0; j < n; j++)
+        all_m_count[m[j] - all_m]++;
+      unlock_all(m, n);
+    }
+    {
+      transactional_lock_all_guard<atomic_spin_mutex<>, 3>
+        g{{&all_m[c], &all_m[b], &all_m[a]}};
+      all_m_count[a]++;
+      all_m_count[a]--;
+    }
+
+    atomic_spin_shared_mutex<> *s[] = {&all_sux[c], &all_sux[a], &all_sux[b]};
+    if (i & 2)
+    {
+      /* Update locks are mutually exclusive; no update_lock_upgrade(),
+      which would deadlock with lock_all_shared(). */
+      const size_t n = lock_all_update(s);
+      for (size_t j = 0; j < n; j++)
+        all_sux_count[s[j] - all_sux]++;
+      unlock_all_update(s, n);
+    }
+    else if (i & 1)
+    {
+      const size_t n = lock_all(s);
+      for (size_t j = 0; j < n; j++)
+        all_sux_count[s[j] - all_sux]++;
+      unlock_all(s, n);
+    }
+    else
+    {
+      const size_t n = lock_all_shared(s);
+      for (size_t j = 1; j < n; j++)
+        assert(s[j - 1] < s[j]);
+      unlock_all_shared(s, n);
+    }
+    transactional_shared_lock_all_guard<atomic_spin_shared_mutex<>, 2>
+      g{{&all_sux[b], &all_sux[a]}};
+    (void) all_sux_count[a];
+  }
+}
+
+/** a tagged counter that is modified while holding the lock */
+/** the state that is protected by flat_combining */
+struct combined_counters { unsigned sum, ops; };
+/** having fewer slots than threads will also cover slot sharing */
+static flat_combining<combined_counters, mutex_storage<>, 8> combining;
+
+TRANSACTIONAL_TARGET static void test_flat_combining()
+{
+  for (unsigned i = 0; i < N_ROUNDS * M_ROUNDS / 10; i++)
+  {
+    unsigned before = 0;
+    combining.apply([&](combined_counters &c){
+      before = c.sum;
+      c.sum += 1 + (i & 1);
+      c.ops++;
+    });
+    assert(before < N_THREADS * N_ROUNDS * M_ROUNDS / 10 * 2);
+    (void) before;
+  }
+}
+
+static atomic_spin_mutex<embedded_mutex_storage<uintptr_t>> embedded_m;
+/** a reference count that is modified without holding the lock */
+static atomic_spin_mutex<embedded_mutex_storage<uint32_t>> embedded_ref;
+/** protected by embedded_ref */
+static unsigned embedded_count;
+
+static void test_embedded_mutex()
+{
+  for (auto i = N_ROUNDS * M_ROUNDS / 10; i--; )
+  {
+    embedded_ref.get_storage().fetch_add(1);
+
+    if (i & 1)
+      embedded_m.lock();
+    else
+      while (!embedded_m.try_lock_for(std::chrono::microseconds(100)));
+    assert(!critical);
+    critical = true;
+    const uintptr_t p = embedded_m.get_storage().load();
+    embedded_m.get_storage().store(p + 1);
+    critical = false;
+    embedded_m.unlock();
+
+    embedded_ref.lock();
+    embedded_count++;
+    embedded_ref.unlock();
+
+    const uint32_t r = embedded_ref.get_storage().fetch_sub(1);
+    assert(r > 0);
+    (void) r;
+  }
+}
+
+#ifdef __linux__
+/** Locks and data in memory that is shared between processes */
+struct process_shared_locks
+{
+  atomic_mutex<mutex_storage<uint32_t, futex_scope::process_shared>> m;
+  atomic_shared_mutex<shared_mutex_storage
+                      <uint32_t, shared_mutex_policy::prefer_writer,
+                       mutex_storage<uint32_t, futex_scope::process_shared>>>
+  sux;
+  unsigned m_count, sux_count;
+};
+
+constexpr unsigned N_PROCESSES = 4;
+
+static void test_process_shared(process_shared_locks &l)
+{
+  for (auto i = N_ROUNDS * M_ROUNDS; i--; )
+  {
+    l.m.lock();
+    l.m_count++;
+    l.m.unlock();
+
+    l.sux.lock_shared();
+    assert(l.sux_count <= N_PROCESSES * N_ROUNDS * M_ROUNDS);
+    l.sux.unlock_shared();
+
+    l.sux.lock();
+    l.sux_count++;
+    l.sux.unlock();
+  }
+}
+#endif
+
+#ifdef __cpp_impl_coroutine
+/** A coroutine that starts immediately and is not awaited */
+struct detached_coroutine
+{
+  struct promise_type
+  {
+    detached_coroutine get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { abort(); }
+  };
+};
+
+/** An executor whose coroutines are resumed by run() */
+struct queue_executor
+{
+  atomic_mutex<> mutex;
+  std::vector<std::coroutine_handle<>> queue;
+
+  void post(std::coroutine_handle<> h) noexcept
+  {
+    mutex.lock();
+    queue.push_back(h);
+    mutex.unlock();
+  }
+  void run()
+  {
+    mutex.lock();
+    std::vector<std::coroutine_handle<>> q;
+    q.swap(queue);
+    mutex.unlock();
+    for (std::coroutine_handle<> h : q)
+      h.resume();
+  }
+};
+
+static atomic_mutex<async_mutex_storage<>> async_m;
+static atomic_shared_mutex<shared_mutex_storage
+<uint32_t, shared_mutex_policy::prefer_writer, async_mutex_storage<>>>
+  async_sux;
+static queue_executor async_queue;
+static std::atomic<unsigned> async_done;
+static bool async_m_critical, async_sux_critical;
+
+static detached_coroutine async_critical_sections(unsigned i)
+{
+  const async_executor e = make_async_executor(async_queue);
+  if (i & 3)
+    co_await async_m.async_lock(e);
+  else
+    co_await async_m.async_lock();
+  assert(!async_m_critical);
+  async_m_critical = true;
+  async_m_critical = false;
+  async_m.unlock();
+
+  co_await async_sux.async_lock_shared(e);
+  assert(!async_sux_critical);
+  async_sux.unlock_shared();
+
+  co_await async_sux.async_lock_update(e);
+  assert(!async_sux_critical);
+  async_sux.update_lock_upgrade();
+  async_sux_critical = true;
+  async_sux_critical = false;
+  async_sux.update_lock_downgrade();
+  async_sux.unlock_update();
+
+  co_await async_sux.async_lock(e);
+  assert(!async_sux_critical);
+  async_sux_critical = true;
+  async_sux_critical = false;
+  async_sux.unlock();
+
+  async_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void test_async_mutex()
+{
+  for (unsigned i = 0; i < N_ROUNDS * M_ROUNDS / 10; i++)
+  {
+    async_critical_sections(i);
+
+    /* Threads may wait for the same locks as coroutines */
+    async_m.lock();
+    assert(!async_m_critical);
+    async_m_critical = true;
+    /* Make coroutines of other threads wait */
+    std::this_thread::yield();
+    async_m_critical = false;
+    async_m.unlock();
+
+    async_sux.lock_shared();
+    assert(!async_sux_critical);
+    async_sux.unlock_shared();
+    async_sux.lock();
+    assert(!async_sux_critical);
+    async_sux_critical = true;
+    std::this_thread::yield();
+    async_sux_critical = false;
+    async_sux.unlock();
+  }
+}
+
+/** Resume the coroutines that were posted to async_queue. Threads that
+are blocked in lock() may be waiting for these coroutines; hence, the
+queue must not be run by them. */
+static void test_async_executor()
+{
+  while (async_done.load(std::memory_order_relaxed) <
+         N_THREADS * N_ROUNDS * M_ROUNDS / 10)
+  {
+    async_queue.run();
+    std::this_thread::yield();
+  }
+}
+#endif
+
+static atomic_mutex<> timed_m;
+static atomic_shared_mutex<> timed_sux;
+static bool timed_critical;
+static atomic_mutex<fair_mutex_storage<>> fair_m;
+static bool fair_critical;
+static bool reader_critical;
+static bool phase_critical;
+static bool sharded_critical;
+#ifdef __linux__
+static bool pi_critical;
+#endif
+
+static void test_timed_mutex()
+{
+  for (auto i = N_ROUNDS * 10; i--; )
+  {
+    const auto timeout = std::chrono::microseconds(i % 4 * 50);
+    if (timed_m.try_lock_for(timeout))
+    {
+      assert(!critical);
+      critical = true;
+      std::this_thread::yield();
+      critical = false;
+      timed_m.unlock();
+    }
+
+    fair_m.lock();
+    assert(!fair_critical);
+    fair_critical = true;
+    std::this_thread::yield();
+    fair_critical = false;
+    fair_m.unlock();
+
+    if (fair_m.try_lock_for(timeout))
+    {
+      assert(!fair_critical);
+      fair_critical = true;
+      fair_critical = false;
+      fair_m.unlock();
+    }
+
+    if (timed_sux.try_lock_until(std::chrono::steady_clock::now() + timeout))
+    {
+      assert(!timed_critical);
+      timed_critical = true;
+      std::this_thread::yield();
+      timed_critical = false;
+      timed_sux.unlock();
+    }
+
+    if (timed_sux.try_lock_shared_for(timeout))
+    {
+      assert(!timed_critical);
+      std::this_thread::yield();
+      timed_sux.unlock_shared();
+    }
+
+    if (timed_sux.try_lock_update_for(timeout))
+    {
+      assert(!timed_critical);
+      timed_sux.update_lock_upgrade();
+      timed_critical = true;
+      std::this_thread::yield();
+      timed_critical = false;
+      timed_sux.update_lock_downgrade();
+      timed_sux.unlock_update();
+    }
+
+    if (reader_sux.try_lock_for(timeout))
+    {
+      assert(!reader_critical);
+      reader_critical = true;
+      std::this_thread::yield();
+      reader_critical = false;
+      reader_sux.unlock();
+    }
+
+    if (reader_sux.try_lock_shared_for(timeout))
+    {
+      assert(!reader_critical);
+      reader_sux.unlock_shared();
+    }
+
+    if (sharded_sux.try_lock_for(timeout))
+    {
+      assert(!sharded_critical);
+      sharded_critical = true;
+      std::this_thread::yield();
+      sharded_critical = false;
+      sharded_sux.unlock();
+    }
+
+    if (sharded_sux.try_lock_shared_for(timeout))
+    {
+      assert(!sharded_critical);
+      sharded_sux.unlock_shared();
+    }
+
+    if (fair_sux.try_lock_for(timeout))
+    {
+      assert(!phase_critical);
+      phase_critical = true;
+      std::this_thread::yield();
+      phase_critical = false;
+      fair_sux.unlock();
+    }
+
+    if (fair_sux.try_lock_shared_for(timeout))
+    {
+      assert(!phase_critical);
+      fair_sux.unlock_shared();
+    }
+
+#ifdef __linux__
+    if (pi_m.try_lock_for(timeout))
+    {
+      assert(!pi_critical);
+      pi_critical = true;
+      std::this_thread::yield();
+      pi_critical = false;
+      pi_m.unlock();
+    }
+#endif
+  }
+}
+
+#ifdef WITH_LOCK_ORDER
+static atomic_mutex<> order_a, order_b, order_c, order_d;
+static atomic_shared_mutex<> order_sux;
+static atomic_condition_variable order_cv;
+/** number of reports, by lock_order_violation */
+static unsigned order_violations[3];
+
+static void count_violation(lock_order_violation v, const void *, const void *)
+{ order_violations[unsigned(v)]++; }
+
+static void test_lock_order()
+{
+  constexpr unsigned RANK = unsigned(lock_order_violation::rank);
+  constexpr unsigned INVERSION = unsigned(lock_order_violation::inversion);
+  constexpr unsigned SLEEP = unsigned(lock_order_violation::sleep);
+  /* Forgotten locks must not fill up the table of ranks. */
+  static uint32_t churn[1U << 17];
+  for (const uint32_t &c : churn)
+  {
+    lock_order_set_rank(&c, 1);
+    lock_order_forget(&c);
+  }
+
+  lock_order_set_handler(count_violation);
+  lock_order_set_sampling(1);
+  order_a.set_lock_rank(1);
+  order_sux.set_lock_rank(2);
+  order_b.set_lock_rank(3);
+
+  order_a.lock();
+  order_sux.lock();
+  order_b.lock();
+  order_b.unlock();
+  order_sux.unlock();
+  order_sux.lock_update();
+  order_sux.update_lock_upgrade();
+  order_sux.update_lock_downgrade();
+  order_sux.unlock_update();
+  order_a.unlock();
+  assert(!order_violations[RANK]);
+
+  order_b.lock();
+  order_sux.lock_shared();
+  order_sux.unlock_shared();
+  assert(order_violations[RANK]);
+  /* A try_lock() cannot deadlock. */
+  const unsigned ranked = order_violations[RANK];
+  bool locked = order_a.try_lock();
+  assert(locked);
+  order_a.unlock();
+  order_b.unlock();
+  assert(order_violations[RANK] == ranked);
+  (void) locked; (void) ranked;
+
+  /* The above also inverted the order of order_sux and order_b. */
+  const unsigned inverted = order_violations[INVERSION];
+  assert(inverted);
+  order_c.lock();
+  order_d.lock();
+  order_d.unlock();
+  order_c.unlock();
+  assert(order_violations[INVERSION] == inverted);
+  order_d.lock();
+  order_c.lock();
+  order_c.unlock();
+  assert(order_violations[INVERSION] == inverted + 1);
+  (void) inverted;
+
+  (void) order_cv.wait_for(order_d, std::chrono::microseconds(1));
+  assert(!order_violations[SLEEP]);
+  order_c.lock();
+  (void) order_cv.wait_for(order_d, std::chrono::microseconds(1));
+  assert(order_violations[SLEEP] == 1);
+  order_c.unlock();
+  order_d.unlock();
+
+  for (const atomic_mutex<> *m : {&order_a, &order_b, &order_c, &order_d})
+    lock_order_forget(&m->get_storage());
+  lock_order_forget(&order_sux.get_storage());
+  lock_order_set_sampling(64);
+  lock_order_set_handler(nullptr);
+}
+#endif
+
 TRANSACTIONAL_TARGET
 int main(int, char **)
 {
@@ -171,20 +826,121 @@ int main(int, char **)
 
   assert(!m.get_storage().is_locked_or_waiting());
   for (auto i = N_THREADS; i--; )
-    t[i]= std::thread(test_atomic_mutex);
+    t[i]= std::thread(test_atomic_mutex<typeof m>, std::ref(m));
   for (auto i = N_THREADS; i--; )
     t[i].join();
   assert(!m.get_storage().is_locked_or_waiting());
 
+  fputs(" (mcs", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof mcs_m>, std::ref(mcs_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!mcs_m.get_storage().is_locked_or_waiting());
+
+  fputs(", cohort", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof cohort_m>, std::ref(cohort_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!cohort_m.get_storage().is_locked_or_waiting());
+
+  fputs(", uint16_t", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof m16>, std::ref(m16));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m16.get_storage().is_locked_or_waiting());
+
+  fputs(", uint64_t", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof m64>, std::ref(m64));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m64.get_storage().is_locked_or_waiting());
+
+#ifdef __linux__
+  fputs(", pi", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof pi_m>, std::ref(pi_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!pi_m.get_storage().is_locked_or_waiting());
+
+  {
+    /* The child process of fork() must not keep using the TID that the
+    parent cached, or FUTEX_UNLOCK_PI would fail with EPERM. */
+    pi_m.lock();
+    pi_m.unlock();
+    const pid_t pid = fork();
+    if (!pid)
+    {
+      pi_m.lock();
+      std::thread waiter{[]() { pi_m.lock(); pi_m.unlock(); }};
+      while (pi_m.get_storage().is_locked_not_waiting())
+        std::this_thread::yield();
+      pi_m.unlock();
+      waiter.join();
+      _exit(pi_m.get_storage().is_locked_or_waiting());
+    }
+    int status;
+    assert(pid > 0);
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+  }
+#endif
+  fputs(")", stderr);
+
   fputs(", " ATOMIC_MUTEX_NAME(shared_mutex), stderr);
 
   assert(!sux.get_storage().is_locked_or_waiting());
   for (auto i = N_THREADS; i--; )
-    t[i]= std::thread(test_shared_mutex);
+    t[i]= std::thread(test_shared_mutex<typeof sux>, std::ref(sux));
   for (auto i = N_THREADS; i--; )
     t[i].join();
   assert(!sux.get_storage().is_locked_or_waiting());
 
+  fputs(" (prefer_writer", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof reader_sux>,
+                      std::ref(reader_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!reader_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", prefer_reader", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof fair_sux>, std::ref(fair_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!fair_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", phase_fair", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof sharded_sux>,
+                      std::ref(sharded_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sharded_sux.get_storage().is_locked_or_waiting());
+
+  fputs(", sharded", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof sux64>, std::ref(sux64));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!sux64.get_storage().is_locked_or_waiting());
+
+  fputs(", uint64_t)", stderr);
+
   fputs(", " ATOMIC_MUTEX_NAME(recursive_shared_mutex), stderr);
 
   recursive_sux.init();
@@ -194,6 +950,266 @@ int main(int, char **)
     t[i].join();
   recursive_sux.destroy();
 
+  fputs(", atomic_recursive_mutex", stderr);
+
+  recursive_m.init();
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_recursive_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  recursive_m.destroy();
+
+  fputs(", striped_lock_table", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_striped_lock_table);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  {
+    unsigned sum = 0;
+    for (size_t i = table.size(); i--; )
+    {
+      assert(!table.mutex_for(i).get_storage().is_locked_or_waiting());
+      sum += table.at(i);
+    }
+    assert(sum == N_THREADS * N_ROUNDS * M_ROUNDS);
+  }
+
+  fputs(", lock_all", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_lock_all);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  {
+    unsigned sum = 0, sux_sum = 0;
+    for (auto i = 4; i--; )
+    {
+      assert(!all_m[i].get_storage().is_locked_or_waiting());
+      assert(!all_sux[i].get_storage().is_locked_or_waiting());
+      sum += all_m_count[i];
+      sux_sum += all_sux_count[i];
+    }
+    /* Even rounds lock 2 distinct mutexes, odd rounds 3 */
+    unsigned expected = 0, sux_expected = 0;
+    for (unsigned i = 0; i < N_ROUNDS * M_ROUNDS / 10; i++)
+    {
+      expected += 2 + (i & 1);
+      sux_expected += i & 2 ? 2 + (i & 1) : 3 * (i & 1);
+    }
+    assert(sum == N_THREADS * expected);
+    assert(sux_sum == N_THREADS * sux_expected);
+    (void) sum; (void) sux_sum; (void) expected; (void) sux_expected;
+  }
+
+  fputs(", flat_combining", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_flat_combining);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!combining.get_mutex().get_storage().is_locked_or_waiting());
+  assert(combining.get().ops == N_THREADS * N_ROUNDS * M_ROUNDS / 10);
+  assert(combining.get().sum == N_THREADS * N_ROUNDS * M_ROUNDS / 20 * 3);
+
+  fputs(", embedded_mutex", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_embedded_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!embedded_m.get_storage().is_locked_or_waiting());
+  assert(!embedded_ref.get_storage().is_locked_or_waiting());
+  assert(embedded_m.get_storage().load() ==
+         N_THREADS * N_ROUNDS * M_ROUNDS / 10);
+  assert(embedded_count == N_THREADS * N_ROUNDS * M_ROUNDS / 10);
+  assert(!embedded_ref.get_storage().load());
+
+#ifdef __linux__
+  fputs(", process_shared", stderr);
+
+  {
+    /* Anonymous shared memory is zero-initialized, and so are the locks. */
+    void *mem = mmap(nullptr, sizeof(process_shared_locks),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                     -1, 0);
+    assert(mem != MAP_FAILED);
+    process_shared_locks &l = *static_cast<process_shared_locks*>(mem);
+    pid_t pid[N_PROCESSES];
+    for (auto i = N_PROCESSES; i--; )
+      if (!(pid[i] = fork()))
+      {
+        test_process_shared(l);
+        _exit(0);
+      }
+    for (auto i = N_PROCESSES; i--; )
+    {
+      int status;
+      assert(pid[i] > 0);
+      waitpid(pid[i], &status, 0);
+      assert(WIFEXITED(status) && !WEXITSTATUS(status));
+    }
+    assert(!l.m.get_storage().is_locked_or_waiting());
+    assert(!l.sux.get_storage().is_locked_or_waiting());
+    assert(l.m_count == N_PROCESSES * N_ROUNDS * M_ROUNDS);
+    assert(l.sux_count == N_PROCESSES * N_ROUNDS * M_ROUNDS);
+
+    /* A process-shared mutex refuses to requeue, but it must still
+    count the waiter that will invoke lock_requeued(). */
+    std::atomic<uint32_t> word{0};
+    l.m.lock();
+    assert(!l.m.requeue(word, 0, 1));
+    l.m.unlock();
+    l.m.lock_requeued();
+    l.m.unlock();
+    assert(!l.m.get_storage().is_locked_or_waiting());
+    munmap(mem, sizeof l);
+  }
+#endif
+
+#ifdef __cpp_impl_coroutine
+  fputs(", async_mutex", stderr);
+
+  {
+    std::thread executor(test_async_executor);
+    for (auto i = N_THREADS; i--; )
+      t[i]= std::thread(test_async_mutex);
+    for (auto i = N_THREADS; i--; )
+      t[i].join();
+    executor.join();
+  }
+  assert(!async_m.get_storage().is_locked_or_waiting());
+  assert(!async_sux.get_storage().is_locked_or_waiting());
+#endif
+
+  fputs(", atomic_seqlock", stderr);
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_seqlock);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!seqlock.get_storage().is_locked_or_waiting());
+  assert(seq_a == N_THREADS * N_ROUNDS * 2);
+  assert(seq_a == seq_b);
+
+  fputs(", profiled", stderr);
+
+  mutex_profile_label(&profiled_m.get_storage(), "profiled_m");
+  mutex_profile_label(&profiled_sux.get_storage(), "profiled_sux");
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_atomic_mutex<typeof profiled_m>,
+                      std::ref(profiled_m));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_shared_mutex<typeof profiled_sux>,
+                      std::ref(profiled_sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!profiled_m.get_storage().is_locked_or_waiting());
+  assert(!profiled_sux.get_storage().is_locked_or_waiting());
+  {
+    const mutex_stats ms = profiled_stats(&profiled_m.get_storage());
+    const mutex_stats ss = profiled_stats(&profiled_sux.get_storage());
+    assert(ms.contended <= ms.acquired);
+    assert(ms.spun + ms.slept == ms.contended);
+    assert(!ss.timeouts);
+#ifdef WITH_ELISION
+    if (!have_transactional_memory)
+#endif
+    {
+      assert(ms.acquired == N_THREADS * N_ROUNDS * M_ROUNDS);
+      /* Each successful try_lock_shared_upgrade() acquires outer. */
+      assert(ss.acquired >= N_THREADS * N_ROUNDS * (1 + 3 * M_ROUNDS));
+      assert(ss.acquired <=
+             N_THREADS * N_ROUNDS * (1 + 3 * M_ROUNDS + M_ROUNDS / 2));
+    }
+    (void) ms; (void) ss;
+  }
+  {
+    /* A try_lock_for() that acquires outer but times out waiting for
+    a shared lock is a single timeout, and not an acquisition. */
+    static atomic_shared_mutex<profiled_shared_mutex_storage<>> timed_sux;
+    timed_sux.lock_shared();
+    assert(!timed_sux.try_lock_for(std::chrono::milliseconds(1)));
+    timed_sux.unlock_shared();
+    assert(timed_sux.try_lock_for(std::chrono::milliseconds(1)));
+    timed_sux.unlock();
+    const mutex_stats s = profiled_stats(&timed_sux.get_storage());
+    assert(s.acquired == 2);
+    assert(s.timeouts == 1);
+    (void) s;
+  }
+
+  fputs(", transactional_elision", stderr);
+
+  {
+    /* The policy, independent of the availability of transactional memory */
+    transactional_elision e{};
+    assert(e.is_enabled());
+    e.aborted(XABORT_CAPACITY);
+    assert(e.aborts(transactional_elision::CAPACITY) == 1);
+    for (auto i = transactional_elision::MIN_SKIP; i--; )
+      assert(!e.should_elide());
+    assert(e.should_elide());
+    e.aborted(XABORT_EXPLICIT);
+    for (auto i = 2 * transactional_elision::MIN_SKIP; i--; )
+      assert(!e.should_elide());
+    assert(e.should_elide());
+    e.committed();
+    e.aborted(XABORT_CONFLICT | XABORT_RETRY);
+    e.aborted(XABORT_CONFLICT | XABORT_RETRY);
+    for (auto i = transactional_elision::MIN_SKIP; i--; )
+      assert(!e.should_elide());
+    assert(e.is_enabled());
+    assert(e.skipped() == 4 * transactional_elision::MIN_SKIP);
+    assert(e.aborts(transactional_elision::CONFLICT) == 2);
+
+    /* Retries of transient aborts, and of aborts due to a held lock */
+    bool busy = false;
+    auto is_busy = [&busy]{ return busy; };
+    assert(e.may_retry(XABORT_CONFLICT | XABORT_RETRY, is_busy));
+    assert(e.may_retry(XABORT_EXPLICIT, is_busy));
+    assert(!e.may_retry(XABORT_CAPACITY | XABORT_RETRY, is_busy));
+    assert(!e.may_retry(0, is_busy));
+    busy = true;
+    assert(!e.may_retry(XABORT_EXPLICIT, is_busy));
+    assert(e.retried() == 2);
+
+    /* An elided try_upgrade() falls back to the lock without penalty */
+    busy = false;
+    assert(!e.may_retry(XABORT_EXPLICIT | XABORT_UPGRADE, is_busy));
+    e.aborted(XABORT_EXPLICIT | XABORT_UPGRADE);
+    assert(e.is_enabled());
+    assert(e.retried() == 2);
+  }
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_transactional_elision);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!m.get_storage().is_locked_or_waiting());
+#ifdef WITH_ELISION
+  if (!have_transactional_memory)
+#endif
+    assert(!elision.skipped());
+
+  for (auto i = N_THREADS; i--; )
+    t[i]= std::thread(test_timed_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  assert(!timed_m.get_storage().is_locked_or_waiting());
+  assert(!timed_sux.get_storage().is_locked_or_waiting());
+  assert(!fair_m.get_storage().is_locked_or_waiting());
+  assert(!reader_sux.get_storage().is_locked_or_waiting());
+  assert(!fair_sux.get_storage().is_locked_or_waiting());
+  assert(!sharded_sux.get_storage().is_locked_or_waiting());
+
+#ifdef WITH_LOCK_ORDER
+  fputs(", lock_order", stderr);
+  test_lock_order();
+#endif
+
   fputs(".\n", stderr);
 
   return 0;
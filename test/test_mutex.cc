@@ -49,6 +49,67 @@ static void test_atomic_spin_mutex()
 }
 #endif
 
+/** Like atomic_mutex, but with an adaptive spinloop in lock() */
+template<typename storage = mutex_storage<>>
+class atomic_adaptive_mutex : public atomic_mutex<storage>
+{
+  adaptive_spin_rounds spin;
+public:
+  void lock() noexcept { atomic_mutex<storage>::spin_lock(spin); }
+};
+
+static atomic_adaptive_mutex<> a_am;
+
+static void test_atomic_adaptive_mutex()
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    std::lock_guard<atomic_adaptive_mutex<>> g{a_am};
+    assert(!critical);
+    critical = true;
+    critical = false;
+  }
+}
+
+static atomic_mutex<fair_mutex_storage<>> a_fm;
+
+static void test_atomic_fair_mutex()
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    std::lock_guard<atomic_mutex<fair_mutex_storage<>>> g{a_fm};
+    assert(!critical);
+    critical = true;
+    critical = false;
+  }
+}
+
+static atomic_mutex<mcs_mutex_storage> a_mcs;
+
+static void test_atomic_mcs_mutex()
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    std::lock_guard<atomic_mutex<mcs_mutex_storage>> g{a_mcs};
+    assert(!critical);
+    critical = true;
+    critical = false;
+  }
+}
+
+static atomic_mutex<cohort_mutex_storage<>> a_cm;
+
+static void test_atomic_cohort_mutex()
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    std::lock_guard<atomic_mutex<cohort_mutex_storage<>>> g{a_cm};
+    assert(!critical);
+    critical = true;
+    critical = false;
+  }
+}
+
 static std::mutex m;
 
 static void test_mutex()
@@ -98,6 +159,34 @@ int main(int argc, char **argv)
   for (auto i = N_THREADS; i--; )
     t[i].join();
 #endif
+  const auto start_atomic_adaptive_mutex = std::chrono::steady_clock::now();
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_adaptive_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  const auto start_atomic_fair_mutex = std::chrono::steady_clock::now();
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_fair_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  const auto start_atomic_mcs_mutex = std::chrono::steady_clock::now();
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_mcs_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
+  const auto start_atomic_cohort_mutex = std::chrono::steady_clock::now();
+
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_atomic_cohort_mutex);
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+
   const auto start_mutex = std::chrono::steady_clock::now();
 
   for (auto i = N_THREADS; i--; )
@@ -108,13 +197,31 @@ int main(int argc, char **argv)
   const auto start_output = std::chrono::steady_clock::now();
   using duration = std::chrono::duration<double>;
 #if defined WITH_SPINLOOP && defined SPINLOOP
-  fprintf(stderr, "atomic_mutex: %lfs, atomic_spin_mutex: %lfs, mutex: %lfs\n",
+  fprintf(stderr, "atomic_mutex: %lfs, atomic_spin_mutex: %lfs, "
+          "atomic_adaptive_mutex: %lfs, atomic_fair_mutex: %lfs, "
+          "atomic_mcs_mutex: %lfs, atomic_cohort_mutex: %lfs, "
+          "mutex: %lfs\n",
           duration{start_atomic_spin_mutex - start_atomic_mutex}.count(),
-          duration{start_mutex - start_atomic_spin_mutex}.count(),
+          duration{start_atomic_adaptive_mutex -
+                   start_atomic_spin_mutex}.count(),
+          duration{start_atomic_fair_mutex -
+                   start_atomic_adaptive_mutex}.count(),
+          duration{start_atomic_mcs_mutex - start_atomic_fair_mutex}.count(),
+          duration{start_atomic_cohort_mutex -
+                   start_atomic_mcs_mutex}.count(),
+          duration{start_mutex - start_atomic_cohort_mutex}.count(),
           duration{start_output - start_mutex}.count());
 #else
-  fprintf(stderr, "atomic_mutex: %lfs, mutex: %lfs\n",
-          duration{start_mutex - start_atomic_mutex}.count(),
+  fprintf(stderr, "atomic_mutex: %lfs, atomic_adaptive_mutex: %lfs, "
+          "atomic_fair_mutex: %lfs, atomic_mcs_mutex: %lfs, "
+          "atomic_cohort_mutex: %lfs, mutex: %lfs\n",
+          duration{start_atomic_adaptive_mutex - start_atomic_mutex}.count(),
+          duration{start_atomic_fair_mutex -
+                   start_atomic_adaptive_mutex}.count(),
+          duration{start_atomic_mcs_mutex - start_atomic_fair_mutex}.count(),
+          duration{start_atomic_cohort_mutex -
+                   start_atomic_mcs_mutex}.count(),
+          duration{start_mutex - start_atomic_cohort_mutex}.count(),
           duration{start_output - start_mutex}.count());
 #endif
 
@@ -6,60 +6,7 @@
 #include <chrono>
 #include <mutex>
 
-#include "atomic_mutex.h"
-
-#ifndef _WIN32
-# include <pthread.h>
-
-class native_mutex_storage
-{
-  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-
-public:
-  /** Try to acquire a mutex
-  @return whether the mutex was acquired */
-  bool lock_impl() noexcept
-  {
-    return pthread_mutex_trylock(&mutex) == 0;
-  }
-  void lock_wait() noexcept { pthread_mutex_lock(&mutex); }
-  void spin_lock_wait(unsigned spin_rounds) noexcept; // not defined
-
-  /** Release a mutex
-  @return whether the lock is being waited for */
-  bool unlock_impl() noexcept
-  {
-    pthread_mutex_unlock(&mutex);
-    return false;
-  }
-  /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept {}
-};
-#else
-# include <synchapi.h>
-
-class native_mutex_storage
-{
-  SRWLOCK mutex = SRWLOCK_INIT;
-
-public:
-  /** Try to acquire a mutex
-  @return whether the mutex was acquired */
-  bool lock_impl() noexcept { return TryAcquireSRWLockExclusive(&mutex); }
-  void lock_wait() noexcept { AcquireSRWLockExclusive(&mutex); }
-  void spin_lock_wait(unsigned spin_rounds) noexcept; // not defined
-
-  /** Release a mutex
-  @return whether the lock is being waited for */
-  bool unlock_impl() noexcept
-  {
-    ReleaseSRWLockExclusive(&mutex);
-    return false;
-  }
-  /** Notify waiters after unlock_impl() returned true */
-  void unlock_notify() noexcept {}
-};
-#endif
+#include "native_mutex_storage.h"
 
 static bool critical;
 
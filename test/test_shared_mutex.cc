@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <functional>
+#include <cassert>
+#include <vector>
+#include <chrono>
+
+#if __cplusplus >= 201703L
+# include <shared_mutex>
+#endif
+#include "atomic_shared_mutex.h"
+
+static bool critical;
+
+static unsigned long N_THREADS;
+static unsigned long N_ROUNDS;
+/** one out of this many operations will be exclusive */
+constexpr unsigned long WRITE_RATIO = 16;
+
+template<shared_mutex_policy policy>
+using atomic_policy_shared_mutex =
+  atomic_shared_mutex<shared_mutex_storage<uint32_t, policy>>;
+
+static atomic_policy_shared_mutex<shared_mutex_policy::prefer_writer> w_sux;
+static atomic_policy_shared_mutex<shared_mutex_policy::prefer_reader> r_sux;
+static atomic_policy_shared_mutex<shared_mutex_policy::phase_fair> pf_sux;
+static atomic_shared_mutex<sharded_shared_mutex_storage<>> sh_sux;
+#if __cplusplus >= 201703L
+static std::shared_mutex sux;
+#endif
+
+template<class shared_mutex>
+static void test_shared_mutex(shared_mutex &sux)
+{
+  for (auto i = N_ROUNDS; i; i--)
+  {
+    if (i % WRITE_RATIO)
+    {
+      sux.lock_shared();
+      assert(!critical);
+      sux.unlock_shared();
+    }
+    else
+    {
+      sux.lock();
+      assert(!critical);
+      critical = true;
+      critical = false;
+      sux.unlock();
+    }
+  }
+}
+
+template<class shared_mutex>
+static double run(std::vector<std::thread> &t, shared_mutex &sux)
+{
+  const auto start = std::chrono::steady_clock::now();
+  for (auto i = N_THREADS; i--; )
+    t[i] = std::thread(test_shared_mutex<shared_mutex>, std::ref(sux));
+  for (auto i = N_THREADS; i--; )
+    t[i].join();
+  return std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3)
+  {
+  usage:
+    fprintf(stderr, "usage: %s N_THREADS N_ROUNDS\n", *argv);
+    return 1;
+  }
+  else
+  {
+    char *endp;
+    N_THREADS = strtoul(argv[1], &endp, 0);
+    if (endp == argv[1] || *endp)
+      goto usage;
+    N_ROUNDS = strtoul(argv[2], &endp, 0);
+    if (endp == argv[2] || *endp)
+      goto usage;
+  }
+
+  std::vector<std::thread> t(N_THREADS);
+
+  const double w = run(t, w_sux);
+  assert(!w_sux.get_storage().is_locked_or_waiting());
+  const double r = run(t, r_sux);
+  assert(!r_sux.get_storage().is_locked_or_waiting());
+  const double pf = run(t, pf_sux);
+  assert(!pf_sux.get_storage().is_locked_or_waiting());
+  const double sh = run(t, sh_sux);
+  assert(!sh_sux.get_storage().is_locked_or_waiting());
+
+#if __cplusplus >= 201703L
+  fprintf(stderr, "prefer_writer: %lfs, prefer_reader: %lfs, "
+          "phase_fair: %lfs, sharded: %lfs, shared_mutex: %lfs\n",
+          w, r, pf, sh, run(t, sux));
+#else
+  fprintf(stderr, "prefer_writer: %lfs, prefer_reader: %lfs, "
+          "phase_fair: %lfs, sharded: %lfs\n", w, r, pf, sh);
+#endif
+
+  return 0;
+}